@@ -0,0 +1,303 @@
+#define ASSET_QUEUED   0 // waiting for its turn
+#define ASSET_COUNTING 1 // first pass: counting the vertices, normals and faces
+#define ASSET_PARSING  2 // second pass: reading them into the mesh
+#define ASSET_READY    3 // parsed, waiting for registerLoadedMeshes()
+#define ASSET_LOADED   4 // in the triangle pool, the mesh belongs to the caller now
+#define ASSET_FAILED   5
+
+#define MAX_ACTIVE_ASSETS 4 // files read at the same time, the rest wait in the queue
+
+typedef struct AssetRequestStruct
+{
+    char *fileName;
+    short state;
+    FILE *file;
+    MeshFile info;
+    Mesh *mesh;
+    int vertexNum;
+    int normalNum;
+    int faceNum;
+}AssetRequest;
+
+typedef struct AssetLoaderStruct
+{
+    int requestCount;
+    int requestCapacity;
+    AssetRequest *requests; // indexed by mesh handle
+
+    int lineBudget; // lines read per step, shared by the active requests
+}AssetLoader;
+
+AssetLoader *newAssetLoader(int lineBudget);
+int requestMeshLoad(AssetLoader *al, char fileName[256]);
+int stepAssetLoader(AssetLoader *al);
+int stepAssetRequest(AssetRequest *request, int lineBudget);
+int finishAssetRequest(AssetRequest *request, char errorMsg[256]);
+int registerLoadedMeshes(AssetLoader *al, TrianglePool *tp);
+short getMeshLoadState(AssetLoader *al, int handle);
+Mesh *getLoadedMesh(AssetLoader *al, int handle);
+void destroyAssetLoader(AssetLoader *al);
+
+AssetLoader *newAssetLoader(int lineBudget)
+{
+    AssetLoader *ptr = NULL;
+
+    if (lineBudget <= 0) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    ptr->requestCapacity = 16;
+    ptr->requests = malloc(sizeof *(ptr->requests) * ptr->requestCapacity);
+
+    if (!ptr->requests)
+    {
+        free(ptr);
+        return NULL;
+    }
+
+    ptr->requestCount = 0;
+    ptr->lineBudget = lineBudget;
+
+    return ptr;
+}
+
+int requestMeshLoad(AssetLoader *al, char fileName[256])
+{
+    AssetRequest *requests, *request;
+
+    if (!al) return -1;
+
+    if (al->requestCount == al->requestCapacity)
+    {
+        if (!(requests = realloc(al->requests, sizeof *requests * 2 * al->requestCapacity)))
+            return -2;
+
+        al->requests = requests;
+        al->requestCapacity *= 2;
+    }
+
+    request = &al->requests[al->requestCount];
+
+    if (!(request->fileName = malloc(strlen(fileName) + 1))) return -2;
+
+    // nothing is read yet, the file is opened when the request becomes active
+    strcpy(request->fileName, fileName);
+    request->state = ASSET_QUEUED;
+    request->file = NULL;
+    request->mesh = NULL;
+    request->vertexNum = request->normalNum = request->faceNum = 0;
+    request->info.vertexCount = request->info.normalCount = request->info.faceCount = 0;
+
+    return al->requestCount++;
+}
+
+int stepAssetLoader(AssetLoader *al)
+{
+    int i, slots, budget, loading = 0;
+
+    if (!al) return -1;
+
+    for (i = 0; i < al->requestCount; i++)
+    {
+        if (al->requests[i].state <= ASSET_PARSING)
+            loading++;
+    }
+
+    if (!loading) return 0;
+
+    // the first MAX_ACTIVE_ASSETS unfinished requests are read interleaved,
+    // each getting an equal share of the line budget, so that a big file
+    // doesn't hold back the small ones queued after it
+    slots = min(loading, MAX_ACTIVE_ASSETS);
+    budget = max(1, al->lineBudget / slots);
+
+    for (i = 0; i < al->requestCount && slots > 0; i++)
+    {
+        if (al->requests[i].state > ASSET_PARSING) continue;
+
+        if (stepAssetRequest(&al->requests[i], budget) <= 0)
+            loading--;
+
+        slots--;
+    }
+
+    return loading;
+}
+
+int stepAssetRequest(AssetRequest *request, int lineBudget)
+{
+    int lines = 0;
+    char line[256] = "", errorMsg[256] = "";
+    Vector3 vec;
+    Face face;
+
+    if (request->state == ASSET_QUEUED)
+    {
+        if (!(request->file = fopen(request->fileName, "r")))
+        {
+            request->state = ASSET_FAILED;
+            sprintf(errorMsg, "Failed: Couldn't open file %s.", request->fileName);
+            DEBUG_MSG_FROM(errorMsg, "stepAssetRequest");
+            return -1;
+        }
+
+        request->state = ASSET_COUNTING;
+    }
+
+    // the same two passes as getMeshFileInfo() and readMeshFromFile(),
+    // split into steps of at most lineBudget lines
+    while (lines < lineBudget)
+    {
+        if (!fgets(line, sizeof line, request->file))
+        {
+            if (request->state == ASSET_PARSING)
+                return finishAssetRequest(request, errorMsg);
+
+            if (!request->info.vertexCount ||
+                !(request->mesh = newMesh(request->fileName, request->info.vertexCount,
+                                          request->info.faceCount, request->info.normalCount)))
+            {
+                sprintf(errorMsg, "Failed: File %s has no vertices or allocation failed.", request->fileName);
+                break;
+            }
+
+            rewind(request->file);
+            request->state = ASSET_PARSING;
+            continue;
+        }
+
+        lines++;
+
+        if (request->state == ASSET_COUNTING)
+        {
+            if (line[0] == 'v' && line[1] == ' ')      // this line is a vertex
+                request->info.vertexCount++;
+            else if (line[0] == 'v' && line[1] == 'n') // this line is a normal
+                request->info.normalCount++;
+            else if (line[0] == 'f' && line[1] == ' ') // this line is a face
+                request->info.faceCount++;
+        }
+        else if (line[0] == 'v' && line[1] == ' ')
+        {
+            if (sscanf(line, "%*s %f %f %f", &vec.x, &vec.y, &vec.z) != 4)
+            {
+                sprintf(errorMsg, "Failed: Parsing vertex %d from file %s failed.", request->vertexNum, request->fileName);
+                break;
+            }
+
+            setMeshVertex(request->mesh, request->vertexNum++, vec);
+        }
+        else if (line[0] == 'v' && line[1] == 'n')
+        {
+            if (sscanf(line, "%*s %f %f %f", &vec.x, &vec.y, &vec.z) != 4)
+            {
+                sprintf(errorMsg, "Failed: Parsing normal %d from file %s failed.", request->normalNum, request->fileName);
+                break;
+            }
+
+            setMeshNormal(request->mesh, request->normalNum++, vec);
+        }
+        else if (line[0] == 'f' && line[1] == ' ')
+        {
+            if (!parseFaceLine(line, &face))
+            {
+                sprintf(errorMsg, "Failed: Parsing face %d from file %s failed.", request->faceNum, request->fileName);
+                break;
+            }
+
+            setMeshFace(request->mesh, request->faceNum++, face);
+        }
+    }
+
+    if (errorMsg[0])
+        return finishAssetRequest(request, errorMsg);
+
+    return 1;
+}
+
+int finishAssetRequest(AssetRequest *request, char errorMsg[256])
+{
+    fclose(request->file);
+    request->file = NULL;
+
+    // faces without a normal in the file get one generated from their vertices
+    if (!errorMsg[0] && generateMeshNormals(request->mesh, MESH_NORMALS_FROM_FILE) < 0)
+        sprintf(errorMsg, "Failed: Generating normals for file %s failed.", request->fileName);
+
+    if (errorMsg[0])
+    {
+        destroyMesh(request->mesh);
+        request->mesh = NULL;
+        request->state = ASSET_FAILED;
+        DEBUG_MSG_FROM(errorMsg, "finishAssetRequest");
+        return -2;
+    }
+
+    request->state = ASSET_READY;
+
+    return 0;
+}
+
+int registerLoadedMeshes(AssetLoader *al, TrianglePool *tp)
+{
+    int i, registered = 0;
+
+    if (!al || !tp) return -1;
+
+    // meant to be called between frames, when the pool isn't being
+    // rendered or sorted, so new triangles appear on a frame boundary
+    for (i = 0; i < al->requestCount; i++)
+    {
+        if (al->requests[i].state != ASSET_READY) continue;
+
+        if (tp->triCount + al->requests[i].mesh->faceCount > tp->maxTriCount)
+        {
+            DEBUG_MSG_FROM("Failed: The triangle pool is full.", "registerLoadedMeshes");
+            continue;
+        }
+
+        addMeshFacesToPool(tp, al->requests[i].mesh);
+        al->requests[i].state = ASSET_LOADED;
+        registered++;
+    }
+
+    return registered;
+}
+
+short getMeshLoadState(AssetLoader *al, int handle)
+{
+    if (!al || handle < 0 || handle >= al->requestCount) return ASSET_FAILED;
+
+    return al->requests[handle].state;
+}
+
+Mesh *getLoadedMesh(AssetLoader *al, int handle)
+{
+    if (getMeshLoadState(al, handle) != ASSET_LOADED) return NULL;
+
+    return al->requests[handle].mesh;
+}
+
+void destroyAssetLoader(AssetLoader *al)
+{
+    int i;
+
+    if (!al) return;
+
+    for (i = 0; i < al->requestCount; i++)
+    {
+        if (al->requests[i].file)
+            fclose(al->requests[i].file);
+
+        // meshes that made it into the pool are the caller's to destroy
+        if (al->requests[i].state != ASSET_LOADED)
+            destroyMesh(al->requests[i].mesh);
+
+        free(al->requests[i].fileName);
+    }
+
+    free(al->requests);
+    free(al);
+}
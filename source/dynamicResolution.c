@@ -0,0 +1,236 @@
+#define UPSCALE_NEAREST  0
+#define UPSCALE_BILINEAR 1
+
+#define DYNAMIC_RESOLUTION_DEAD_BAND 0.05f // frame times this close to the target leave the scale as it is
+
+typedef struct DynamicResolutionStruct
+{
+    Screen output;         // size of the upscaled frame
+    Screen render;         // size the current frame is rendered at
+    FrameBuffer *internal; // allocated at the output size, its width and height are set to the render size
+    FrameBuffer *upscaled; // the output sized frame, ready for presenting
+
+    float scale;          // render size relative to the output size, per axis
+    float minScale;
+    float maxScale;
+    float maxStep;        // largest change of the scale per frame
+    float targetTime;     // frame time budget, in milliseconds
+    float smoothedTime;   // exponential moving average of the measured frame times
+    float smoothing;      // weight of the newest frame time in the average, 0 - 1
+    short filter;
+
+    // source column and row of every output pixel, with the weight of the next
+    // one in 1/256ths, recomputed only when the render size changes
+    int *columns;
+    int *rows;
+    unsigned char *columnWeights;
+    unsigned char *rowWeights;
+    short tableWidth;
+    short tableHeight;
+}DynamicResolution;
+
+DynamicResolution *newDynamicResolution(short width, short height, float targetTime, float minScale);
+FrameBuffer *beginDynamicResolutionFrame(DynamicResolution *dr);
+void updateDynamicResolution(DynamicResolution *dr, float frameTime);
+void updateUpscaleTables(DynamicResolution *dr);
+FrameBuffer *upscaleDynamicResolution(DynamicResolution *dr);
+void upscaleNearest(DynamicResolution *dr);
+void upscaleBilinear(DynamicResolution *dr);
+void destroyDynamicResolution(DynamicResolution *dr);
+
+DynamicResolution *newDynamicResolution(short width, short height, float targetTime, float minScale)
+{
+    DynamicResolution *ptr = NULL;
+
+    if (width <= 0 || height <= 0 || targetTime <= 0.0f) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    ptr->internal = newFrameBuffer(width, height);
+    ptr->upscaled = newFrameBuffer(width, height);
+    ptr->columns = malloc(sizeof *(ptr->columns) * width);
+    ptr->rows = malloc(sizeof *(ptr->rows) * height);
+    ptr->columnWeights = malloc(width);
+    ptr->rowWeights = malloc(height);
+
+    if (!ptr->internal || !ptr->upscaled || !ptr->columns || !ptr->rows ||
+        !ptr->columnWeights || !ptr->rowWeights)
+    {
+        destroyDynamicResolution(ptr);
+        return NULL;
+    }
+
+    ptr->output = createScreen(width, height);
+    ptr->render = ptr->output;
+    ptr->scale = 1.0f;
+    ptr->minScale = max(0.1f, min(1.0f, minScale));
+    ptr->maxScale = 1.0f;
+    ptr->maxStep = 0.05f;
+    ptr->targetTime = targetTime;
+    ptr->smoothedTime = targetTime;
+    ptr->smoothing = 0.2f;
+    ptr->filter = UPSCALE_BILINEAR;
+    ptr->tableWidth = ptr->tableHeight = 0;
+
+    return ptr;
+}
+
+FrameBuffer *beginDynamicResolutionFrame(DynamicResolution *dr)
+{
+    if (!dr) return NULL;
+
+    dr->render = createScreen(max(1, floor(dr->output.width * dr->scale + 0.5f)),
+                              max(1, floor(dr->output.height * dr->scale + 0.5f)));
+
+    // rows are packed by the current width, so the smaller frame uses
+    // the start of the same memory and nothing is reallocated
+    dr->internal->width = dr->render.width;
+    dr->internal->height = dr->render.height;
+
+    return dr->internal;
+}
+
+void updateDynamicResolution(DynamicResolution *dr, float frameTime)
+{
+    float wanted;
+
+    if (!dr || frameTime <= 0.0f) return;
+
+    dr->smoothedTime += (frameTime - dr->smoothedTime) * dr->smoothing;
+
+    if (abs(dr->smoothedTime - dr->targetTime) <= dr->targetTime * DYNAMIC_RESOLUTION_DEAD_BAND)
+        return;
+
+    // the cost follows the pixel count, which goes with the square of the scale
+    wanted = dr->scale * sqrt(dr->targetTime / dr->smoothedTime);
+    wanted = max(dr->scale - dr->maxStep, min(dr->scale + dr->maxStep, wanted));
+    dr->scale = max(dr->minScale, min(dr->maxScale, wanted));
+}
+
+void updateUpscaleTables(DynamicResolution *dr)
+{
+    int i;
+    float pos, stepX, stepY;
+
+    if (dr->tableWidth == dr->render.width && dr->tableHeight == dr->render.height) return;
+
+    stepX = dr->render.width / (float)dr->output.width;
+    stepY = dr->render.height / (float)dr->output.height;
+
+    // output pixel centers are mapped to the render buffer, and the
+    // samples are clamped so the edge pixels don't read past the frame
+    for (i = 0; i < dr->output.width; i++)
+    {
+        pos = max(0.0f, min(dr->render.width - 1.0f, (i + 0.5f) * stepX - 0.5f));
+        dr->columns[i] = floor(pos);
+        dr->columnWeights[i] = floor((pos - dr->columns[i]) * 256.0f);
+
+        if (dr->columns[i] >= dr->render.width - 1) dr->columnWeights[i] = 0;
+    }
+
+    for (i = 0; i < dr->output.height; i++)
+    {
+        pos = max(0.0f, min(dr->render.height - 1.0f, (i + 0.5f) * stepY - 0.5f));
+        dr->rows[i] = floor(pos);
+        dr->rowWeights[i] = floor((pos - dr->rows[i]) * 256.0f);
+
+        if (dr->rows[i] >= dr->render.height - 1) dr->rowWeights[i] = 0;
+    }
+
+    dr->tableWidth = dr->render.width;
+    dr->tableHeight = dr->render.height;
+}
+
+FrameBuffer *upscaleDynamicResolution(DynamicResolution *dr)
+{
+    if (!dr) return NULL;
+
+    updateUpscaleTables(dr);
+
+    if (dr->filter == UPSCALE_BILINEAR && dr->scale < 1.0f)
+        upscaleBilinear(dr);
+    else
+        upscaleNearest(dr);
+
+    return dr->upscaled;
+}
+
+void upscaleNearest(DynamicResolution *dr)
+{
+    int x, y, previousRow = -1, rowBytes = 3 * dr->output.width;
+    unsigned char *src, *dst, *p;
+
+    for (y = 0; y < dr->output.height; y++)
+    {
+        dst = &dr->upscaled->pixels[y * rowBytes];
+
+        // rounding the bilinear position gives the nearest pixel, and
+        // an output row showing the same source row as the last is copied
+        if (dr->rows[y] + (dr->rowWeights[y] >= 128) == previousRow)
+        {
+            memcpy(dst, dst - rowBytes, rowBytes);
+            continue;
+        }
+
+        previousRow = dr->rows[y] + (dr->rowWeights[y] >= 128);
+        src = &dr->internal->pixels[3 * previousRow * dr->render.width];
+
+        for (x = 0; x < dr->output.width; x++)
+        {
+            p = &src[3 * (dr->columns[x] + (dr->columnWeights[x] >= 128))];
+            *dst++ = p[0];
+            *dst++ = p[1];
+            *dst++ = p[2];
+        }
+    }
+}
+
+void upscaleBilinear(DynamicResolution *dr)
+{
+    int x, y, c, wx, wy, top, bottom, rowBytes = 3 * dr->render.width;
+    unsigned char *src, *dst, *p;
+
+    dst = dr->upscaled->pixels;
+
+    for (y = 0; y < dr->output.height; y++)
+    {
+        src = &dr->internal->pixels[dr->rows[y] * rowBytes];
+        wy = dr->rowWeights[y];
+
+        for (x = 0; x < dr->output.width; x++)
+        {
+            p = &src[3 * dr->columns[x]];
+            wx = dr->columnWeights[x];
+
+            // the neighbours at weight 0 are never read, so the last
+            // column and row don't need a pixel past the frame
+            for (c = 0; c < 3; c++, p++)
+            {
+                top = wx ? (p[0] << 8) + (p[3] - p[0]) * wx : p[0] << 8;
+
+                if (wy)
+                {
+                    bottom = wx ? (p[rowBytes] << 8) + (p[rowBytes + 3] - p[rowBytes]) * wx : p[rowBytes] << 8;
+                    top = ((top << 8) + (bottom - top) * wy) >> 8;
+                }
+
+                *dst++ = top >> 8;
+            }
+        }
+    }
+}
+
+void destroyDynamicResolution(DynamicResolution *dr)
+{
+    if (!dr) return;
+
+    destroyFrameBuffer(dr->internal);
+    destroyFrameBuffer(dr->upscaled);
+    free(dr->columns);
+    free(dr->rows);
+    free(dr->columnWeights);
+    free(dr->rowWeights);
+    free(dr);
+}
@@ -0,0 +1,457 @@
+#define FRAME_FORMAT_PPM 0
+#define FRAME_FORMAT_Y4M 1
+
+typedef struct FrameBufferStruct
+{
+    short width;
+    short height;
+    unsigned char *pixels; // 3 bytes per pixel, RGB, rows from top to bottom
+    float *depth;          // projected depth per pixel, 0 near - 1 far, NULL unless enabled
+}FrameBuffer;
+
+typedef struct RectStruct
+{
+    int x1; // inclusive pixel bounds, the rect is empty when x2 < x1
+    int y1;
+    int x2;
+    int y2;
+}Rect;
+
+typedef struct DirtyRegionStruct
+{
+    Rect previous;           // what was drawn last frame
+    Rect current;            // what has been drawn so far this frame
+    float fullFrameCoverage; // fraction of the frame above which the whole frame is used
+}DirtyRegion;
+
+typedef struct VisibilityBufferStruct
+{
+    short width;
+    short height;
+    unsigned int *ids; // triangle pool index + 1 of the nearest triangle per pixel, 0 = nothing
+    float *depth;      // projected depth of that triangle, 0 near - 1 far
+    Rect used;         // pixels written since the last clear
+}VisibilityBuffer;
+
+FrameBuffer *newFrameBuffer(short width, short height);
+int enableFrameBufferDepth(FrameBuffer *fb);
+void clearFrameBuffer(FrameBuffer *fb, unsigned char r, unsigned char g, unsigned char b);
+void clearFrameBufferDepth(FrameBuffer *fb, Rect rect);
+void fillFrameBufferSpan(FrameBuffer *fb, int y, int x1, int x2, unsigned char r, unsigned char g, unsigned char b);
+void clearFrameBufferRect(FrameBuffer *fb, Rect rect, unsigned char r, unsigned char g, unsigned char b);
+void presentFrameBuffer(FrameBuffer *fb, Rect rect, short x, short y);
+void destroyFrameBuffer(FrameBuffer *fb);
+VisibilityBuffer *newVisibilityBuffer(short width, short height);
+void clearVisibilityBuffer(VisibilityBuffer *vb);
+void destroyVisibilityBuffer(VisibilityBuffer *vb);
+Rect createRect(int x1, int y1, int x2, int y2);
+Rect createEmptyRect();
+Rect unionRect(Rect a, Rect b);
+Rect clipRect(Rect rect, short width, short height);
+int rectArea(Rect rect);
+void initDirtyRegion(DirtyRegion *dr, float fullFrameCoverage);
+void markDirtyRect(DirtyRegion *dr, Rect rect);
+Rect getDirtyRect(DirtyRegion *dr, short width, short height);
+void endDirtyFrame(DirtyRegion *dr);
+int frameBufferEncodedSize(FrameBuffer *fb);
+int writeFrameStreamHeader(FrameBuffer *fb, FILE *f, short format, int fps);
+int encodeFrameBuffer(FrameBuffer *fb, short format, unsigned char *out);
+int writeEncodedFrame(FrameBuffer *fb, FILE *f, short format, unsigned char *encoded);
+
+FrameBuffer *newFrameBuffer(short width, short height)
+{
+    FrameBuffer *ptr = NULL;
+
+    if (width <= 0 || height <= 0) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    ptr->width = width;
+    ptr->height = height;
+    ptr->depth = NULL;
+    ptr->pixels = malloc(3 * width * height);
+
+    if (!ptr->pixels)
+    {
+        free(ptr);
+        return NULL;
+    }
+
+    clearFrameBuffer(ptr, 0, 0, 0);
+
+    return ptr;
+}
+
+int enableFrameBufferDepth(FrameBuffer *fb)
+{
+    if (!fb) return -1;
+    if (fb->depth) return 0;
+
+    fb->depth = malloc(sizeof *(fb->depth) * fb->width * fb->height);
+
+    if (!fb->depth) return -2;
+
+    clearFrameBufferDepth(fb, createRect(0, 0, fb->width - 1, fb->height - 1));
+
+    return 0;
+}
+
+void clearFrameBuffer(FrameBuffer *fb, unsigned char r, unsigned char g, unsigned char b)
+{
+    int i, count;
+    unsigned char *p;
+
+    if (!fb) return;
+
+    count = fb->width * fb->height;
+
+    if (fb->depth)
+        clearFrameBufferDepth(fb, createRect(0, 0, fb->width - 1, fb->height - 1));
+
+    if (r == g && g == b) // gray levels (including black) can be cleared in one go
+    {
+        memset(fb->pixels, r, 3 * count);
+        return;
+    }
+
+    p = fb->pixels;
+
+    for (i = 0; i < count; i++)
+    {
+        *p++ = r;
+        *p++ = g;
+        *p++ = b;
+    }
+}
+
+void fillFrameBufferSpan(FrameBuffer *fb, int y, int x1, int x2, unsigned char r, unsigned char g, unsigned char b)
+{
+    int x;
+    unsigned char *p;
+
+    if (y < 0 || y >= fb->height) return;
+    if (x1 < 0) x1 = 0;
+    if (x2 >= fb->width) x2 = fb->width - 1;
+
+    p = &fb->pixels[3 * (y * fb->width + x1)];
+
+    for (x = x1; x <= x2; x++)
+    {
+        *p++ = r;
+        *p++ = g;
+        *p++ = b;
+    }
+}
+
+void clearFrameBufferRect(FrameBuffer *fb, Rect rect, unsigned char r, unsigned char g, unsigned char b)
+{
+    int y;
+
+    if (!fb) return;
+
+    rect = clipRect(rect, fb->width, fb->height);
+
+    if (rectArea(rect) == fb->width * fb->height)
+    {
+        clearFrameBuffer(fb, r, g, b);
+        return;
+    }
+
+    for (y = rect.y1; y <= rect.y2; y++)
+    {
+        fillFrameBufferSpan(fb, y, rect.x1, rect.x2, r, g, b);
+    }
+
+    if (fb->depth)
+        clearFrameBufferDepth(fb, rect);
+}
+
+void clearFrameBufferDepth(FrameBuffer *fb, Rect rect)
+{
+    int x, y;
+    float *p;
+
+    if (!fb || !fb->depth) return;
+
+    rect = clipRect(rect, fb->width, fb->height);
+
+    for (y = rect.y1; y <= rect.y2; y++)
+    {
+        p = &fb->depth[y * fb->width + rect.x1];
+
+        for (x = rect.x1; x <= rect.x2; x++)
+        {
+            *p++ = 1.0f;
+        }
+    }
+}
+
+void presentFrameBuffer(FrameBuffer *fb, Rect rect, short x, short y)
+{
+    int i, j, start;
+    unsigned char *row, *p;
+
+    if (!fb) return;
+
+    rect = clipRect(rect, fb->width, fb->height);
+
+    // draws the given part of the buffer onto the canvas at (x, y),
+    // using one line for each run of same colored pixels on a row
+    for (j = rect.y1; j <= rect.y2; j++)
+    {
+        row = &fb->pixels[3 * j * fb->width];
+        start = rect.x1;
+
+        for (i = rect.x1 + 1; i <= rect.x2 + 1; i++)
+        {
+            p = &row[3 * i];
+
+            if (i <= rect.x2 && p[0] == p[-3] && p[1] == p[-2] && p[2] == p[-1])
+                continue;
+
+            p = &row[3 * start];
+            setpen(p[0], p[1], p[2], 0, 1);
+
+            if (i - 1 == start)
+                putpixel(x + start, y + j);
+            else
+            {
+                moveto(x + start, y + j);
+                lineto(x + i - 1, y + j);
+            }
+
+            start = i;
+        }
+    }
+}
+
+void destroyFrameBuffer(FrameBuffer *fb)
+{
+    if (!fb) return;
+
+    free(fb->pixels);
+    free(fb->depth);
+    free(fb);
+}
+
+VisibilityBuffer *newVisibilityBuffer(short width, short height)
+{
+    VisibilityBuffer *ptr = NULL;
+
+    if (width <= 0 || height <= 0) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    ptr->width = width;
+    ptr->height = height;
+    ptr->ids = malloc(sizeof *(ptr->ids) * width * height);
+    ptr->depth = malloc(sizeof *(ptr->depth) * width * height);
+
+    if (!ptr->ids || !ptr->depth)
+    {
+        destroyVisibilityBuffer(ptr);
+        return NULL;
+    }
+
+    // everything counts as used once, so the first clear covers the whole buffer
+    ptr->used = createRect(0, 0, width - 1, height - 1);
+    clearVisibilityBuffer(ptr);
+
+    return ptr;
+}
+
+void clearVisibilityBuffer(VisibilityBuffer *vb)
+{
+    int x, y, offset;
+
+    if (!vb) return;
+
+    // only the pixels written since the last clear need resetting
+    vb->used = clipRect(vb->used, vb->width, vb->height);
+
+    for (y = vb->used.y1; y <= vb->used.y2; y++)
+    {
+        offset = y * vb->width;
+        memset(&vb->ids[offset + vb->used.x1], 0, sizeof *(vb->ids) * (vb->used.x2 - vb->used.x1 + 1));
+
+        for (x = vb->used.x1; x <= vb->used.x2; x++)
+        {
+            vb->depth[offset + x] = 1.0f;
+        }
+    }
+
+    vb->used = createEmptyRect();
+}
+
+void destroyVisibilityBuffer(VisibilityBuffer *vb)
+{
+    if (!vb) return;
+
+    free(vb->ids);
+    free(vb->depth);
+    free(vb);
+}
+
+int frameBufferEncodedSize(FrameBuffer *fb)
+{
+    // both formats store 3 full resolution bytes per pixel:
+    // PPM as interleaved RGB, Y4M as planar Y, U and V (4:4:4)
+    return 3 * fb->width * fb->height;
+}
+
+int writeFrameStreamHeader(FrameBuffer *fb, FILE *f, short format, int fps)
+{
+    if (!fb || !f) return -1;
+
+    // a raw PPM stream is just the frames one after another, every frame
+    // carries its own header, so only Y4M has a stream header
+    if (format == FRAME_FORMAT_Y4M)
+    {
+        if (fprintf(f, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", fb->width, fb->height, fps) < 0)
+            return -2;
+    }
+
+    return 0;
+}
+
+int encodeFrameBuffer(FrameBuffer *fb, short format, unsigned char *out)
+{
+    int i, count, r, g, b;
+    unsigned char *p, *y, *u, *v;
+
+    if (!fb || !out) return -1;
+
+    count = fb->width * fb->height;
+
+    if (format == FRAME_FORMAT_PPM)
+    {
+        memcpy(out, fb->pixels, 3 * count);
+        return 0;
+    }
+
+    // BT.601 studio range RGB -> YCbCr, integer approximation
+    p = fb->pixels;
+    y = out;
+    u = out + count;
+    v = out + 2 * count;
+
+    for (i = 0; i < count; i++)
+    {
+        r = *p++;
+        g = *p++;
+        b = *p++;
+
+        *y++ = (( 66 * r + 129 * g +  25 * b + 128) >> 8) + 16;
+        *u++ = ((-38 * r -  74 * g + 112 * b + 128) >> 8) + 128;
+        *v++ = ((112 * r -  94 * g -  18 * b + 128) >> 8) + 128;
+    }
+
+    return 0;
+}
+
+int writeEncodedFrame(FrameBuffer *fb, FILE *f, short format, unsigned char *encoded)
+{
+    int size;
+
+    if (!fb || !f || !encoded) return -1;
+
+    size = frameBufferEncodedSize(fb);
+
+    if (format == FRAME_FORMAT_Y4M)
+    {
+        if (fputs("FRAME\n", f) < 0) return -2;
+    }
+    else
+    {
+        if (fprintf(f, "P6\n%d %d\n255\n", fb->width, fb->height) < 0) return -2;
+    }
+
+    if (fwrite(encoded, 1, size, f) != (size_t)size) return -2;
+
+    return 0;
+}
+
+Rect createRect(int x1, int y1, int x2, int y2)
+{
+    Rect rect;
+
+    rect.x1 = x1;
+    rect.y1 = y1;
+    rect.x2 = x2;
+    rect.y2 = y2;
+
+    return rect;
+}
+
+Rect createEmptyRect()
+{
+    return createRect(0, 0, -1, -1);
+}
+
+Rect unionRect(Rect a, Rect b)
+{
+    if (a.x2 < a.x1 || a.y2 < a.y1) return b;
+    if (b.x2 < b.x1 || b.y2 < b.y1) return a;
+
+    return createRect(min(a.x1, b.x1), min(a.y1, b.y1), max(a.x2, b.x2), max(a.y2, b.y2));
+}
+
+Rect clipRect(Rect rect, short width, short height)
+{
+    rect.x1 = max(0, rect.x1);
+    rect.y1 = max(0, rect.y1);
+    rect.x2 = min(width - 1, rect.x2);
+    rect.y2 = min(height - 1, rect.y2);
+
+    return rect;
+}
+
+int rectArea(Rect rect)
+{
+    if (rect.x2 < rect.x1 || rect.y2 < rect.y1) return 0;
+
+    return (rect.x2 - rect.x1 + 1) * (rect.y2 - rect.y1 + 1);
+}
+
+void initDirtyRegion(DirtyRegion *dr, float fullFrameCoverage)
+{
+    if (!dr) return;
+
+    dr->previous = createEmptyRect();
+    dr->current = createEmptyRect();
+    dr->fullFrameCoverage = fullFrameCoverage;
+}
+
+void markDirtyRect(DirtyRegion *dr, Rect rect)
+{
+    if (!dr) return;
+
+    dr->current = unionRect(dr->current, rect);
+}
+
+Rect getDirtyRect(DirtyRegion *dr, short width, short height)
+{
+    Rect rect;
+
+    // the area to clear and present is where something was drawn
+    // last frame, to erase it, plus where something is drawn now
+    rect = clipRect(unionRect(dr->previous, dr->current), width, height);
+
+    // past the threshold a single full frame pass is cheaper than the bookkeeping
+    if (rectArea(rect) > dr->fullFrameCoverage * width * height)
+        return createRect(0, 0, width - 1, height - 1);
+
+    return rect;
+}
+
+void endDirtyFrame(DirtyRegion *dr)
+{
+    if (!dr) return;
+
+    dr->previous = dr->current;
+    dr->current = createEmptyRect();
+}
@@ -0,0 +1,745 @@
+#define HUD_FIRST_CHAR  32  // space
+#define HUD_LAST_CHAR   126 // tilde
+#define HUD_GLYPH_COUNT (HUD_LAST_CHAR - HUD_FIRST_CHAR + 1)
+
+#define HUD_ATLAS_WIDTH   256
+#define HUD_SUBSAMPLES    4  // sample rows per pixel row when rasterizing the glyphs
+#define HUD_MAX_LABEL     128
+#define HUD_MAX_COMPOSITE 4  // nesting depth of composite glyphs
+
+typedef struct HudGlyphStruct
+{
+    short x;       // position in the atlas
+    short y;
+    short width;
+    short height;
+    short left;    // bitmap position from the pen, right of it
+    short top;     // and up from the baseline
+    float advance; // pen movement after the glyph, in pixels
+}HudGlyph;
+
+typedef struct HudFontStruct
+{
+    short pixelHeight;
+    short ascent; // from the top of a line to the baseline
+    short lineHeight;
+
+    short atlasWidth;
+    short atlasHeight;
+    unsigned char *atlas; // coverage of every glyph, 0 - 255
+    HudGlyph glyphs[HUD_GLYPH_COUNT];
+}HudFont;
+
+typedef struct HudLabelStruct
+{
+    char text[HUD_MAX_LABEL]; // the text the layout was made for
+    int length;
+    short pens[HUD_MAX_LABEL]; // x of each character from the start of the label
+    short width;
+}HudLabel;
+
+// the font file while the atlas is being built, with the table offsets
+typedef struct FontFileStruct
+{
+    unsigned char *data;
+    long size;
+    long glyf;
+    long loca;
+    long hmtx;
+    long cmap; // the format 4 subtable
+    int unitsPerEm;
+    int longOffsets;
+    int hMetricCount;
+    int glyphCount;
+
+    // the outline of the glyph being rasterized, in bitmap pixels
+    float scale;
+    float originX;
+    float originY;
+    int edgeCount;
+    int edgeCapacity;
+    float *edges; // x0, y0, x1, y1 of every edge
+}FontFile;
+
+HudFont *loadHudFont(char fileName[256], short pixelHeight);
+unsigned int readFontU16(FontFile *ff, long offset);
+int readFontS16(FontFile *ff, long offset);
+unsigned long readFontU32(FontFile *ff, long offset);
+long findFontTable(FontFile *ff, char tag[5]);
+int findFontCmap(FontFile *ff);
+int getFontGlyphIndex(FontFile *ff, int charCode);
+long getFontGlyphOffset(FontFile *ff, int glyph, long *length);
+int addFontEdge(FontFile *ff, float x0, float y0, float x1, float y1);
+int addFontCurve(FontFile *ff, float x0, float y0, float cx, float cy, float x1, float y1);
+int addGlyphOutline(FontFile *ff, int glyph, float dx, float dy, int depth);
+int addGlyphContours(FontFile *ff, long offset, int contourCount, float dx, float dy);
+void rasterizeGlyphOutline(FontFile *ff, unsigned char *dst, int pitch, int width, int height);
+void setHudLabelText(HudFont *font, HudLabel *label, char *text);
+Rect drawHudLabel(HudFont *font, HudLabel *label, FrameBuffer *fb, short x, short y,
+                  unsigned char r, unsigned char g, unsigned char b);
+Rect drawHudText(HudFont *font, FrameBuffer *fb, short x, short y, char *text,
+                 unsigned char r, unsigned char g, unsigned char b);
+void drawHudGlyph(HudFont *font, HudGlyph *glyph, FrameBuffer *fb, int x, int y,
+                  unsigned char r, unsigned char g, unsigned char b);
+void destroyHudFont(HudFont *font);
+
+HudFont *loadHudFont(char fileName[256], short pixelHeight)
+{
+    int c, glyph, ascender, descender, penX = 0, penY = 0, rowHeight = 0;
+    long offset, length, head, hhea;
+    char errorMsg[256] = "";
+    FILE *f;
+    FontFile ff;
+    HudFont *ptr = NULL;
+    HudGlyph *hg;
+
+    if (pixelHeight <= 0) return NULL;
+
+    if (!(f = fopen(fileName, "rb")))
+    {
+        sprintf(errorMsg, "Failed: Couldn't open the font %s.", fileName);
+        DEBUG_MSG_FROM(errorMsg, "loadHudFont");
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    ff.size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    ff.data = malloc(ff.size > 0 ? ff.size : 1);
+    ff.edgeCapacity = 256;
+    ff.edges = malloc(sizeof *(ff.edges) * 4 * ff.edgeCapacity);
+    ptr = malloc(sizeof *ptr);
+
+    if (!ff.data || !ff.edges || !ptr || fread(ff.data, 1, ff.size, f) != (size_t)ff.size)
+    {
+        fclose(f);
+        free(ff.data);
+        free(ff.edges);
+        free(ptr);
+        DEBUG_MSG_FROM("Failed: Couldn't read the font.", "loadHudFont");
+        return NULL;
+    }
+
+    fclose(f);
+    ptr->atlas = NULL;
+
+    head = findFontTable(&ff, "head");
+    hhea = findFontTable(&ff, "hhea");
+    ff.glyf = findFontTable(&ff, "glyf");
+    ff.loca = findFontTable(&ff, "loca");
+    ff.hmtx = findFontTable(&ff, "hmtx");
+
+    if (head < 0 || hhea < 0 || ff.glyf < 0 || ff.loca < 0 || ff.hmtx < 0 || findFontTable(&ff, "maxp") < 0 ||
+        !findFontCmap(&ff))
+    {
+        sprintf(errorMsg, "Failed: %s is not a TrueType font with a Unicode character map.", fileName);
+        DEBUG_MSG_FROM(errorMsg, "loadHudFont");
+        free(ff.data);
+        free(ff.edges);
+        free(ptr);
+        return NULL;
+    }
+
+    ff.unitsPerEm = readFontU16(&ff, head + 18);
+    ff.longOffsets = readFontS16(&ff, head + 50);
+    ff.hMetricCount = readFontU16(&ff, hhea + 34);
+    ff.glyphCount = readFontU16(&ff, findFontTable(&ff, "maxp") + 4);
+    ascender = readFontS16(&ff, hhea + 4);
+    descender = readFontS16(&ff, hhea + 6);
+
+    // the pixel height covers the ascender and the descender
+    ff.scale = pixelHeight / (float)(ascender - descender);
+    ptr->pixelHeight = pixelHeight;
+    ptr->ascent = ceil(ascender * ff.scale);
+    ptr->lineHeight = ceil((ascender - descender + readFontS16(&ff, hhea + 8)) * ff.scale);
+
+    // the glyph boxes first, packed into rows of the atlas
+    for (c = HUD_FIRST_CHAR; c <= HUD_LAST_CHAR; c++)
+    {
+        hg = &ptr->glyphs[c - HUD_FIRST_CHAR];
+        glyph = getFontGlyphIndex(&ff, c);
+        hg->advance = readFontU16(&ff, ff.hmtx + 4 * min(glyph, ff.hMetricCount - 1)) * ff.scale;
+        hg->width = hg->height = hg->left = hg->top = 0;
+
+        if ((offset = getFontGlyphOffset(&ff, glyph, &length)) >= 0 && length > 0)
+        {
+            hg->left = floor(readFontS16(&ff, offset + 2) * ff.scale);
+            hg->top = ceil(readFontS16(&ff, offset + 8) * ff.scale);
+            hg->width = ceil(readFontS16(&ff, offset + 6) * ff.scale) - hg->left + 1;
+            hg->height = hg->top - floor(readFontS16(&ff, offset + 4) * ff.scale) + 1;
+        }
+
+        // a glyph wider than the atlas can't be packed, it's left out and only moves the pen
+        if (hg->width > HUD_ATLAS_WIDTH)
+        {
+            sprintf(errorMsg, "Failed: Character '%c' doesn't fit in the glyph atlas at %d pixels.", c, pixelHeight);
+            DEBUG_MSG_FROM(errorMsg, "loadHudFont");
+            hg->width = hg->height = 0;
+        }
+
+        if (penX + hg->width > HUD_ATLAS_WIDTH)
+        {
+            penX = 0;
+            penY += rowHeight + 1;
+            rowHeight = 0;
+        }
+
+        hg->x = penX;
+        hg->y = penY;
+        penX += hg->width + 1;
+        rowHeight = max(rowHeight, hg->height);
+    }
+
+    ptr->atlasWidth = HUD_ATLAS_WIDTH;
+    ptr->atlasHeight = penY + rowHeight;
+    ptr->atlas = malloc(ptr->atlasWidth * max(1, ptr->atlasHeight));
+
+    if (!ptr->atlas)
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't allocate the glyph atlas.", "loadHudFont");
+        free(ff.data);
+        free(ff.edges);
+        free(ptr);
+        return NULL;
+    }
+
+    memset(ptr->atlas, 0, ptr->atlasWidth * max(1, ptr->atlasHeight));
+
+    // then the outlines, each glyph only once for the lifetime of the font
+    for (c = HUD_FIRST_CHAR; c <= HUD_LAST_CHAR; c++)
+    {
+        hg = &ptr->glyphs[c - HUD_FIRST_CHAR];
+
+        if (!hg->width || !hg->height) continue;
+
+        ff.edgeCount = 0;
+        ff.originX = hg->left;
+        ff.originY = hg->top;
+
+        if (addGlyphOutline(&ff, getFontGlyphIndex(&ff, c), 0.0f, 0.0f, 0) < 0) continue;
+
+        rasterizeGlyphOutline(&ff, &ptr->atlas[hg->y * ptr->atlasWidth + hg->x], ptr->atlasWidth, hg->width, hg->height);
+    }
+
+    free(ff.data);
+    free(ff.edges);
+
+    return ptr;
+}
+
+unsigned int readFontU16(FontFile *ff, long offset)
+{
+    if (offset < 0 || offset + 2 > ff->size) return 0;
+
+    // TrueType is big endian
+    return (ff->data[offset] << 8) | ff->data[offset + 1];
+}
+
+int readFontS16(FontFile *ff, long offset)
+{
+    int value = readFontU16(ff, offset);
+
+    return value >= 32768 ? value - 65536 : value;
+}
+
+unsigned long readFontU32(FontFile *ff, long offset)
+{
+    return ((unsigned long)readFontU16(ff, offset) << 16) | readFontU16(ff, offset + 2);
+}
+
+long findFontTable(FontFile *ff, char tag[5])
+{
+    int i, tableCount = readFontU16(ff, 4);
+
+    for (i = 0; i < tableCount && 12 + 16 * i + 16 <= ff->size; i++)
+    {
+        if (!strncmp((char *)&ff->data[12 + 16 * i], tag, 4))
+            return readFontU32(ff, 12 + 16 * i + 8);
+    }
+
+    return -1;
+}
+
+int findFontCmap(FontFile *ff)
+{
+    int i, platform, encoding;
+    long cmap = findFontTable(ff, "cmap"), subtable;
+
+    if (cmap < 0) return 0;
+
+    // Windows Unicode BMP (3, 1) or any Unicode (0, x) subtable in format 4
+    for (i = 0; i < (int)readFontU16(ff, cmap + 2); i++)
+    {
+        platform = readFontU16(ff, cmap + 4 + 8 * i);
+        encoding = readFontU16(ff, cmap + 4 + 8 * i + 2);
+        subtable = cmap + readFontU32(ff, cmap + 4 + 8 * i + 4);
+
+        if ((platform == 0 || (platform == 3 && encoding == 1)) && readFontU16(ff, subtable) == 4)
+        {
+            ff->cmap = subtable;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int getFontGlyphIndex(FontFile *ff, int charCode)
+{
+    int i, segCount = readFontU16(ff, ff->cmap + 6) / 2, start, delta, rangeOffset;
+    long ends = ff->cmap + 14, starts = ends + 2 * segCount + 2, deltas = starts + 2 * segCount;
+    long rangeOffsets = deltas + 2 * segCount;
+
+    for (i = 0; i < segCount; i++)
+    {
+        if ((int)readFontU16(ff, ends + 2 * i) < charCode) continue;
+
+        start = readFontU16(ff, starts + 2 * i);
+
+        if (start > charCode) return 0;
+
+        delta = readFontS16(ff, deltas + 2 * i);
+        rangeOffset = readFontU16(ff, rangeOffsets + 2 * i);
+
+        if (!rangeOffset) return (charCode + delta) & 0xFFFF;
+
+        // the offset is relative to where it's stored
+        i = readFontU16(ff, rangeOffsets + 2 * i + rangeOffset + 2 * (charCode - start));
+
+        return i ? (i + delta) & 0xFFFF : 0;
+    }
+
+    return 0;
+}
+
+long getFontGlyphOffset(FontFile *ff, int glyph, long *length)
+{
+    long start, end;
+
+    if (glyph < 0 || glyph >= ff->glyphCount) return -1;
+
+    if (ff->longOffsets)
+    {
+        start = readFontU32(ff, ff->loca + 4 * glyph);
+        end = readFontU32(ff, ff->loca + 4 * glyph + 4);
+    }
+    else
+    {
+        start = 2 * (long)readFontU16(ff, ff->loca + 2 * glyph);
+        end = 2 * (long)readFontU16(ff, ff->loca + 2 * glyph + 2);
+    }
+
+    *length = end - start;
+
+    return ff->glyf + start;
+}
+
+int addFontEdge(FontFile *ff, float x0, float y0, float x1, float y1)
+{
+    float *edges, *e;
+
+    if (y0 == y1) return 0; // horizontal edges cross no sample rows
+
+    if (ff->edgeCount == ff->edgeCapacity)
+    {
+        if (!(edges = realloc(ff->edges, sizeof *edges * 4 * 2 * ff->edgeCapacity))) return -1;
+
+        ff->edges = edges;
+        ff->edgeCapacity *= 2;
+    }
+
+    e = &ff->edges[4 * ff->edgeCount++];
+
+    // from font units with y up to bitmap pixels with y down
+    e[0] = x0 * ff->scale - ff->originX;
+    e[1] = ff->originY - y0 * ff->scale;
+    e[2] = x1 * ff->scale - ff->originX;
+    e[3] = ff->originY - y1 * ff->scale;
+
+    return 0;
+}
+
+int addFontCurve(FontFile *ff, float x0, float y0, float cx, float cy, float x1, float y1)
+{
+    int i, steps;
+    float t, x, y, px = x0, py = y0;
+
+    // about one line segment per two pixels of the curve's control polygon
+    steps = ceil((sqrt((cx - x0) * (cx - x0) + (cy - y0) * (cy - y0)) +
+                  sqrt((x1 - cx) * (x1 - cx) + (y1 - cy) * (y1 - cy))) * ff->scale / 2.0f);
+    steps = max(1, min(16, steps));
+
+    for (i = 1; i <= steps; i++)
+    {
+        t = i / (float)steps;
+        x = (1.0f - t) * (1.0f - t) * x0 + 2.0f * (1.0f - t) * t * cx + t * t * x1;
+        y = (1.0f - t) * (1.0f - t) * y0 + 2.0f * (1.0f - t) * t * cy + t * t * y1;
+
+        if (addFontEdge(ff, px, py, x, y) < 0) return -1;
+
+        px = x;
+        py = y;
+    }
+
+    return 0;
+}
+
+int addGlyphOutline(FontFile *ff, int glyph, float dx, float dy, int depth)
+{
+    int contourCount, flags, component;
+    long offset, length;
+    float ox, oy;
+
+    if ((offset = getFontGlyphOffset(ff, glyph, &length)) < 0) return -1;
+    if (length <= 0) return 0;
+
+    contourCount = readFontS16(ff, offset);
+
+    if (contourCount >= 0) return addGlyphContours(ff, offset, contourCount, dx, dy);
+
+    if (depth >= HUD_MAX_COMPOSITE) return -1;
+
+    // a composite glyph is made of other glyphs moved by an offset,
+    // the scales and matrices of the components aren't applied
+    offset += 10;
+
+    do
+    {
+        flags = readFontU16(ff, offset);
+        component = readFontU16(ff, offset + 2);
+        offset += 4;
+
+        if (flags & 1) // the offsets are words
+        {
+            ox = readFontS16(ff, offset);
+            oy = readFontS16(ff, offset + 2);
+            offset += 4;
+        }
+        else
+        {
+            ox = (signed char)ff->data[offset];
+            oy = (signed char)ff->data[offset + 1];
+            offset += 2;
+        }
+
+        if (flags & 8) offset += 2;          // one scale
+        else if (flags & 0x40) offset += 4;  // x and y scales
+        else if (flags & 0x80) offset += 8;  // 2 by 2 matrix
+
+        // the arguments can also be point numbers to match instead of offsets
+        if (!(flags & 2)) ox = oy = 0.0f;
+
+        if (addGlyphOutline(ff, component, dx + ox, dy + oy, depth + 1) < 0) return -1;
+    }while (flags & 0x20); // more components follow
+
+    return 0;
+}
+
+int addGlyphContours(FontFile *ff, long offset, int contourCount, float dx, float dy)
+{
+    int i, j, first, last, end, pointCount, flag, repeat, result = 0, pending;
+    long p;
+    float *x, *y, value, startX, startY, prevX, prevY, midX, midY, controlX = 0.0f, controlY = 0.0f;
+    unsigned char *onCurve;
+
+    if (!contourCount) return 0;
+
+    pointCount = readFontU16(ff, offset + 10 + 2 * (contourCount - 1)) + 1;
+    x = malloc(sizeof *x * pointCount);
+    y = malloc(sizeof *y * pointCount);
+    onCurve = malloc(pointCount);
+
+    if (!x || !y || !onCurve)
+    {
+        free(x);
+        free(y);
+        free(onCurve);
+        return -1;
+    }
+
+    // skip the contour ends and the hinting instructions
+    p = offset + 10 + 2 * contourCount;
+    p += 2 + readFontU16(ff, p);
+
+    // the flags are run length coded, the coordinates come after all of them
+    for (i = 0; i < pointCount; )
+    {
+        flag = ff->data[p++];
+        repeat = (flag & 8) ? ff->data[p++] : 0;
+
+        for (j = 0; j <= repeat && i < pointCount; j++)
+        {
+            onCurve[i] = flag;
+            i++;
+        }
+    }
+
+    // the coordinates are deltas, short ones are a byte with the sign in the flag,
+    // and a long one missing means that it's the same as the previous point
+    for (i = 0, value = dx; i < pointCount; i++)
+    {
+        if (onCurve[i] & 2) { value += (onCurve[i] & 16) ? ff->data[p] : -ff->data[p]; p++; }
+        else if (!(onCurve[i] & 16)) { value += readFontS16(ff, p); p += 2; }
+        x[i] = value;
+    }
+
+    for (i = 0, value = dy; i < pointCount; i++)
+    {
+        if (onCurve[i] & 4) { value += (onCurve[i] & 32) ? ff->data[p] : -ff->data[p]; p++; }
+        else if (!(onCurve[i] & 32)) { value += readFontS16(ff, p); p += 2; }
+        y[i] = value;
+        onCurve[i] &= 1;
+    }
+
+    for (i = 0, first = 0; i < contourCount && !result; i++, first = last + 1)
+    {
+        last = readFontU16(ff, offset + 10 + 2 * i);
+
+        if (last >= pointCount || last < first) break;
+
+        // the contour starts from a point on the curve, or from
+        // between two control points if there isn't one at the ends
+        end = last;
+
+        if (onCurve[first]) { startX = x[first]; startY = y[first]; j = first + 1; }
+        else if (onCurve[last]) { startX = x[last]; startY = y[last]; j = first; end--; }
+        else { startX = (x[first] + x[last]) / 2.0f; startY = (y[first] + y[last]) / 2.0f; j = first; }
+
+        prevX = startX;
+        prevY = startY;
+        pending = 0;
+
+        for (; j <= end && !result; j++)
+        {
+            if (onCurve[j])
+            {
+                if (pending) result = addFontCurve(ff, prevX, prevY, controlX, controlY, x[j], y[j]);
+                else result = addFontEdge(ff, prevX, prevY, x[j], y[j]);
+
+                prevX = x[j];
+                prevY = y[j];
+                pending = 0;
+            }
+            else
+            {
+                // two control points in a row have an implied point between them
+                if (pending)
+                {
+                    midX = (controlX + x[j]) / 2.0f;
+                    midY = (controlY + y[j]) / 2.0f;
+                    result = addFontCurve(ff, prevX, prevY, controlX, controlY, midX, midY);
+                    prevX = midX;
+                    prevY = midY;
+                }
+
+                controlX = x[j];
+                controlY = y[j];
+                pending = 1;
+            }
+        }
+
+        if (!result)
+        {
+            if (pending) result = addFontCurve(ff, prevX, prevY, controlX, controlY, startX, startY);
+            else result = addFontEdge(ff, prevX, prevY, startX, startY);
+        }
+    }
+
+    free(x);
+    free(y);
+    free(onCurve);
+
+    return result;
+}
+
+void rasterizeGlyphOutline(FontFile *ff, unsigned char *dst, int pitch, int width, int height)
+{
+    int i, j, row, s, count, winding, x, *windings, crossingCapacity = ff->edgeCount;
+    float sampleY, from, to, *crossings, *coverage, *e, t, swap;
+
+    crossings = malloc(sizeof *crossings * (crossingCapacity > 0 ? crossingCapacity : 1));
+    windings = malloc(sizeof *windings * (crossingCapacity > 0 ? crossingCapacity : 1));
+    coverage = malloc(sizeof *coverage * (width + 1));
+
+    if (!crossings || !windings || !coverage)
+    {
+        free(crossings);
+        free(windings);
+        free(coverage);
+        return;
+    }
+
+    for (row = 0; row < height; row++)
+    {
+        for (x = 0; x <= width; x++) coverage[x] = 0.0f;
+
+        for (s = 0; s < HUD_SUBSAMPLES; s++)
+        {
+            sampleY = row + (s + 0.5f) / HUD_SUBSAMPLES;
+            count = 0;
+
+            // where the sample row crosses the outline, and in which direction
+            for (i = 0; i < ff->edgeCount; i++)
+            {
+                e = &ff->edges[4 * i];
+
+                if ((sampleY >= e[1]) == (sampleY >= e[3])) continue;
+
+                t = e[0] + (sampleY - e[1]) * (e[2] - e[0]) / (e[3] - e[1]);
+
+                // sorted by x as they are found, there are only a few per row
+                for (j = count; j > 0 && crossings[j - 1] > t; j--)
+                {
+                    crossings[j] = crossings[j - 1];
+                    windings[j] = windings[j - 1];
+                }
+
+                crossings[j] = t;
+                windings[j] = e[3] > e[1] ? 1 : -1;
+                count++;
+            }
+
+            // nonzero winding: inside wherever the directions don't cancel out,
+            // with the exact horizontal coverage of the pixels at the ends
+            for (i = 0, winding = 0; i < count - 1; i++)
+            {
+                winding += windings[i];
+
+                if (!winding) continue;
+
+                from = max(0.0f, crossings[i]);
+                to = min((float)width, crossings[i + 1]);
+
+                if (from >= to) continue;
+
+                for (x = floor(from); x < to; x++)
+                {
+                    swap = min(to, x + 1.0f) - max(from, (float)x);
+
+                    if (swap > 0.0f) coverage[x] += swap;
+                }
+            }
+        }
+
+        for (x = 0; x < width; x++)
+        {
+            dst[row * pitch + x] = min(255, floor(coverage[x] * 255.0f / HUD_SUBSAMPLES + 0.5f));
+        }
+    }
+
+    free(crossings);
+    free(windings);
+    free(coverage);
+}
+
+void setHudLabelText(HudFont *font, HudLabel *label, char *text)
+{
+    int i, c;
+    float pen = 0.0f;
+
+    // unchanged text keeps its layout
+    if (!strcmp(label->text, text)) return;
+
+    strncpy(label->text, text, HUD_MAX_LABEL - 1);
+    label->text[HUD_MAX_LABEL - 1] = '\0';
+    label->length = strlen(label->text);
+
+    for (i = 0; i < label->length; i++)
+    {
+        c = (unsigned char)label->text[i];
+        label->pens[i] = floor(pen + 0.5f);
+
+        if (c >= HUD_FIRST_CHAR && c <= HUD_LAST_CHAR)
+            pen += font->glyphs[c - HUD_FIRST_CHAR].advance;
+    }
+
+    label->width = ceil(pen);
+}
+
+Rect drawHudLabel(HudFont *font, HudLabel *label, FrameBuffer *fb, short x, short y,
+                  unsigned char r, unsigned char g, unsigned char b)
+{
+    int i, c;
+    Rect rect;
+
+    if (!font || !label || !fb || !label->length) return createEmptyRect();
+
+    for (i = 0; i < label->length; i++)
+    {
+        c = (unsigned char)label->text[i];
+
+        if (c > HUD_FIRST_CHAR && c <= HUD_LAST_CHAR)
+            drawHudGlyph(font, &font->glyphs[c - HUD_FIRST_CHAR], fb, x + label->pens[i], y + font->ascent, r, g, b);
+    }
+
+    // presented with the rest of the frame's changes
+    rect = clipRect(createRect(x, y, x + label->width, y + font->lineHeight), fb->width, fb->height);
+    markDirtyRect(&dirtyRegion, rect);
+
+    return rect;
+}
+
+Rect drawHudText(HudFont *font, FrameBuffer *fb, short x, short y, char *text,
+                 unsigned char r, unsigned char g, unsigned char b)
+{
+    HudLabel label;
+
+    // laid out every time, a HudLabel kept between frames skips that for unchanged text
+    label.text[0] = '\0';
+    label.length = 0;
+
+    if (!font || !text || !text[0]) return createEmptyRect();
+
+    setHudLabelText(font, &label, text);
+
+    return drawHudLabel(font, &label, fb, x, y, r, g, b);
+}
+
+void drawHudGlyph(HudFont *font, HudGlyph *glyph, FrameBuffer *fb, int x, int y,
+                  unsigned char r, unsigned char g, unsigned char b)
+{
+    int row, x1, x2, alpha;
+    unsigned char *src, *end, *p;
+
+    // x and y are the pen on the baseline
+    x += glyph->left;
+    y -= glyph->top;
+    x1 = max(0, x);
+    x2 = min(fb->width, x + glyph->width);
+
+    if (x1 >= x2) return;
+
+    for (row = max(0, -y); row < glyph->height && y + row < fb->height; row++)
+    {
+        src = &font->atlas[(glyph->y + row) * font->atlasWidth + glyph->x + (x1 - x)];
+        end = src + (x2 - x1);
+        p = &fb->pixels[3 * ((y + row) * fb->width + x1)];
+
+        // the inside of a glyph is a run of full coverage, only the edges are blended
+        for (; src < end; src++, p += 3)
+        {
+            if (!(alpha = *src)) continue;
+
+            if (alpha == 255)
+            {
+                p[0] = r;
+                p[1] = g;
+                p[2] = b;
+            }
+            else
+            {
+                p[0] += ((r - p[0]) * alpha) >> 8;
+                p[1] += ((g - p[1]) * alpha) >> 8;
+                p[2] += ((b - p[2]) * alpha) >> 8;
+            }
+        }
+    }
+}
+
+void destroyHudFont(HudFont *font)
+{
+    if (!font) return;
+
+    free(font->atlas);
+    free(font);
+}
@@ -0,0 +1,352 @@
+#define INSTANCE_LOD_CULLED  0 // outside the view, nothing is projected or drawn
+#define INSTANCE_LOD_DISTANT 1 // farther than the batch's draw distance, nothing is projected or drawn
+#define INSTANCE_LOD_FULL    2 // every face is projected and drawn
+
+typedef struct InstanceBatchStruct
+{
+    Mesh *mesh; // the shared geometry, it must not change while the batch uses it
+
+    int count;
+    int capacity;
+    MeshInstance *instances;
+    Vector3 *projections; // capacity * vertexCount projected vertices, split between the instances
+    int *slots;           // capacity * faceCount pool indices, split between the instances
+
+    // the face data every instance needs, read from the mesh once instead of per instance
+    Vector3 *faceNormals;
+    Vector3 *facePoints; // first vertex of each face
+    float *facePlanes;   // dot(normal, first vertex), the face is seen from the front above it
+    float *normalMagnitudes;
+
+    Vector3 boundsCenter; // object space bounding sphere of the mesh
+    float boundsRadius;
+    float drawDistance;   // instances farther than this are not drawn, 0 = no limit
+
+    TrianglePool *pool;
+    int pooledCount; // instances whose faces are in the pool
+}InstanceBatch;
+
+InstanceBatch *newInstanceBatch(Mesh *mesh, int capacity);
+int addMeshInstance(InstanceBatch *batch, Vector3 position, Matrix4x4 orientation,
+                    unsigned char r, unsigned char g, unsigned char b);
+void setMeshInstanceTransform(InstanceBatch *batch, int instanceNum, Vector3 position, Matrix4x4 orientation);
+int addInstanceBatchToPool(TrianglePool *tp, InstanceBatch *batch);
+void renderInstanceBatch(Screen *screen, Camera *camera, InstanceBatch *batch);
+short pickInstanceLOD(InstanceBatch *batch, MeshInstance *instance, Camera *camera);
+void projectMeshInstance(Screen *screen, InstanceBatch *batch, MeshInstance *instance, Matrix4x4 vertexMatrix);
+void hideMeshInstance(InstanceBatch *batch, MeshInstance *instance);
+void renderInstanceFacesPlain(InstanceBatch *batch, MeshInstance *instance, Vector3 camera);
+void renderInstanceFacesShaded(InstanceBatch *batch, MeshInstance *instance, Vector3 camera);
+void renderInstanceFacesCulled(InstanceBatch *batch, MeshInstance *instance, Vector3 camera);
+void renderInstanceFacesCulledShaded(InstanceBatch *batch, MeshInstance *instance, Vector3 camera);
+void destroyInstanceBatch(InstanceBatch *batch);
+
+InstanceBatch *newInstanceBatch(Mesh *mesh, int capacity)
+{
+    int i;
+    InstanceBatch *ptr = NULL;
+
+    if (!mesh || mesh->vertexCount <= 0 || mesh->faceCount <= 0 || capacity <= 0) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    ptr->instances = malloc(sizeof *(ptr->instances) * capacity);
+    ptr->projections = malloc(sizeof *(ptr->projections) * capacity * mesh->vertexCount);
+    ptr->slots = malloc(sizeof *(ptr->slots) * capacity * mesh->faceCount);
+    ptr->faceNormals = malloc(sizeof *(ptr->faceNormals) * mesh->faceCount);
+    ptr->facePoints = malloc(sizeof *(ptr->facePoints) * mesh->faceCount);
+    ptr->facePlanes = malloc(sizeof *(ptr->facePlanes) * mesh->faceCount);
+    ptr->normalMagnitudes = malloc(sizeof *(ptr->normalMagnitudes) * mesh->faceCount);
+
+    if (!ptr->instances || !ptr->projections || !ptr->slots || !ptr->faceNormals ||
+        !ptr->facePoints || !ptr->facePlanes || !ptr->normalMagnitudes)
+    {
+        destroyInstanceBatch(ptr);
+        return NULL;
+    }
+
+    ptr->mesh = mesh;
+    ptr->count = 0;
+    ptr->capacity = capacity;
+    ptr->drawDistance = 0.0f;
+    ptr->pool = NULL;
+    ptr->pooledCount = 0;
+
+    for (i = 0; i < mesh->faceCount; i++)
+    {
+        ptr->faceNormals[i] = getMeshNormal(mesh, mesh->faces[i].normal);
+        ptr->facePoints[i] = getMeshVertex(mesh, mesh->faces[i].indices[0]);
+        ptr->facePlanes[i] = dotProductVector3(ptr->faceNormals[i], ptr->facePoints[i]);
+        ptr->normalMagnitudes[i] = magnitudeVector3(ptr->faceNormals[i]);
+    }
+
+    getMeshBoundingSphere(mesh, &ptr->boundsCenter, &ptr->boundsRadius);
+
+    return ptr;
+}
+
+int addMeshInstance(InstanceBatch *batch, Vector3 position, Matrix4x4 orientation,
+                    unsigned char r, unsigned char g, unsigned char b)
+{
+    MeshInstance *instance;
+
+    if (!batch) return -1;
+
+    if (batch->count >= batch->capacity)
+    {
+        DEBUG_MSG_FROM("Failed: The instance batch is full.", "addMeshInstance");
+        return -2;
+    }
+
+    instance = &batch->instances[batch->count];
+    instance->projections = &batch->projections[batch->count * batch->mesh->vertexCount];
+    instance->slots = &batch->slots[batch->count * batch->mesh->faceCount];
+    instance->r = r;
+    instance->g = g;
+    instance->b = b;
+    instance->lod = INSTANCE_LOD_CULLED;
+    instance->objectSpaceCamera = createVector3(0.0f, 0.0f, 0.0f);
+    instance->screenBounds = createEmptyRect();
+    batch->count++;
+    setMeshInstanceTransform(batch, batch->count - 1, position, orientation);
+
+    return batch->count - 1;
+}
+
+void setMeshInstanceTransform(InstanceBatch *batch, int instanceNum, Vector3 position, Matrix4x4 orientation)
+{
+    if (!batch || instanceNum < 0 || instanceNum >= batch->count) return;
+
+    // the same world matrix getMeshWorldMatrix() builds for a mesh
+    batch->instances[instanceNum].world =
+        multiplyMatrices(orientation, createTranslationMatrix(position.x, position.y, position.z));
+}
+
+int addInstanceBatchToPool(TrianglePool *tp, InstanceBatch *batch)
+{
+    int i, j, added = 0;
+    TriangleObj *to;
+    MeshInstance *instance;
+
+    if (!tp || !tp->triangles || !batch) return -1;
+
+    if (batch->pool && batch->pool != tp)
+    {
+        DEBUG_MSG_FROM("Failed: The batch is already in another pool.", "addInstanceBatchToPool");
+        return -2;
+    }
+
+    // only the instances added since the last call go in
+    if (tp->triCount + (batch->count - batch->pooledCount) * batch->mesh->faceCount > tp->maxTriCount)
+    {
+        DEBUG_MSG_FROM("Failed: The triangle pool is full.", "addInstanceBatchToPool");
+        return -3;
+    }
+
+    for (i = batch->pooledCount; i < batch->count; i++)
+    {
+        instance = &batch->instances[i];
+
+        // the entries point to the shared faces, the instance keeps their pool indices
+        for (j = 0; j < batch->mesh->faceCount; j++)
+        {
+            to = &tp->triangles[tp->triCount];
+            to->mesh = batch->mesh;
+            to->face = &batch->mesh->faces[j];
+            to->instance = instance;
+            to->drawState = 0;
+            to->shading = 0.0f;
+            to->faceDist = 0.0f;
+            instance->slots[j] = tp->triCount++;
+        }
+
+        added++;
+    }
+
+    batch->pool = tp;
+    batch->pooledCount = batch->count;
+
+    return added;
+}
+
+void renderInstanceBatch(Screen *screen, Camera *camera, InstanceBatch *batch)
+{
+    int i;
+    short variant;
+    Matrix4x4 viewProjectionMatrix, vertexMatrix;
+    Vector3 objectSpaceCamera;
+    MeshInstance *instance;
+
+    if (!batch || !batch->pool) return;
+
+    // the matrices, the frustum and the face loop variant are the same for
+    // every instance, so they are set up once for the whole batch
+    viewProjectionMatrix = getViewProjectionMatrix(screen, camera);
+    setCameraFrustum(camera, viewProjectionMatrix); // world space planes
+    variant = ((flags & BACKFACE_CULLING) ? 2 : 0) + (!(visibilityBuffer && renderTarget && !overdrawStats) ? 1 : 0);
+
+    for (i = 0; i < batch->pooledCount; i++)
+    {
+        instance = &batch->instances[i];
+
+        if ((instance->lod = pickInstanceLOD(batch, instance, camera)) != INSTANCE_LOD_FULL)
+        {
+            hideMeshInstance(batch, instance);
+            continue;
+        }
+
+        objectSpaceCamera = transformVector3ByMatrix(camera->position, Invert(instance->world));
+        instance->objectSpaceCamera = objectSpaceCamera;
+
+        // compressed positions get the dequantization folded in, as in renderMesh
+        vertexMatrix = multiplyMatrices(instance->world, viewProjectionMatrix);
+
+        if (batch->mesh->quantizedVertices)
+            vertexMatrix = multiplyMatrices(getMeshDequantizationMatrix(batch->mesh), vertexMatrix);
+
+        projectMeshInstance(screen, batch, instance, vertexMatrix);
+
+        switch (variant)
+        {
+            case 0: renderInstanceFacesPlain(batch, instance, camera->position); break;
+            case 1: renderInstanceFacesShaded(batch, instance, camera->position); break;
+            case 2: renderInstanceFacesCulled(batch, instance, camera->position); break;
+            case 3: renderInstanceFacesCulledShaded(batch, instance, camera->position); break;
+        }
+    }
+}
+
+short pickInstanceLOD(InstanceBatch *batch, MeshInstance *instance, Camera *camera)
+{
+    int i;
+    float scale;
+    Vector3 center;
+
+    center = transformVector3ByMatrix(batch->boundsCenter, instance->world);
+    scale = getMatrixMaxScale(instance->world);
+
+    if (batch->drawDistance > 0.0f &&
+        magnitudeVector3(subtractVector3(center, camera->position)) - batch->boundsRadius * scale > batch->drawDistance)
+        return INSTANCE_LOD_DISTANT;
+
+    // the bounding sphere against the frustum planes, which are normalized
+    for (i = 0; i < 6; i++)
+    {
+        if (dotProductVector3(camera->frustum[i].normal, center) + camera->frustum[i].d < -batch->boundsRadius * scale)
+            return INSTANCE_LOD_CULLED;
+    }
+
+    return INSTANCE_LOD_FULL;
+}
+
+void projectMeshInstance(Screen *screen, InstanceBatch *batch, MeshInstance *instance, Matrix4x4 vertexMatrix)
+{
+    int i;
+    float minX, minY, maxX, maxY;
+    int clipped = 0;
+    Vector3 vertex, projectedVertex, *p;
+    Mesh *mesh = batch->mesh;
+    QuantizedVertex *quantized = mesh->quantizedVertices;
+
+    minX = minY = 1000000.0f;
+    maxX = maxY = -1000000.0f;
+
+    // the same projection renderMesh does, into the instance's own array
+    for (i = 0; i < mesh->vertexCount; i++)
+    {
+        vertex = quantized ? createVector3(quantized[i].x, quantized[i].y, quantized[i].z) : mesh->vertices[i];
+        p = &instance->projections[i];
+        *p = project(screen->width, screen->height, vertex, vertexMatrix, &projectedVertex);
+
+        if (projectedVertex.z < 0.0f || projectedVertex.z > 1.0f)
+            clipped = 1;
+
+        if (p->x < minX) minX = p->x;
+        if (p->y < minY) minY = p->y;
+        if (p->x > maxX) maxX = p->x;
+        if (p->y > maxY) maxY = p->y;
+    }
+
+    if (clipped)
+        instance->screenBounds = createRect(0, 0, screen->width - 1, screen->height - 1);
+    else
+        instance->screenBounds = clipRect(createRect(floor(minX) - 2, floor(minY) - 2, ceil(maxX) + 2, ceil(maxY) + 2),
+                                          screen->width, screen->height);
+
+    markDirtyRect(&dirtyRegion, instance->screenBounds);
+}
+
+void hideMeshInstance(InstanceBatch *batch, MeshInstance *instance)
+{
+    int i;
+    TriangleObj *triangles = batch->pool->triangles;
+
+    for (i = 0; i < batch->mesh->faceCount; i++)
+    {
+        triangles[instance->slots[i]].drawState = 0;
+    }
+
+    instance->screenBounds = createEmptyRect();
+}
+
+// Generates a face loop variant for renderInstanceBatch, like MESH_FACE_LOOP
+// does for renderMesh. The distance the pool is sorted by is the dot product
+// of the face's first vertex in world space and the camera position, which is
+// linear in the object space vertex, so it's a dot product with a vector worked
+// out once per instance (the world matrix is affine).
+#define INSTANCE_FACE_LOOP(NAME, CULL, SHADE)                                                   \
+void NAME(InstanceBatch *batch, MeshInstance *instance, Vector3 camera)                         \
+{                                                                                               \
+    int i;                                                                                      \
+    float shading = 0.0f, cameraMagnitude, distOffset;                                          \
+    Vector3 eye = instance->objectSpaceCamera, distAxis;                                        \
+    Matrix4x4 m = instance->world;                                                              \
+    TriangleObj *to, *triangles = batch->pool->triangles;                                       \
+                                                                                                \
+    cameraMagnitude = magnitudeVector3(eye);                                                    \
+    distAxis = createVector3(m.m11 * camera.x + m.m12 * camera.y + m.m13 * camera.z,            \
+                             m.m21 * camera.x + m.m22 * camera.y + m.m23 * camera.z,            \
+                             m.m31 * camera.x + m.m32 * camera.y + m.m33 * camera.z);           \
+    distOffset = m.m41 * camera.x + m.m42 * camera.y + m.m43 * camera.z;                        \
+                                                                                                \
+    for (i = 0; i < batch->mesh->faceCount; i++)                                                \
+    {                                                                                           \
+        to = &triangles[instance->slots[i]];                                                    \
+                                                                                                \
+        if (CULL && dotProductVector3(batch->faceNormals[i], eye) <= batch->facePlanes[i])      \
+        {                                                                                       \
+            to->drawState = 0;                                                                  \
+            continue;                                                                           \
+        }                                                                                       \
+                                                                                                \
+        if (SHADE)                                                                              \
+            shading = max(0.0f, dotProductVector3(batch->faceNormals[i], eye) /                 \
+                                (batch->normalMagnitudes[i] * cameraMagnitude));                \
+                                                                                                \
+        to->drawState = 1;                                                                      \
+        to->shading = shading;                                                                  \
+        to->faceDist = dotProductVector3(batch->facePoints[i], distAxis) + distOffset;          \
+    }                                                                                           \
+}
+
+INSTANCE_FACE_LOOP(renderInstanceFacesPlain, 0, 0)
+INSTANCE_FACE_LOOP(renderInstanceFacesShaded, 0, 1)
+INSTANCE_FACE_LOOP(renderInstanceFacesCulled, 1, 0)
+INSTANCE_FACE_LOOP(renderInstanceFacesCulledShaded, 1, 1)
+
+void destroyInstanceBatch(InstanceBatch *batch)
+{
+    // the batch's triangles have to be out of the pool (resetTrianglePool) first
+    if (!batch) return;
+
+    free(batch->instances);
+    free(batch->projections);
+    free(batch->slots);
+    free(batch->faceNormals);
+    free(batch->facePoints);
+    free(batch->facePlanes);
+    free(batch->normalMagnitudes);
+    free(batch);
+}
@@ -0,0 +1,167 @@
+#define LIGHT_DIRECTIONAL 0
+#define LIGHT_POINT       1
+
+#define MAX_LIGHTS 8
+
+typedef struct LightStruct
+{
+    short type;
+    Vector3 vector;  // the direction the light shines to, or the position of a point light
+    float intensity;
+    float range;     // a point light fades out to nothing at this distance
+}Light;
+
+typedef struct LightSetStruct
+{
+    int count;
+    Light lights[MAX_LIGHTS];
+    float ambient;
+
+    // changed by every change to the lights, meshes compare it
+    // with the version their cached lighting was computed for
+    unsigned int version;
+}LightSet;
+
+// with no lights, meshes are shaded by a light at the camera as before
+LightSet lightSet = { 0 };
+
+int addDirectionalLight(Vector3 direction, float intensity);
+int addPointLight(Vector3 position, float intensity, float range);
+void setLightVector(int light, Vector3 vector);
+void setLightIntensity(int light, float intensity);
+void setAmbientLight(float ambient);
+void clearLights(void);
+void transformLights(Matrix4x4 inverseWorld, float scale, Light *objectLights);
+float shadeWithLights(Vector3 position, Vector3 normal, Light *objectLights);
+
+int addDirectionalLight(Vector3 direction, float intensity)
+{
+    Light *light;
+
+    if (lightSet.count >= MAX_LIGHTS)
+    {
+        DEBUG_MSG_FROM("Failed: Too many lights.", "addDirectionalLight");
+        return -1;
+    }
+
+    light = &lightSet.lights[lightSet.count];
+    light->type = LIGHT_DIRECTIONAL;
+    light->vector = normalizeVector3(direction);
+    light->intensity = intensity;
+    light->range = 0.0f;
+    lightSet.version++;
+
+    return lightSet.count++;
+}
+
+int addPointLight(Vector3 position, float intensity, float range)
+{
+    Light *light;
+
+    if (lightSet.count >= MAX_LIGHTS)
+    {
+        DEBUG_MSG_FROM("Failed: Too many lights.", "addPointLight");
+        return -1;
+    }
+
+    if (range <= 0.0f) return -2;
+
+    light = &lightSet.lights[lightSet.count];
+    light->type = LIGHT_POINT;
+    light->vector = position;
+    light->intensity = intensity;
+    light->range = range;
+    lightSet.version++;
+
+    return lightSet.count++;
+}
+
+void setLightVector(int light, Vector3 vector)
+{
+    if (light < 0 || light >= lightSet.count) return;
+
+    if (lightSet.lights[light].type == LIGHT_DIRECTIONAL)
+        vector = normalizeVector3(vector);
+
+    lightSet.lights[light].vector = vector;
+    lightSet.version++;
+}
+
+void setLightIntensity(int light, float intensity)
+{
+    if (light < 0 || light >= lightSet.count) return;
+
+    lightSet.lights[light].intensity = intensity;
+    lightSet.version++;
+}
+
+void setAmbientLight(float ambient)
+{
+    lightSet.ambient = ambient;
+    lightSet.version++;
+}
+
+void clearLights(void)
+{
+    lightSet.count = 0;
+    lightSet.version++;
+}
+
+void transformLights(Matrix4x4 inverseWorld, float scale, Light *objectLights)
+{
+    int i;
+    Light *light;
+
+    // once per mesh, so that the vertices can be lit in object space
+    // without transforming every position and normal to world space
+    for (i = 0; i < lightSet.count; i++)
+    {
+        light = &objectLights[i];
+        *light = lightSet.lights[i];
+
+        if (light->type == LIGHT_DIRECTIONAL)
+        {
+            // pointing back towards the light, ready for the dot product
+            light->vector = normalizeVector3(transformDirectionByMatrix(scaleVector3(light->vector, -1.0f), inverseWorld));
+        }
+        else
+        {
+            light->vector = transformVector3ByMatrix(light->vector, inverseWorld);
+            light->range /= scale; // object space distances are this much shorter
+        }
+    }
+}
+
+float shadeWithLights(Vector3 position, Vector3 normal, Light *objectLights)
+{
+    int i;
+    float shade = lightSet.ambient, distance, diffuse;
+    Vector3 toLight;
+    Light *light;
+
+    // the normal is expected to be normalized
+    for (i = 0; i < lightSet.count; i++)
+    {
+        light = &objectLights[i];
+
+        if (light->type == LIGHT_DIRECTIONAL)
+        {
+            diffuse = dotProductVector3(normal, light->vector);
+
+            if (diffuse > 0.0f) shade += diffuse * light->intensity;
+        }
+        else
+        {
+            toLight = subtractVector3(light->vector, position);
+            distance = magnitudeVector3(toLight);
+
+            if (distance >= light->range) continue;
+
+            diffuse = distance > 0.0f ? dotProductVector3(normal, toLight) / distance : 1.0f;
+
+            if (diffuse > 0.0f) shade += diffuse * light->intensity * (1.0f - distance / light->range);
+        }
+    }
+
+    return min(1.0f, shade);
+}
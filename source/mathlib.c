@@ -48,18 +48,26 @@ Point2D createPoint2D(int x, int y);
 Vector3 project(short width, short height, Vector3 vertex, Matrix4x4 projectionMatrix, Vector3 *out);
 Vector3 createVector3(float x, float y, float z);
 Vector3 scaleVector3(Vector3 vector, float scale);
+Vector3 lerpVector3(Vector3 a, Vector3 b, float t);
+Vector3 minVector3(Vector3 a, Vector3 b);
+Vector3 maxVector3(Vector3 a, Vector3 b);
+float getVector3Component(Vector3 vector, int axis);
 Vector3 normalizeVector3(Vector3 vector);
 Vector3 subtractVector3(Vector3 a, Vector3 b);
 Vector3 crossProductVector3(Vector3 a, Vector3 b);
 float dotProductVector3(Vector3 a, Vector3 b);
 float magnitudeVector3(Vector3 vector);
 Vector3 transformVector3ByMatrix(Vector3 vector, Matrix4x4 matrix);
+Vector3 transformDirectionByMatrix(Vector3 direction, Matrix4x4 matrix);
 Quaternion createQuaternion(float x, float y, float z, float w);
 Quaternion vectorToQuaternion(Vector3 vector, float scalar);
 Matrix4x4 createLookAtMatrix(Vector3 cameraPosition, Vector3 cameraTarget, Vector3 cameraUp);
 Matrix4x4 createRotationXYZMatrix(float x, float y, float z);
 Matrix4x4 createPerspectiveMatrix(float fov, float aspectRatio, float near, float far);
+Matrix4x4 createOrthographicMatrix(float height, float aspectRatio, float near, float far);
 Matrix4x4 createTranslationMatrix(float x, float y, float z);
+Matrix4x4 createScaleTranslationMatrix(Vector3 scale, Vector3 translation);
+float getMatrixMaxScale(Matrix4x4 matrix);
 Matrix4x4 multiplyMatrices(Matrix4x4 a, Matrix4x4 b);
 
 const Matrix4x4 emptyMatrix;
@@ -128,6 +136,28 @@ Vector3 scaleVector3(Vector3 vector, float scale)
     return result;
 }
 
+Vector3 lerpVector3(Vector3 a, Vector3 b, float t)
+{
+    return createVector3(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t);
+}
+
+Vector3 minVector3(Vector3 a, Vector3 b)
+{
+    return createVector3(min(a.x, b.x), min(a.y, b.y), min(a.z, b.z));
+}
+
+Vector3 maxVector3(Vector3 a, Vector3 b)
+{
+    return createVector3(max(a.x, b.x), max(a.y, b.y), max(a.z, b.z));
+}
+
+float getVector3Component(Vector3 vector, int axis)
+{
+    if (axis == 0) return vector.x;
+    if (axis == 1) return vector.y;
+    return vector.z;
+}
+
 Vector3 normalizeVector3(Vector3 vector)
 {
     float magnitude = magnitudeVector3(vector);
@@ -202,6 +232,14 @@ Vector3 transformVector3ByMatrix(Vector3 vector, Matrix4x4 matrix)
     return result;
 }
 
+Vector3 transformDirectionByMatrix(Vector3 direction, Matrix4x4 matrix)
+{
+    // rotation and scale only, a direction has no position to translate
+    return createVector3(matrix.m11 * direction.x + matrix.m21 * direction.y + matrix.m31 * direction.z,
+                         matrix.m12 * direction.x + matrix.m22 * direction.y + matrix.m32 * direction.z,
+                         matrix.m13 * direction.x + matrix.m23 * direction.y + matrix.m33 * direction.z);
+}
+
 Quaternion createQuaternion(float x, float y, float z, float w)
 {
     Quaternion q;
@@ -351,6 +389,43 @@ Matrix4x4 createPerspectiveMatrix(float fov, float aspectRatio, float near, floa
     return result;
 }
 
+Matrix4x4 createOrthographicMatrix(float height, float aspectRatio, float near, float far)
+{
+    Matrix4x4 result;
+
+    if (height <= 0.0f || aspectRatio <= 0.0f)
+    {
+        char temp[128];
+        sprintf(temp, "Failed: Invalid height: %f.", height);
+        DEBUG_MSG_FROM(temp, "createOrthographicMatrix");
+        return emptyMatrix;
+    }
+    if (near >= far)
+    {
+        char temp[128];
+        sprintf(temp, "Failed: Invalid near: %f.", near);
+        DEBUG_MSG_FROM(temp, "createOrthographicMatrix");
+        return emptyMatrix;
+    }
+
+    // the same ranges as createPerspectiveMatrix: x and y from -0.5 to 0.5
+    // across the view, which is height units tall, and z from 0 to 1
+    result.m11 = 1.0f / (height * aspectRatio);
+    result.m12 = result.m13 = result.m14 = 0.0f;
+
+    result.m22 = 1.0f / height;
+    result.m21 = result.m23 = result.m24 = 0.0f;
+
+    result.m33 = 1.0f / (near - far);
+    result.m31 = result.m32 = result.m34 = 0.0f;
+
+    result.m43 = near / (near - far);
+    result.m44 = 1.0f;
+    result.m41 = result.m42 = 0.0f;
+
+    return result;
+}
+
 Matrix4x4 createTranslationMatrix(float x, float y, float z)
 {
     Matrix4x4 result;
@@ -378,6 +453,25 @@ Matrix4x4 createTranslationMatrix(float x, float y, float z)
     return result;
 }
 
+Matrix4x4 createScaleTranslationMatrix(Vector3 scale, Vector3 translation)
+{
+    Matrix4x4 result = createTranslationMatrix(translation.x, translation.y, translation.z);
+
+    result.m11 = scale.x;
+    result.m22 = scale.y;
+    result.m33 = scale.z;
+
+    return result;
+}
+
+float getMatrixMaxScale(Matrix4x4 matrix)
+{
+    // the longest of the transformed axes, enough to scale a bounding sphere
+    return max(magnitudeVector3(createVector3(matrix.m11, matrix.m12, matrix.m13)),
+               max(magnitudeVector3(createVector3(matrix.m21, matrix.m22, matrix.m23)),
+                   magnitudeVector3(createVector3(matrix.m31, matrix.m32, matrix.m33))));
+}
+
 Matrix4x4 multiplyMatrices(Matrix4x4 a, Matrix4x4 b)
 {
     Matrix4x4 result;
@@ -0,0 +1,429 @@
+#define BSP_EPSILON    0.0001f // vertices closer than this to a plane count as lying on it
+#define BSP_CANDIDATES 8       // splitting planes tried for each node
+
+typedef struct BSPBuilderStruct
+{
+    Mesh *mesh;
+    BSP *bsp;
+    int vertexCapacity;
+    int faceCapacity;
+    int nodeCapacity;
+    int faceIndexCount;
+}BSPBuilder;
+
+typedef struct BSPWorkStruct
+{
+    int node;   // the node to fill in
+    int *faces; // the faces it is built from
+    int count;
+}BSPWork;
+
+int buildMeshBSP(Mesh *mesh);
+int buildBSPNode(BSPBuilder *b, BSPWork *work, BSPWork *front, BSPWork *back);
+int getFacePlane(Mesh *mesh, int faceNum, Vector3 *normal, float *d);
+int chooseBSPSplitter(Mesh *mesh, int *faces, int count);
+int splitFaceByPlane(BSPBuilder *b, int faceNum, Vector3 normal, float d, BSPWork *front, BSPWork *back);
+int addBSPVertex(BSPBuilder *b, int from, int to, float t);
+int addBSPFace(BSPBuilder *b, Face face);
+int addBSPNode(BSPBuilder *b);
+
+int buildMeshBSP(Mesh *mesh)
+{
+    int i, workCount = 0, workCapacity = 64, failed = 0;
+    BSPWork *work = NULL, *temp, current, front, back;
+    BSPBuilder b;
+
+    if (!mesh || mesh->faceCount <= 0) return -1;
+    if (!mesh->vertices) return -2; // splitting needs the exact positions of compressed meshes
+
+    // splitting grows the face array, which would leave the pool pointing at freed memory
+    for (i = 0; i < trianglePool.meshCount; i++)
+    {
+        if (trianglePool.meshes[i] == mesh)
+        {
+            DEBUG_MSG_FROM("Failed: Build the BSP before adding the mesh to the pool.", "buildMeshBSP");
+            return -3;
+        }
+    }
+
+    freeMeshBSP(mesh);
+
+    b.mesh = mesh;
+    b.vertexCapacity = mesh->vertexCount;
+    b.faceCapacity = mesh->faceCount;
+    b.nodeCapacity = 64;
+    b.faceIndexCount = 0;
+
+    if (!(b.bsp = malloc(sizeof *(b.bsp)))) return -4;
+
+    b.bsp->nodeCount = 0;
+    b.bsp->nodes = malloc(sizeof *(b.bsp->nodes) * b.nodeCapacity);
+    b.bsp->faceIndices = NULL;
+    b.bsp->stack = b.bsp->drawOrder = b.bsp->slots = NULL;
+
+    work = malloc(sizeof *work * workCapacity);
+    current.faces = malloc(sizeof *(current.faces) * mesh->faceCount);
+
+    if (!b.bsp->nodes || !work || !current.faces)
+    {
+        free(work);
+        free(current.faces);
+        mesh->bsp = b.bsp;
+        freeMeshBSP(mesh);
+        return -4;
+    }
+
+    for (i = 0; i < mesh->faceCount; i++)
+    {
+        current.faces[i] = i;
+    }
+
+    current.count = mesh->faceCount;
+    current.node = addBSPNode(&b);
+    work[workCount++] = current;
+
+    // the tree is built from an explicit work list instead of recursion,
+    // a BSP of a convex mesh is a chain as deep as the mesh has faces
+    while (workCount > 0)
+    {
+        current = work[--workCount];
+
+        if (workCount + 2 > workCapacity)
+        {
+            if (!(temp = realloc(work, sizeof *work * 2 * workCapacity)))
+            {
+                free(current.faces);
+                failed = 1;
+                break;
+            }
+
+            work = temp;
+            workCapacity *= 2;
+        }
+
+        failed = buildBSPNode(&b, &current, &front, &back);
+        free(current.faces);
+
+        if (failed)
+        {
+            free(front.faces);
+            free(back.faces);
+            break;
+        }
+
+        if (front.count) work[workCount++] = front;
+        else free(front.faces);
+
+        if (back.count) work[workCount++] = back;
+        else free(back.faces);
+    }
+
+    if (!failed)
+    {
+        b.bsp->stack = malloc(sizeof *(b.bsp->stack) * (2 * b.bsp->nodeCount + 1));
+        b.bsp->drawOrder = malloc(sizeof *(b.bsp->drawOrder) * mesh->faceCount);
+        b.bsp->slots = malloc(sizeof *(b.bsp->slots) * mesh->faceCount);
+        failed = !b.bsp->stack || !b.bsp->drawOrder || !b.bsp->slots;
+    }
+
+    while (workCount > 0)
+    {
+        free(work[--workCount].faces);
+    }
+
+    free(work);
+    mesh->bsp = b.bsp;
+
+    if (failed)
+    {
+        freeMeshBSP(mesh);
+        DEBUG_MSG_FROM("Failed: Couldn't allocate memory for the BSP.", "buildMeshBSP");
+        return -4;
+    }
+
+    b.bsp->slots[0] = -1; // not ordered yet
+
+    // the split faces got new vertices, and the bounds of the faces changed
+    freeMeshBVH(mesh);
+
+    return b.bsp->nodeCount;
+}
+
+int buildBSPNode(BSPBuilder *b, BSPWork *work, BSPWork *front, BSPWork *back)
+{
+    int i, j, face, splitter, *indices;
+    float dist;
+    short onFront, onBack;
+    Vector3 normal;
+    Mesh *mesh = b->mesh;
+    BSPNode *node;
+
+    // every face can end up as two fragments on either side
+    front->faces = malloc(sizeof *(front->faces) * 2 * work->count);
+    back->faces = malloc(sizeof *(back->faces) * 2 * work->count);
+    front->count = back->count = 0;
+
+    if (!front->faces || !back->faces) return -1; // the caller frees both lists
+
+    if (!(indices = realloc(b->bsp->faceIndices, sizeof *indices * (b->faceIndexCount + work->count))))
+        return -1;
+
+    b->bsp->faceIndices = indices;
+
+    node = &b->bsp->nodes[work->node];
+    node->firstFace = b->faceIndexCount;
+    node->faceCount = 0;
+    node->front = node->back = -1;
+
+    splitter = chooseBSPSplitter(mesh, work->faces, work->count);
+
+    if (splitter < 0) // only degenerate faces left, they can be drawn in any order
+    {
+        node->normal = createVector3(0.0f, 0.0f, 0.0f);
+        node->d = 0.0f;
+
+        for (i = 0; i < work->count; i++)
+        {
+            b->bsp->faceIndices[b->faceIndexCount++] = work->faces[i];
+        }
+
+        node->faceCount = work->count;
+
+        return 0;
+    }
+
+    getFacePlane(mesh, splitter, &node->normal, &node->d);
+    normal = node->normal;
+
+    for (i = 0; i < work->count; i++)
+    {
+        face = work->faces[i];
+        onFront = onBack = 0;
+
+        for (j = 0; j < 3; j++)
+        {
+            dist = dotProductVector3(normal, mesh->vertices[mesh->faces[face].indices[j]]) - b->bsp->nodes[work->node].d;
+
+            if (dist > BSP_EPSILON) onFront = 1;
+            else if (dist < -BSP_EPSILON) onBack = 1;
+        }
+
+        if (!onFront && !onBack)
+            b->bsp->faceIndices[b->faceIndexCount++] = face;
+        else if (!onBack)
+            front->faces[front->count++] = face;
+        else if (!onFront)
+            back->faces[back->count++] = face;
+        else if (splitFaceByPlane(b, face, normal, b->bsp->nodes[work->node].d, front, back))
+            return -1;
+    }
+
+    node = &b->bsp->nodes[work->node];
+    node->faceCount = b->faceIndexCount - node->firstFace;
+
+    // the children are allocated here so the node knows them,
+    // the work list fills them in later
+    if (front->count)
+    {
+        if ((front->node = addBSPNode(b)) < 0) return -1;
+        b->bsp->nodes[work->node].front = front->node;
+    }
+
+    if (back->count)
+    {
+        if ((back->node = addBSPNode(b)) < 0) return -1;
+        b->bsp->nodes[work->node].back = back->node;
+    }
+
+    return 0;
+}
+
+int getFacePlane(Mesh *mesh, int faceNum, Vector3 *normal, float *d)
+{
+    Vector3 v0 = mesh->vertices[mesh->faces[faceNum].indices[0]];
+    Vector3 v1 = mesh->vertices[mesh->faces[faceNum].indices[1]];
+    Vector3 v2 = mesh->vertices[mesh->faces[faceNum].indices[2]];
+    Vector3 cross = crossProductVector3(subtractVector3(v1, v0), subtractVector3(v2, v0));
+    float magnitude = magnitudeVector3(cross);
+
+    if (magnitude < BSP_EPSILON * BSP_EPSILON) return 0; // no area, no plane
+
+    // normalizeVector3() gives up on the small crosses of small faces
+    *normal = scaleVector3(cross, 1.0f / magnitude);
+    *d = dotProductVector3(*normal, v0);
+
+    return 1;
+}
+
+int chooseBSPSplitter(Mesh *mesh, int *faces, int count)
+{
+    int i, j, k, candidate, step, score, bestScore = 0, best = -1;
+    int frontCount, backCount, splits;
+    short onFront, onBack;
+    float d, dist;
+    Vector3 normal;
+
+    // a few evenly spread candidates are scored by how many faces they
+    // would split, and by how unevenly they would divide the rest
+    step = max(1, count / BSP_CANDIDATES);
+
+    for (i = 0; i < count; i += step)
+    {
+        candidate = faces[i];
+
+        if (!getFacePlane(mesh, candidate, &normal, &d)) continue;
+
+        frontCount = backCount = splits = 0;
+
+        for (j = 0; j < count; j++)
+        {
+            onFront = onBack = 0;
+
+            for (k = 0; k < 3; k++)
+            {
+                dist = dotProductVector3(normal, mesh->vertices[mesh->faces[faces[j]].indices[k]]) - d;
+
+                if (dist > BSP_EPSILON) onFront = 1;
+                else if (dist < -BSP_EPSILON) onBack = 1;
+            }
+
+            if (onFront && onBack) splits++;
+            else if (onFront) frontCount++;
+            else if (onBack) backCount++;
+        }
+
+        score = 8 * splits + abs(frontCount - backCount);
+
+        if (best < 0 || score < bestScore)
+        {
+            best = candidate;
+            bestScore = score;
+        }
+    }
+
+    return best;
+}
+
+int splitFaceByPlane(BSPBuilder *b, int faceNum, Vector3 normal, float d, BSPWork *front, BSPWork *back)
+{
+    int i, j, k, v, frontPoly[4], backPoly[4], frontSize = 0, backSize = 0;
+    int first = 1, fragment;
+    float dist[3];
+    Face face = b->mesh->faces[faceNum], part;
+
+    for (i = 0; i < 3; i++)
+    {
+        dist[i] = dotProductVector3(normal, b->mesh->vertices[face.indices[i]]) - d;
+    }
+
+    // the triangle is cut into a polygon on each side, vertices on
+    // the plane and the new ones where edges cross it go to both
+    for (i = 0; i < 3; i++)
+    {
+        j = (i + 1) % 3;
+
+        if (dist[i] >= -BSP_EPSILON) frontPoly[frontSize++] = face.indices[i];
+        if (dist[i] <= BSP_EPSILON) backPoly[backSize++] = face.indices[i];
+
+        if ((dist[i] > BSP_EPSILON && dist[j] < -BSP_EPSILON) ||
+            (dist[i] < -BSP_EPSILON && dist[j] > BSP_EPSILON))
+        {
+            if ((v = addBSPVertex(b, face.indices[i], face.indices[j], dist[i] / (dist[i] - dist[j]))) < 0)
+                return -1;
+
+            frontPoly[frontSize++] = v;
+            backPoly[backSize++] = v;
+        }
+    }
+
+    // the polygons are fanned back into triangles with the original winding,
+    // the first one takes the place of the original face
+    for (k = 1; k < frontSize - 1; k++)
+    {
+        part = createFaceWithNormal(frontPoly[0], frontPoly[k], frontPoly[k + 1], face.normal);
+
+        if (first) { b->mesh->faces[faceNum] = part; fragment = faceNum; first = 0; }
+        else if ((fragment = addBSPFace(b, part)) < 0) return -1;
+
+        front->faces[front->count++] = fragment;
+    }
+
+    for (k = 1; k < backSize - 1; k++)
+    {
+        part = createFaceWithNormal(backPoly[0], backPoly[k], backPoly[k + 1], face.normal);
+
+        if (first) { b->mesh->faces[faceNum] = part; fragment = faceNum; first = 0; }
+        else if ((fragment = addBSPFace(b, part)) < 0) return -1;
+
+        back->faces[back->count++] = fragment;
+    }
+
+    return 0;
+}
+
+int addBSPVertex(BSPBuilder *b, int from, int to, float t)
+{
+    int capacity;
+    Vector3 *vertices;
+    Mesh *mesh = b->mesh;
+
+    if (mesh->vertexCount == b->vertexCapacity)
+    {
+        capacity = 2 * b->vertexCapacity;
+
+        if (!(vertices = realloc(mesh->vertices, sizeof *vertices * capacity))) return -1;
+        mesh->vertices = vertices;
+
+        if (!(vertices = realloc(mesh->vertexProjections, sizeof *vertices * capacity))) return -1;
+        mesh->vertexProjections = vertices;
+
+        if (mesh->vertexNormals)
+        {
+            if (!(vertices = realloc(mesh->vertexNormals, sizeof *vertices * capacity))) return -1;
+            mesh->vertexNormals = vertices;
+        }
+
+        b->vertexCapacity = capacity;
+    }
+
+    mesh->vertices[mesh->vertexCount] = lerpVector3(mesh->vertices[from], mesh->vertices[to], t);
+
+    if (mesh->vertexNormals)
+        mesh->vertexNormals[mesh->vertexCount] =
+            normalizeVector3(lerpVector3(mesh->vertexNormals[from], mesh->vertexNormals[to], t));
+
+    return mesh->vertexCount++;
+}
+
+int addBSPFace(BSPBuilder *b, Face face)
+{
+    Face *faces;
+    Mesh *mesh = b->mesh;
+
+    if (mesh->faceCount == b->faceCapacity)
+    {
+        if (!(faces = realloc(mesh->faces, sizeof *faces * 2 * b->faceCapacity))) return -1;
+
+        mesh->faces = faces;
+        b->faceCapacity *= 2;
+    }
+
+    mesh->faces[mesh->faceCount] = face;
+
+    return mesh->faceCount++;
+}
+
+int addBSPNode(BSPBuilder *b)
+{
+    BSPNode *nodes;
+
+    if (b->bsp->nodeCount == b->nodeCapacity)
+    {
+        if (!(nodes = realloc(b->bsp->nodes, sizeof *nodes * 2 * b->nodeCapacity))) return -1;
+
+        b->bsp->nodes = nodes;
+        b->nodeCapacity *= 2;
+    }
+
+    return b->bsp->nodeCount++;
+}
@@ -0,0 +1,566 @@
+#define MESH_CHUNK_FACES 1024
+#define MESH_LOADER_INITIAL_CAPACITY 1024
+
+typedef struct MeshChunkStruct
+{
+    long fileOffset; // start of the chunk's first face line, for reading the chunk back in
+    int faceCount;
+    int firstFace;   // index of the chunk's first face in mesh->faces, -1 when evicted
+    int firstNormal; // the normals generated for the chunk's faces without one follow from here
+    Vector3 center;  // object space bounding sphere of the chunk's faces
+    float radius;
+}MeshChunk;
+
+typedef struct MeshLoaderStruct
+{
+    Mesh *mesh;
+    TrianglePool *pool;
+    FILE *file;       // the file being streamed in
+    FILE *reloadFile; // a second handle for reading evicted chunks back in
+    int done;
+
+    int vertexCapacity;
+    int normalCapacity; // of mesh->normals and normalMap
+    int faceCapacity;
+
+    // the mesh->normals index of each normal of the file, the generated
+    // normals are stored in between as the chunks are published
+    int *normalMap;
+    int fileNormalCount;
+
+    int chunkCount;
+    int chunkCapacity;
+    MeshChunk *chunks;
+
+    int pendingFaces;   // faces parsed after mesh->faceCount that are not published yet
+    long pendingOffset;
+
+    long memoryBudget;  // bytes the vertex, normal and face arrays may take at once, 0 = no limit
+}MeshLoader;
+
+MeshLoader *newMeshLoader(char fileName[256], TrianglePool *pool, long memoryBudget);
+int stepMeshLoader(MeshLoader *ml, Camera *camera, int lineBudget);
+int reserveLoaderVertices(MeshLoader *ml, int count);
+int reserveLoaderNormals(MeshLoader *ml, int count);
+int reserveLoaderFaces(MeshLoader *ml, int count);
+int resizeLoaderFaces(MeshLoader *ml, int capacity);
+int loaderFaceCapacity(int count);
+int publishMeshChunk(MeshLoader *ml);
+void evictMeshChunk(MeshLoader *ml, int chunkNum);
+int reloadMeshChunk(MeshLoader *ml, int chunkNum);
+void balanceMeshChunks(MeshLoader *ml, Camera *camera);
+long meshLoaderFixedBytes(MeshLoader *ml);
+long meshLoaderResidentBytes(MeshLoader *ml);
+int meshChunkFits(MeshLoader *ml, MeshChunk *chunk);
+float meshChunkDistance(MeshChunk *chunk, Vector3 eye);
+void destroyMeshLoader(MeshLoader *ml);
+
+MeshLoader *newMeshLoader(char fileName[256], TrianglePool *pool, long memoryBudget)
+{
+    MeshLoader *ptr = NULL;
+
+    if (!pool || !pool->triangles) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    if (!(ptr->file = fopen(fileName, "r")))
+    {
+        free(ptr);
+        return NULL;
+    }
+
+    // the arrays start small and grow as the file is read,
+    // so nothing has to scan the whole file before the first frame
+    ptr->mesh = newMesh(fileName, MESH_LOADER_INITIAL_CAPACITY, MESH_LOADER_INITIAL_CAPACITY, MESH_LOADER_INITIAL_CAPACITY);
+    ptr->chunkCapacity = 64;
+    ptr->chunks = malloc(sizeof *(ptr->chunks) * ptr->chunkCapacity);
+    ptr->normalMap = malloc(sizeof *(ptr->normalMap) * MESH_LOADER_INITIAL_CAPACITY);
+
+    if (!ptr->mesh || !ptr->chunks || !ptr->normalMap)
+    {
+        destroyMesh(ptr->mesh);
+        free(ptr->chunks);
+        free(ptr->normalMap);
+        fclose(ptr->file);
+        free(ptr);
+        return NULL;
+    }
+
+    // chunks evicted to stay in the budget or to make room in the pool are read back from here
+    ptr->reloadFile = fopen(fileName, "r");
+
+    ptr->vertexCapacity = ptr->normalCapacity = ptr->faceCapacity = MESH_LOADER_INITIAL_CAPACITY;
+    ptr->mesh->vertexCount = ptr->mesh->normalCount = ptr->mesh->faceCount = 0;
+
+    ptr->pool = pool;
+    registerPoolMesh(pool, ptr->mesh);
+    ptr->done = 0;
+    ptr->chunkCount = 0;
+    ptr->pendingFaces = 0;
+    ptr->pendingOffset = 0;
+    ptr->fileNormalCount = 0;
+    ptr->memoryBudget = memoryBudget;
+
+    return ptr;
+}
+
+int stepMeshLoader(MeshLoader *ml, Camera *camera, int lineBudget)
+{
+    int lines = 0;
+    long offset;
+    char line[256] = "", errorMsg[256] = "";
+    Mesh *mesh;
+    Vector3 vec;
+    Face face;
+
+    if (!ml) return -1;
+
+    mesh = ml->mesh;
+
+    // chunks are published and evicted in place, which compressMesh() doesn't support
+    if (!mesh->vertices) return -3;
+
+    while (!ml->done && lines < lineBudget)
+    {
+        offset = ftell(ml->file);
+
+        if (!fgets(line, sizeof line, ml->file)) // end of file, publish what's left
+        {
+            if (ml->pendingFaces && publishMeshChunk(ml))
+            {
+                DEBUG_MSG_FROM("Failed: The triangle pool is full.", "stepMeshLoader");
+                return -2;
+            }
+
+            fclose(ml->file);
+            ml->file = NULL;
+            ml->done = 1;
+            break;
+        }
+
+        lines++;
+
+        if (line[0] == 'v' && line[1] == ' ') // this line is a vertex
+        {
+            if (sscanf(line, "%*s %f %f %f", &vec.x, &vec.y, &vec.z) != 4 ||
+                !reserveLoaderVertices(ml, mesh->vertexCount + 1))
+            {
+                sprintf(errorMsg, "Failed: Reading vertex %d failed.", mesh->vertexCount);
+                break;
+            }
+
+            mesh->vertices[mesh->vertexCount++] = vec;
+        }
+        else if (line[0] == 'v' && line[1] == 'n') // this line is a normal
+        {
+            if (sscanf(line, "%*s %f %f %f", &vec.x, &vec.y, &vec.z) != 4 ||
+                !reserveLoaderNormals(ml, mesh->normalCount + 1))
+            {
+                sprintf(errorMsg, "Failed: Reading normal %d failed.", mesh->normalCount);
+                break;
+            }
+
+            ml->normalMap[ml->fileNormalCount++] = mesh->normalCount;
+            mesh->normals[mesh->normalCount++] = normalizeVector3(vec);
+        }
+        else if (line[0] == 'f' && line[1] == ' ') // this line is a face
+        {
+            // a face can only be published once everything it refers to has been read,
+            // a face without a normal (-1) gets a generated one when it's published
+            if (!parseFaceLine(line, &face) ||
+                face.indices[0] < 0 || face.indices[0] >= mesh->vertexCount ||
+                face.indices[1] < 0 || face.indices[1] >= mesh->vertexCount ||
+                face.indices[2] < 0 || face.indices[2] >= mesh->vertexCount ||
+                face.normal < -1 || face.normal >= ml->fileNormalCount ||
+                !reserveLoaderFaces(ml, mesh->faceCount + ml->pendingFaces + 1))
+            {
+                sprintf(errorMsg, "Failed: Reading face %d failed.", mesh->faceCount + ml->pendingFaces);
+                break;
+            }
+
+            if (!ml->pendingFaces)
+                ml->pendingOffset = offset;
+
+            if (face.normal >= 0)
+                face.normal = ml->normalMap[face.normal];
+
+            mesh->faces[mesh->faceCount + ml->pendingFaces++] = face;
+
+            if (ml->pendingFaces == MESH_CHUNK_FACES && publishMeshChunk(ml))
+            {
+                strcpy(errorMsg, "Failed: The triangle pool is full.");
+                break;
+            }
+        }
+    }
+
+    if (errorMsg[0])
+    {
+        DEBUG_MSG_FROM(errorMsg, "stepMeshLoader");
+        return -2;
+    }
+
+    balanceMeshChunks(ml, camera);
+
+    return !ml->done;
+}
+
+int reserveLoaderVertices(MeshLoader *ml, int count)
+{
+    int capacity;
+    Vector3 *vertices, *projections;
+
+    if (count <= ml->vertexCapacity) return 1;
+
+    capacity = max(count, 2 * ml->vertexCapacity);
+
+    if (!(vertices = realloc(ml->mesh->vertices, sizeof *vertices * capacity))) return 0;
+
+    ml->mesh->vertices = vertices;
+
+    if (!(projections = realloc(ml->mesh->vertexProjections, sizeof *projections * capacity))) return 0;
+
+    ml->mesh->vertexProjections = projections;
+    ml->vertexCapacity = capacity;
+
+    return 1;
+}
+
+int reserveLoaderNormals(MeshLoader *ml, int count)
+{
+    int capacity, *normalMap;
+    Vector3 *normals;
+
+    if (count <= ml->normalCapacity) return 1;
+
+    capacity = max(count, 2 * ml->normalCapacity);
+
+    if (!(normals = realloc(ml->mesh->normals, sizeof *normals * capacity))) return 0;
+
+    ml->mesh->normals = normals;
+
+    if (!(normalMap = realloc(ml->normalMap, sizeof *normalMap * capacity))) return 0;
+
+    ml->normalMap = normalMap;
+    ml->normalCapacity = capacity;
+
+    return 1;
+}
+
+int reserveLoaderFaces(MeshLoader *ml, int count)
+{
+    if (count <= ml->faceCapacity) return 1;
+
+    // under a budget the array grows a chunk at a time, so that it doesn't go over by doubling
+    return resizeLoaderFaces(ml, ml->memoryBudget ? loaderFaceCapacity(count) : max(count, 2 * ml->faceCapacity));
+}
+
+int resizeLoaderFaces(MeshLoader *ml, int capacity)
+{
+    int i;
+    Face *faces;
+
+    if (!(faces = realloc(ml->mesh->faces, sizeof *faces * capacity))) return 0;
+
+    // the pool points at the published faces, which may have moved
+    for (i = 0; i < ml->mesh->faceCount; i++)
+    {
+        ml->pool->triangles[faces[i].poolIndex].face = &faces[i];
+    }
+
+    ml->mesh->faces = faces;
+    ml->faceCapacity = capacity;
+
+    return 1;
+}
+
+int loaderFaceCapacity(int count)
+{
+    // whole chunks, never below the initial size
+    return max(MESH_LOADER_INITIAL_CAPACITY, (count + MESH_CHUNK_FACES - 1) / MESH_CHUNK_FACES * MESH_CHUNK_FACES);
+}
+
+int publishMeshChunk(MeshLoader *ml)
+{
+    int i, j, first, missing = 0;
+    Vector3 vec, minVec, maxVec, v0, v1, v2;
+    Face *face;
+    MeshChunk *chunk, *chunks;
+    Mesh *mesh = ml->mesh;
+
+    // make room in the pool by dropping far away chunks, if there are any
+    while (ml->pool->triCount + ml->pendingFaces > ml->pool->maxTriCount && mesh->faceCount)
+    {
+        balanceMeshChunks(ml, NULL);
+    }
+
+    if (ml->pool->triCount + ml->pendingFaces > ml->pool->maxTriCount) return -1;
+
+    if (ml->chunkCount == ml->chunkCapacity)
+    {
+        if (!(chunks = realloc(ml->chunks, sizeof *chunks * 2 * ml->chunkCapacity))) return -2;
+
+        ml->chunks = chunks;
+        ml->chunkCapacity *= 2;
+    }
+
+    first = mesh->faceCount;
+
+    for (i = first; i < first + ml->pendingFaces; i++)
+    {
+        if (mesh->faces[i].normal < 0) missing++;
+    }
+
+    if (!reserveLoaderNormals(ml, mesh->normalCount + missing)) return -2;
+
+    chunk = &ml->chunks[ml->chunkCount++];
+    chunk->fileOffset = ml->pendingOffset;
+    chunk->faceCount = ml->pendingFaces;
+    chunk->firstFace = first;
+    chunk->firstNormal = mesh->normalCount;
+
+    minVec = maxVec = mesh->vertices[mesh->faces[first].indices[0]];
+
+    for (i = first; i < first + chunk->faceCount; i++)
+    {
+        face = &mesh->faces[i];
+
+        // the generated normals are in the order of the chunk's faces, which
+        // is how reloadMeshChunk gives them back to the faces read back in
+        if (face->normal < 0)
+        {
+            v0 = mesh->vertices[face->indices[0]];
+            v1 = mesh->vertices[face->indices[1]];
+            v2 = mesh->vertices[face->indices[2]];
+
+            face->normal = mesh->normalCount;
+            mesh->normals[mesh->normalCount++] =
+                normalizeVector3(crossProductVector3(subtractVector3(v1, v0), subtractVector3(v2, v0)));
+        }
+
+        for (j = 0; j < 3; j++)
+        {
+            vec = mesh->vertices[face->indices[j]];
+            minVec = createVector3(min(minVec.x, vec.x), min(minVec.y, vec.y), min(minVec.z, vec.z));
+            maxVec = createVector3(max(maxVec.x, vec.x), max(maxVec.y, vec.y), max(maxVec.z, vec.z));
+        }
+
+        addTriangleToPool(ml->pool, mesh, &mesh->faces[i]);
+    }
+
+    chunk->center = scaleVector3(addVector3(minVec, maxVec), 0.5f);
+    chunk->radius = magnitudeVector3(subtractVector3(maxVec, chunk->center));
+
+    mesh->faceCount += ml->pendingFaces;
+    ml->pendingFaces = 0;
+    freeMeshBVH(mesh); // the faces changed, picking builds a new one when needed
+    mesh->lightingVersion = 0; // and the cached face lighting is computed again
+
+    return 0;
+}
+
+void evictMeshChunk(MeshLoader *ml, int chunkNum)
+{
+    int i, first, count;
+    Mesh *mesh = ml->mesh;
+    MeshChunk *chunk = &ml->chunks[chunkNum];
+
+    first = chunk->firstFace;
+    count = chunk->faceCount;
+
+    if (first < 0) return;
+
+    for (i = first; i < first + count; i++)
+    {
+        removeTriangleFromPool(ml->pool, mesh->faces[i].poolIndex);
+    }
+
+    // close the gap, the faces that are parsed but not published yet move along
+    memmove(&mesh->faces[first], &mesh->faces[first + count],
+            sizeof *(mesh->faces) * (mesh->faceCount + ml->pendingFaces - first - count));
+
+    mesh->faceCount -= count;
+
+    for (i = first; i < mesh->faceCount; i++)
+    {
+        ml->pool->triangles[mesh->faces[i].poolIndex].face = &mesh->faces[i];
+    }
+
+    for (i = 0; i < ml->chunkCount; i++)
+    {
+        if (ml->chunks[i].firstFace > first)
+            ml->chunks[i].firstFace -= count;
+    }
+
+    chunk->firstFace = -1;
+    freeMeshBVH(mesh);
+    mesh->lightingVersion = 0;
+}
+
+int reloadMeshChunk(MeshLoader *ml, int chunkNum)
+{
+    int i, read = 0, generated;
+    char line[256];
+    Face *face;
+    Mesh *mesh = ml->mesh;
+    MeshChunk *chunk = &ml->chunks[chunkNum];
+
+    if (chunk->firstFace >= 0) return 0;
+    if (!ml->reloadFile) return -1;
+    if (ml->pool->triCount + chunk->faceCount > ml->pool->maxTriCount) return -1;
+    if (!reserveLoaderFaces(ml, mesh->faceCount + ml->pendingFaces + chunk->faceCount)) return -1;
+
+    // the unpublished faces make room for the chunk
+    memmove(&mesh->faces[mesh->faceCount + chunk->faceCount], &mesh->faces[mesh->faceCount],
+            sizeof *(mesh->faces) * ml->pendingFaces);
+
+    fseek(ml->reloadFile, chunk->fileOffset, SEEK_SET);
+
+    // the chunk is the next faceCount face lines from its offset on
+    while (read < chunk->faceCount && fgets(line, sizeof line, ml->reloadFile))
+    {
+        if (line[0] == 'f' && line[1] == ' ' && parseFaceLine(line, &mesh->faces[mesh->faceCount + read]))
+            read++;
+    }
+
+    if (read < chunk->faceCount)
+    {
+        memmove(&mesh->faces[mesh->faceCount], &mesh->faces[mesh->faceCount + chunk->faceCount],
+                sizeof *(mesh->faces) * ml->pendingFaces);
+        DEBUG_MSG_FROM("Failed: Couldn't read an evicted chunk back in.", "reloadMeshChunk");
+        return -2;
+    }
+
+    chunk->firstFace = mesh->faceCount;
+    generated = chunk->firstNormal;
+
+    for (i = chunk->firstFace; i < chunk->firstFace + chunk->faceCount; i++)
+    {
+        face = &mesh->faces[i];
+        face->normal = (face->normal >= 0) ? ml->normalMap[face->normal] : generated++;
+        addTriangleToPool(ml->pool, mesh, face);
+    }
+
+    mesh->faceCount += chunk->faceCount;
+    freeMeshBVH(mesh);
+    mesh->lightingVersion = 0;
+
+    return 0;
+}
+
+void balanceMeshChunks(MeshLoader *ml, Camera *camera)
+{
+    int i, farthest, nearest, capacity;
+    float dist, farthestDist, nearestDist;
+    Vector3 eye;
+
+    // only the faces can be evicted, every chunk refers to the same vertices and normals
+    if (ml->memoryBudget && meshLoaderFixedBytes(ml) >= ml->memoryBudget)
+    {
+        DEBUG_MSG_FROM("Failed: The vertices and normals alone take more than the memory budget, the budget is turned off.", "balanceMeshChunks");
+        ml->memoryBudget = 0;
+    }
+
+    // without a camera (the pool is full) the chunk loaded first counts as the farthest
+    eye = camera ? transformVector3ByMatrix(camera->position, Invert(getMeshWorldMatrix(ml->mesh)))
+                 : createVector3(0.0f, 0.0f, 0.0f);
+
+    while (1)
+    {
+        farthest = nearest = -1;
+        farthestDist = -1000000.0f;
+        nearestDist = 1000000.0f;
+
+        for (i = 0; i < ml->chunkCount; i++)
+        {
+            dist = camera ? meshChunkDistance(&ml->chunks[i], eye) : -i;
+
+            if (ml->chunks[i].firstFace >= 0 && dist > farthestDist)
+            {
+                farthest = i;
+                farthestDist = dist;
+            }
+            else if (ml->chunks[i].firstFace < 0 && dist < nearestDist)
+            {
+                nearest = i;
+                nearestDist = dist;
+            }
+        }
+
+        if (!camera)
+        {
+            if (farthest >= 0) evictMeshChunk(ml, farthest);
+            return;
+        }
+
+        if (ml->memoryBudget && meshLoaderResidentBytes(ml) > ml->memoryBudget && farthest >= 0)
+        {
+            // over the budget, drop the farthest chunk and give back the memory of its faces
+            evictMeshChunk(ml, farthest);
+            capacity = loaderFaceCapacity(ml->mesh->faceCount + ml->pendingFaces);
+
+            if (capacity < ml->faceCapacity) resizeLoaderFaces(ml, capacity);
+
+            continue;
+        }
+
+        // bring back at most one evicted chunk per call, trading the farthest resident
+        // chunk for it when it's closer and there's no room for it in the budget or the pool
+        if (nearest >= 0)
+        {
+            if (!meshChunkFits(ml, &ml->chunks[nearest]) && farthest >= 0 && nearestDist < farthestDist)
+                evictMeshChunk(ml, farthest);
+
+            if (meshChunkFits(ml, &ml->chunks[nearest]))
+                reloadMeshChunk(ml, nearest);
+        }
+
+        return;
+    }
+}
+
+long meshLoaderFixedBytes(MeshLoader *ml)
+{
+    // the vertices and their projections, the normals and the file's normal indices, as allocated
+    return (long)(ml->vertexCapacity * 2 * sizeof(Vector3) +
+                  ml->normalCapacity * (sizeof(Vector3) + sizeof(int)));
+}
+
+long meshLoaderResidentBytes(MeshLoader *ml)
+{
+    return meshLoaderFixedBytes(ml) + (long)(ml->faceCapacity * sizeof(Face));
+}
+
+int meshChunkFits(MeshLoader *ml, MeshChunk *chunk)
+{
+    int capacity;
+
+    // the faces parsed but not published yet have the first claim on the pool
+    if (ml->pool->triCount + ml->pendingFaces + chunk->faceCount > ml->pool->maxTriCount) return 0;
+
+    if (!ml->memoryBudget) return 1;
+
+    // the face array as reloadMeshChunk would grow it
+    capacity = max(ml->faceCapacity, loaderFaceCapacity(ml->mesh->faceCount + ml->pendingFaces + chunk->faceCount));
+
+    return meshLoaderFixedBytes(ml) + (long)(capacity * sizeof(Face)) <= ml->memoryBudget;
+}
+
+float meshChunkDistance(MeshChunk *chunk, Vector3 eye)
+{
+    return magnitudeVector3(subtractVector3(chunk->center, eye)) - chunk->radius;
+}
+
+void destroyMeshLoader(MeshLoader *ml)
+{
+    if (!ml) return;
+
+    if (ml->file) fclose(ml->file);
+    if (ml->reloadFile) fclose(ml->reloadFile);
+
+    free(ml->chunks);
+    free(ml->normalMap);
+    free(ml);
+}
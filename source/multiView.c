@@ -0,0 +1,204 @@
+#define VIEW_PERSPECTIVE  0
+#define VIEW_ORTHOGRAPHIC 1
+
+// an orthographic view culls, shades and sorts the faces as seen
+// from this far away, where the lines of sight are nearly parallel
+#define ORTHOGRAPHIC_EYE_DISTANCE 10000.0f
+
+typedef struct ViewStruct
+{
+    Camera camera;
+    Screen screen;
+    FrameBuffer *target; // the view is drawn into this buffer, at its size
+
+    short projection;
+    float height;        // world units from the top of an orthographic view to the bottom
+
+    // the pool as this view left it: the views see the faces in different orders,
+    // and the insertion sort is only fast from the order of the same view's last frame
+    int orderCapacity;
+    int orderCount;
+    TriangleObj *order;
+}View;
+
+typedef struct MeshViewStateStruct
+{
+    Matrix4x4 worldMatrix;
+    Matrix4x4 inverseWorld;
+    short shade;
+}MeshViewState;
+
+// the work renderViews shares between the views, one for each mesh
+MeshViewState meshViewStates[MAX_POOL_MESHES];
+
+View createPerspectiveView(FrameBuffer *target, Vector3 position, Vector3 lookAt);
+View createOrthographicView(FrameBuffer *target, Vector3 position, Vector3 lookAt, float height);
+Matrix4x4 getViewMatrix(View *view);
+Vector3 getViewEye(View *view);
+int restoreViewOrder(View *view);
+void saveViewOrder(View *view);
+int renderViews(View *views, int viewCount, Mesh **meshes, int meshCount);
+void destroyView(View *view);
+
+View createPerspectiveView(FrameBuffer *target, Vector3 position, Vector3 lookAt)
+{
+    View view;
+
+    view.camera.position = position;
+    view.camera.target = lookAt;
+    view.screen = createScreen(target->width, target->height);
+    view.target = target;
+    view.projection = VIEW_PERSPECTIVE;
+    view.height = 0.0f;
+    view.orderCapacity = view.orderCount = 0;
+    view.order = NULL;
+
+    return view;
+}
+
+View createOrthographicView(FrameBuffer *target, Vector3 position, Vector3 lookAt, float height)
+{
+    View view = createPerspectiveView(target, position, lookAt);
+
+    view.projection = VIEW_ORTHOGRAPHIC;
+    view.height = height;
+
+    return view;
+}
+
+Matrix4x4 getViewMatrix(View *view)
+{
+    if (view->projection == VIEW_PERSPECTIVE)
+        return getViewProjectionMatrix(&view->screen, &view->camera);
+
+    // the near and far planes of getViewProjectionMatrix
+    return multiplyMatrices(
+        createLookAtMatrix(view->camera.position, view->camera.target, createVector3(0.0f, 1.0f, 0.0f)),
+        createOrthographicMatrix(view->height, view->screen.width / (float)view->screen.height, 0.1f, 100.0f));
+}
+
+Vector3 getViewEye(View *view)
+{
+    Vector3 back;
+
+    if (view->projection == VIEW_PERSPECTIVE) return view->camera.position;
+
+    back = normalizeVector3(subtractVector3(view->camera.position, view->camera.target));
+
+    return addVector3(view->camera.target, scaleVector3(back, ORTHOGRAPHIC_EYE_DISTANCE));
+}
+
+int restoreViewOrder(View *view)
+{
+    int i, n = view->orderCount;
+    TriangleObj *saved, *triangles = trianglePool.triangles;
+
+    if (!view->order || n != trianglePool.triCount) return -1;
+
+    // the saved order is only used if it still holds the same triangles as the pool
+    for (i = 0; i < n; i++)
+    {
+        saved = &view->order[i];
+
+        if (TRIANGLE_SLOT(saved) >= n || triangles[TRIANGLE_SLOT(saved)].face != saved->face ||
+            triangles[TRIANGLE_SLOT(saved)].instance != saved->instance)
+            return -2;
+    }
+
+    memcpy(triangles, view->order, sizeof *triangles * n);
+
+    for (i = 0; i < n; i++)
+    {
+        TRIANGLE_SLOT(&triangles[i]) = i;
+    }
+
+    return 0;
+}
+
+void saveViewOrder(View *view)
+{
+    int n = trianglePool.triCount;
+    TriangleObj *order;
+
+    if (n > view->orderCapacity)
+    {
+        if (!(order = realloc(view->order, sizeof *order * n)))
+        {
+            view->orderCount = 0;
+            return;
+        }
+
+        view->order = order;
+        view->orderCapacity = n;
+    }
+
+    memcpy(view->order, trianglePool.triangles, sizeof *order * n);
+    view->orderCount = n;
+}
+
+int renderViews(View *views, int viewCount, Mesh **meshes, int meshCount)
+{
+    int i, v;
+    Camera eye;
+    Matrix4x4 viewMatrix;
+    FrameBuffer *previousTarget = renderTarget;
+    VisibilityBuffer *previousVisibility = visibilityBuffer;
+    DirtyRegion previousDirty = dirtyRegion;
+    MeshViewState *state;
+
+    if (!views || !meshes || meshCount > MAX_POOL_MESHES) return -1;
+
+    // the rotation, the world matrix, its inverse and the lighting
+    // of a mesh are the same for every view, so they are done once
+    for (i = 0; i < meshCount; i++)
+    {
+        state = &meshViewStates[i];
+
+        updateMeshOrientation(meshes[i]);
+        state->worldMatrix = getMeshWorldMatrix(meshes[i]);
+        state->inverseWorld = Invert(state->worldMatrix);
+        state->shade = updateMeshShading(meshes[i], state->worldMatrix, state->inverseWorld);
+    }
+
+    // the views share the pool, so each one is drawn before the next is projected;
+    // the targets are drawn over as they are, and the visibility buffer is left
+    // out as it's the size of the main view
+    visibilityBuffer = NULL;
+
+    for (v = 0; v < viewCount; v++)
+    {
+        eye = views[v].camera;
+        eye.position = getViewEye(&views[v]);
+        viewMatrix = getViewMatrix(&views[v]);
+        renderTarget = views[v].target;
+
+        if (viewCount > 1) restoreViewOrder(&views[v]);
+
+        for (i = 0; i < meshCount; i++)
+        {
+            state = &meshViewStates[i];
+            renderMeshView(&views[v].screen, &eye, meshes[i], viewMatrix, state->worldMatrix, state->inverseWorld, state->shade);
+        }
+
+        sortTrianglePoolInsertion(&trianglePool);
+        drawTrianglesFromPool(&trianglePool);
+
+        if (viewCount > 1) saveViewOrder(&views[v]);
+    }
+
+    // the screen areas of the views don't belong to the main view's dirty region
+    renderTarget = previousTarget;
+    visibilityBuffer = previousVisibility;
+    dirtyRegion = previousDirty;
+
+    return 0;
+}
+
+void destroyView(View *view)
+{
+    if (!view) return;
+
+    free(view->order);
+    view->order = NULL;
+    view->orderCapacity = view->orderCount = 0;
+}
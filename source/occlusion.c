@@ -0,0 +1,251 @@
+typedef struct OcclusionBufferStruct
+{
+    short width;
+    short height;
+    float *depth; // nearest occluder depth at each pixel, 1.0 where nothing was drawn
+
+    Matrix4x4 viewProjection; // of the screen and camera given to beginOcclusionFrame
+    Vector3 cameraPosition;
+
+    int projectionCapacity;
+    Vector3 *projections; // occluder vertices in buffer pixels, depth in z
+
+    int occluderTriangles; // triangles drawn into the buffer this frame
+    int tested;            // candidates tested this frame
+    int culled;            // candidates found hidden this frame
+}OcclusionBuffer;
+
+// the buffer being drawn into by rasterizeTriangleToOcclusion, and the depth
+// of the triangle being drawn: occlusionDepth.x * x + occlusionDepth.y * y + occlusionDepth.z
+OcclusionBuffer *occlusionBuffer = NULL;
+Vector3 occlusionDepth;
+float occlusionMaxDepth;
+
+OcclusionBuffer *newOcclusionBuffer(short width, short height);
+void beginOcclusionFrame(OcclusionBuffer *ob, Screen *screen, Camera *camera);
+int addOccluderMesh(OcclusionBuffer *ob, Mesh *mesh, Matrix4x4 worldMatrix);
+void setOcclusionDepthPlane(Triangle triangle);
+void writeOcclusionSpan(int y, int x1, int x2);
+void rasterizeTriangleToOcclusion(Triangle triangle, FrameBuffer *fb, short width, short height,
+                                  unsigned char r, unsigned char g, unsigned char b);
+int isSphereOccluded(OcclusionBuffer *ob, Vector3 center, float radius);
+void destroyOcclusionBuffer(OcclusionBuffer *ob);
+
+OcclusionBuffer *newOcclusionBuffer(short width, short height)
+{
+    OcclusionBuffer *ptr = NULL;
+
+    if (width <= 0 || height <= 0) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    ptr->depth = malloc(sizeof *(ptr->depth) * width * height);
+    ptr->projectionCapacity = 256;
+    ptr->projections = malloc(sizeof *(ptr->projections) * ptr->projectionCapacity);
+
+    if (!ptr->depth || !ptr->projections)
+    {
+        destroyOcclusionBuffer(ptr);
+        return NULL;
+    }
+
+    ptr->width = width;
+    ptr->height = height;
+    ptr->occluderTriangles = ptr->tested = ptr->culled = 0;
+
+    return ptr;
+}
+
+void beginOcclusionFrame(OcclusionBuffer *ob, Screen *screen, Camera *camera)
+{
+    int i;
+
+    if (!ob) return;
+
+    for (i = 0; i < ob->width * ob->height; i++)
+    {
+        ob->depth[i] = 1.0f;
+    }
+
+    // the aspect ratio comes from the screen, the buffer only changes the pixel size
+    ob->viewProjection = getViewProjectionMatrix(screen, camera);
+    ob->cameraPosition = camera->position;
+    ob->occluderTriangles = ob->tested = ob->culled = 0;
+}
+
+int addOccluderMesh(OcclusionBuffer *ob, Mesh *mesh, Matrix4x4 worldMatrix)
+{
+    int i, capacity;
+    short culling;
+    Matrix4x4 vertexMatrix;
+    Vector3 invertedCamera, projectedVertex, vertex, *projections;
+    QuantizedVertex *quantized;
+    Triangle triangle;
+    Face *face;
+
+    if (!ob || !mesh) return -1;
+
+    if (mesh->vertexCount > ob->projectionCapacity)
+    {
+        capacity = max(mesh->vertexCount, 2 * ob->projectionCapacity);
+
+        if (!(projections = realloc(ob->projections, sizeof *projections * capacity))) return -2;
+
+        ob->projections = projections;
+        ob->projectionCapacity = capacity;
+    }
+
+    quantized = mesh->quantizedVertices;
+    vertexMatrix = multiplyMatrices(worldMatrix, ob->viewProjection);
+
+    if (quantized)
+        vertexMatrix = multiplyMatrices(getMeshDequantizationMatrix(mesh), vertexMatrix);
+
+    for (i = 0; i < mesh->vertexCount; i++)
+    {
+        vertex = quantized ? createVector3(quantized[i].x, quantized[i].y, quantized[i].z) : mesh->vertices[i];
+        ob->projections[i] = project(ob->width, ob->height, vertex, vertexMatrix, &projectedVertex);
+
+        // marks the vertex as unusable, see below
+        if (projectedVertex.z < 0.0f || projectedVertex.z > 1.0f)
+            ob->projections[i].z = -1.0f;
+    }
+
+    // faces that are culled from the image can't hide anything either
+    culling = (flags & BACKFACE_CULLING) != 0;
+    invertedCamera = transformVector3ByMatrix(ob->cameraPosition, Invert(worldMatrix));
+
+    occlusionBuffer = ob;
+
+    for (i = 0; i < mesh->faceCount; i++)
+    {
+        face = &mesh->faces[i];
+
+        if (culling && dotProductVector3(subtractVector3(getMeshVertex(mesh, face->indices[0]), invertedCamera),
+                                         getMeshNormal(mesh, face->normal)) >= 0.0f)
+            continue;
+
+        triangle.p1 = ob->projections[face->indices[0]];
+        triangle.p2 = ob->projections[face->indices[1]];
+        triangle.p3 = ob->projections[face->indices[2]];
+
+        // a triangle crossing the near plane would need clipping, leaving
+        // it out only makes the buffer hide less than it could
+        if (triangle.p1.z < 0.0f || triangle.p2.z < 0.0f || triangle.p3.z < 0.0f) continue;
+
+        rasterizeTriangleToOcclusion(triangle, NULL, ob->width, ob->height, 0, 0, 0);
+        ob->occluderTriangles++;
+    }
+
+    occlusionBuffer = NULL;
+
+    return 0;
+}
+
+void setOcclusionDepthPlane(Triangle triangle)
+{
+    float area, dx1, dy1, dz1, dx2, dy2, dz2;
+
+    dx1 = triangle.p2.x - triangle.p1.x;
+    dy1 = triangle.p2.y - triangle.p1.y;
+    dz1 = triangle.p2.z - triangle.p1.z;
+    dx2 = triangle.p3.x - triangle.p1.x;
+    dy2 = triangle.p3.y - triangle.p1.y;
+    dz2 = triangle.p3.z - triangle.p1.z;
+
+    // the rasterizer has already left out the triangles without area
+    area = dx1 * dy2 - dx2 * dy1;
+
+    occlusionDepth.x = (dz1 * dy2 - dz2 * dy1) / area;
+    occlusionDepth.y = (dx1 * dz2 - dx2 * dz1) / area;
+    occlusionDepth.z = triangle.p1.z - occlusionDepth.x * triangle.p1.x - occlusionDepth.y * triangle.p1.y;
+
+    // the pixel center depth plus the slope to the farthest corner of the pixel,
+    // a coarse pixel only hides what is behind all of the triangle inside it
+    occlusionDepth.z += 0.5f * (abs(occlusionDepth.x) + abs(occlusionDepth.y));
+    occlusionMaxDepth = max(triangle.p1.z, max(triangle.p2.z, triangle.p3.z));
+}
+
+void writeOcclusionSpan(int y, int x1, int x2)
+{
+    float depth, *p, *end;
+
+    p = &occlusionBuffer->depth[y * occlusionBuffer->width + x1];
+    end = p + (x2 - x1);
+    depth = occlusionDepth.x * (x1 + 0.5f) + occlusionDepth.y * (y + 0.5f) + occlusionDepth.z;
+
+    for (; p <= end; p++, depth += occlusionDepth.x)
+    {
+        if (depth < *p) *p = min(depth, occlusionMaxDepth);
+    }
+}
+
+// the frame buffer and color parameters are unused, the span goes to occlusionBuffer
+RASTERIZE_TRIANGLE(rasterizeTriangleToOcclusion, setOcclusionDepthPlane(triangle), writeOcclusionSpan(y, x1, x2))
+
+int isSphereOccluded(OcclusionBuffer *ob, Vector3 center, float radius)
+{
+    int i, x, y, x1, y1, x2, y2;
+    float nearest = 1.0f, minX, minY, maxX, maxY, *p;
+    Vector3 corner, projected, projectedVertex;
+
+    if (!ob) return 0;
+
+    ob->tested++;
+    minX = minY = 1000000.0f;
+    maxX = maxY = -1000000.0f;
+
+    // the corners of the box around the sphere, the nearest point
+    // of a box is always one of its corners
+    for (i = 0; i < 8; i++)
+    {
+        corner = createVector3(center.x + ((i & 1) ? radius : -radius),
+                               center.y + ((i & 2) ? radius : -radius),
+                               center.z + ((i & 4) ? radius : -radius));
+        projected = project(ob->width, ob->height, corner, ob->viewProjection, &projectedVertex);
+
+        // crossing the near plane, the box may cover the whole view
+        if (projectedVertex.z < 0.0f || projectedVertex.z > 1.0f) return 0;
+
+        nearest = min(nearest, projected.z);
+        minX = min(minX, projected.x);
+        minY = min(minY, projected.y);
+        maxX = max(maxX, projected.x);
+        maxY = max(maxY, projected.y);
+    }
+
+    // one more pixel on every side: an occluder covers a whole pixel
+    // as soon as it covers the pixel center
+    x1 = max(0, floor(minX) - 1);
+    y1 = max(0, floor(minY) - 1);
+    x2 = min(ob->width - 1, floor(maxX) + 1);
+    y2 = min(ob->height - 1, floor(maxY) + 1);
+
+    // off the buffer, that's for the frustum culling to decide
+    if (x1 > x2 || y1 > y2) return 0;
+
+    for (y = y1; y <= y2; y++)
+    {
+        p = &ob->depth[y * ob->width + x1];
+
+        for (x = x1; x <= x2; x++, p++)
+        {
+            if (nearest < *p) return 0;
+        }
+    }
+
+    ob->culled++;
+
+    return 1;
+}
+
+void destroyOcclusionBuffer(OcclusionBuffer *ob)
+{
+    if (!ob) return;
+
+    free(ob->depth);
+    free(ob->projections);
+    free(ob);
+}
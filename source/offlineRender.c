@@ -0,0 +1,319 @@
+typedef struct RenderKeyframeStruct
+{
+    int frame;
+    Vector3 cameraPosition;
+    Vector3 cameraTarget;
+    Vector3 orientation; // mesh rotation around x, y and z axes, in radians
+}RenderKeyframe;
+
+typedef struct RenderJobStruct
+{
+    Mesh *mesh;
+    Camera camera;
+    Screen screen;
+    FrameBuffer *frameBuffer;
+
+    int keyframeCount;
+    RenderKeyframe *keyframes;
+
+    int frameCount;
+    int currentFrame;
+
+    short format;
+    int fps;
+    FILE *output;
+    unsigned char *encoded; // the previous frame, encoded and waiting to be written
+    int pendingFrame;
+
+    DirtyRegion dirtyRegion;
+
+    // the pool as the caller left it, while the job's frames hide the other meshes
+    int poolCapacity;
+    TriangleObj *savedPool;
+}RenderJob;
+
+RenderJob *newRenderJob(Mesh *mesh, short width, short height, int frameCount, int keyframeCount);
+int setRenderKeyframe(RenderJob *job, int keyNum, int frame, Vector3 cameraPosition, Vector3 cameraTarget, Vector3 orientation);
+int startRenderJob(RenderJob *job, char fileName[256], short format, int fps);
+void applyRenderKeyframes(RenderJob *job, int frame);
+int saveRenderJobPool(RenderJob *job);
+void restoreRenderJobPool(RenderJob *job);
+int runRenderJob(RenderJob *job, int maxFrames);
+int flushRenderJob(RenderJob *job);
+void destroyRenderJob(RenderJob *job);
+
+RenderJob *newRenderJob(Mesh *mesh, short width, short height, int frameCount, int keyframeCount)
+{
+    RenderJob *ptr = NULL;
+
+    if (!mesh || frameCount <= 0 || keyframeCount <= 0) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    ptr->frameBuffer = newFrameBuffer(width, height);
+
+    if (!ptr->frameBuffer)
+    {
+        free(ptr);
+        return NULL;
+    }
+
+    ptr->keyframeCount = keyframeCount;
+    ptr->keyframes = malloc(sizeof *(ptr->keyframes) * keyframeCount);
+
+    if (!ptr->keyframes)
+    {
+        destroyFrameBuffer(ptr->frameBuffer);
+        free(ptr);
+        return NULL;
+    }
+
+    ptr->encoded = malloc(frameBufferEncodedSize(ptr->frameBuffer));
+
+    if (!ptr->encoded)
+    {
+        free(ptr->keyframes);
+        destroyFrameBuffer(ptr->frameBuffer);
+        free(ptr);
+        return NULL;
+    }
+
+    ptr->mesh = mesh;
+    ptr->screen = createScreen(width, height);
+    ptr->frameCount = frameCount;
+    ptr->currentFrame = 0;
+    ptr->format = FRAME_FORMAT_Y4M;
+    ptr->fps = 30;
+    ptr->output = NULL;
+    ptr->pendingFrame = 0;
+    initDirtyRegion(&ptr->dirtyRegion, 0.5f);
+    ptr->poolCapacity = 0;
+    ptr->savedPool = NULL;
+
+    return ptr;
+}
+
+int setRenderKeyframe(RenderJob *job, int keyNum, int frame, Vector3 cameraPosition, Vector3 cameraTarget, Vector3 orientation)
+{
+    if (!job) return -1;
+    if (keyNum < 0 || keyNum >= job->keyframeCount) return -2;
+
+    job->keyframes[keyNum].frame = frame;
+    job->keyframes[keyNum].cameraPosition = cameraPosition;
+    job->keyframes[keyNum].cameraTarget = cameraTarget;
+    job->keyframes[keyNum].orientation = orientation;
+
+    return 0;
+}
+
+int startRenderJob(RenderJob *job, char fileName[256], short format, int fps)
+{
+    if (!job) return -1;
+
+    // "-" streams the frames to the standard output, so that they can be piped to an encoder
+    if (!strcmp(fileName, "-"))
+        job->output = stdout;
+    else if (!(job->output = fopen(fileName, "wb")))
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't open the output file.", "startRenderJob");
+        return -2;
+    }
+
+    job->format = format;
+    job->fps = fps;
+    job->currentFrame = 0;
+    job->pendingFrame = 0;
+    initDirtyRegion(&job->dirtyRegion, job->dirtyRegion.fullFrameCoverage);
+    clearFrameBuffer(job->frameBuffer, 0, 0, 0);
+
+    if (writeFrameStreamHeader(job->frameBuffer, job->output, job->format, job->fps))
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't write the stream header.", "startRenderJob");
+        return -3;
+    }
+
+    return 0;
+}
+
+void applyRenderKeyframes(RenderJob *job, int frame)
+{
+    int i;
+    float t;
+    RenderKeyframe *a, *b;
+
+    // keyframes are expected in ascending frame order,
+    // frames outside of the keyed range hold the first or the last key
+    a = b = &job->keyframes[0];
+
+    for (i = 0; i < job->keyframeCount; i++)
+    {
+        b = &job->keyframes[i];
+
+        if (b->frame >= frame) break;
+
+        a = b;
+    }
+
+    t = (b->frame > a->frame) ? (frame - a->frame) / (float)(b->frame - a->frame) : 0.0f;
+    t = max(0.0f, min(1.0f, t));
+
+    job->camera.position = lerpVector3(a->cameraPosition, b->cameraPosition, t);
+    job->camera.target = lerpVector3(a->cameraTarget, b->cameraTarget, t);
+    setMeshOrientation(job->mesh, lerpVector3(a->orientation, b->orientation, t));
+}
+
+int saveRenderJobPool(RenderJob *job)
+{
+    int i, n = trianglePool.triCount;
+    TriangleObj *saved, *to;
+
+    if (n > job->poolCapacity)
+    {
+        if (!(saved = realloc(job->savedPool, sizeof *saved * n))) return -1;
+
+        job->savedPool = saved;
+        job->poolCapacity = n;
+    }
+
+    memcpy(job->savedPool, trianglePool.triangles, sizeof *saved * n);
+
+    // the other meshes and instances were projected for the interactive screen
+    for (i = 0; i < n; i++)
+    {
+        to = &trianglePool.triangles[i];
+
+        if (to->mesh != job->mesh || to->instance) to->drawState = 0;
+    }
+
+    return 0;
+}
+
+void restoreRenderJobPool(RenderJob *job)
+{
+    int i, n = trianglePool.triCount;
+
+    // the order, draw states and distances as they were before the job's frames
+    memcpy(trianglePool.triangles, job->savedPool, sizeof *trianglePool.triangles * n);
+
+    for (i = 0; i < n; i++)
+    {
+        TRIANGLE_SLOT(&trianglePool.triangles[i]) = i;
+    }
+}
+
+int runRenderJob(RenderJob *job, int maxFrames)
+{
+    int rendered = 0;
+    FrameBuffer *previousTarget = renderTarget;
+    VisibilityBuffer *previousVisibility = visibilityBuffer;
+    OverdrawStats *previousOverdraw = overdrawStats;
+    DirtyRegion previousDirty = dirtyRegion;
+    Matrix4x4 previousOrientation;
+    Vector3 previousPosition, previousRotation;
+
+    if (!job || !job->output) return -1;
+
+    if (saveRenderJobPool(job))
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't save the triangle pool.", "runRenderJob");
+        return -2;
+    }
+
+    // the job poses the mesh for its own frames, the caller gets it back as it was
+    previousOrientation = job->mesh->orientation;
+    previousPosition = job->mesh->position;
+    previousRotation = job->mesh->rotation;
+    job->mesh->rotation = createVector3(0.0f, 0.0f, 0.0f);
+
+    // the visibility buffer and the overdraw counters are the size of the main view
+    renderTarget = job->frameBuffer;
+    visibilityBuffer = NULL;
+    overdrawStats = NULL;
+
+    while (job->currentFrame < job->frameCount && rendered < maxFrames)
+    {
+        applyRenderKeyframes(job, job->currentFrame);
+
+        renderMesh(&job->screen, &job->camera, job->mesh);
+        sortTrianglePoolInsertion(&trianglePool);
+
+        // only the area the mesh covered last frame or covers now needs clearing
+        markDirtyRect(&job->dirtyRegion, job->mesh->screenBounds);
+        clearFrameBufferRect(job->frameBuffer, getDirtyRect(&job->dirtyRegion, job->frameBuffer->width, job->frameBuffer->height), 0, 0, 0);
+        endDirtyFrame(&job->dirtyRegion);
+
+        // output runs one frame behind rendering: the previous frame is
+        // written between this frame's geometry and raster stages
+        if (job->pendingFrame && writeEncodedFrame(job->frameBuffer, job->output, job->format, job->encoded))
+        {
+            DEBUG_MSG_FROM("Failed: Couldn't write a frame.", "runRenderJob");
+            rendered = -2;
+            break;
+        }
+
+        drawTrianglesFromPool(&trianglePool);
+        encodeFrameBuffer(job->frameBuffer, job->format, job->encoded);
+        job->pendingFrame = 1;
+
+        job->currentFrame++;
+        rendered++;
+    }
+
+    // renderMesh marked the job's frames in the screen's dirty region
+    renderTarget = previousTarget;
+    visibilityBuffer = previousVisibility;
+    overdrawStats = previousOverdraw;
+    dirtyRegion = previousDirty;
+    job->mesh->orientation = previousOrientation;
+    job->mesh->position = previousPosition;
+    job->mesh->rotation = previousRotation;
+    restoreRenderJobPool(job);
+
+    if (rendered < 0) return rendered;
+
+    if (job->currentFrame >= job->frameCount && flushRenderJob(job))
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't write the last frame.", "runRenderJob");
+        return -2;
+    }
+
+    return rendered;
+}
+
+int flushRenderJob(RenderJob *job)
+{
+    if (!job || !job->output) return -1;
+
+    if (job->pendingFrame)
+    {
+        if (writeEncodedFrame(job->frameBuffer, job->output, job->format, job->encoded))
+            return -2;
+
+        job->pendingFrame = 0;
+    }
+
+    fflush(job->output);
+
+    return 0;
+}
+
+void destroyRenderJob(RenderJob *job)
+{
+    if (!job) return;
+
+    if (job->output)
+    {
+        flushRenderJob(job);
+
+        if (job->output != stdout)
+            fclose(job->output);
+    }
+
+    free(job->savedPool);
+    free(job->encoded);
+    free(job->keyframes);
+    destroyFrameBuffer(job->frameBuffer);
+    free(job);
+}
@@ -0,0 +1,216 @@
+#define OVERDRAW_SIZE_BUCKETS 12 // triangle sizes 0, 1, 2-3, 4-7, ... up to 1024+ pixels
+
+typedef struct OverdrawStatsStruct
+{
+    short width;
+    short height;
+    unsigned short *counts; // writes to each pixel during the last frame
+    Rect used;              // pixels written during the last frame
+
+    int triangles;     // triangles rasterized
+    int pixelWrites;   // pixels written, overwrites included
+    int coveredPixels; // pixels written at least once
+    int maxCount;      // writes to the most overdrawn pixel
+    int currentArea;   // pixels of the triangle being rasterized
+    int sizeHistogram[OVERDRAW_SIZE_BUCKETS];
+}OverdrawStats;
+
+OverdrawStats *newOverdrawStats(short width, short height);
+void beginOverdrawFrame(OverdrawStats *os);
+void countOverdrawSpan(OverdrawStats *os, int y, int x1, int x2);
+void endOverdrawTriangle(OverdrawStats *os);
+void finishOverdrawFrame(OverdrawStats *os);
+float getOverdrawRatio(OverdrawStats *os);
+float getPixelsPerTriangle(OverdrawStats *os);
+void drawOverdrawHeatmap(OverdrawStats *os, FrameBuffer *fb, float opacity);
+void reportOverdrawStats(OverdrawStats *os);
+void destroyOverdrawStats(OverdrawStats *os);
+
+OverdrawStats *newOverdrawStats(short width, short height)
+{
+    OverdrawStats *ptr = NULL;
+
+    if (width <= 0 || height <= 0) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    ptr->counts = malloc(sizeof *(ptr->counts) * width * height);
+
+    if (!ptr->counts)
+    {
+        free(ptr);
+        return NULL;
+    }
+
+    ptr->width = width;
+    ptr->height = height;
+    memset(ptr->counts, 0, sizeof *(ptr->counts) * width * height);
+    ptr->used = createEmptyRect();
+    beginOverdrawFrame(ptr);
+
+    return ptr;
+}
+
+void beginOverdrawFrame(OverdrawStats *os)
+{
+    int i, y;
+
+    if (!os) return;
+
+    // only the rows and columns written last frame hold counts
+    for (y = os->used.y1; y <= os->used.y2; y++)
+    {
+        memset(&os->counts[y * os->width + os->used.x1], 0, sizeof *(os->counts) * (os->used.x2 - os->used.x1 + 1));
+    }
+
+    os->used = createEmptyRect();
+    os->triangles = 0;
+    os->pixelWrites = 0;
+    os->coveredPixels = 0;
+    os->maxCount = 0;
+    os->currentArea = 0;
+
+    for (i = 0; i < OVERDRAW_SIZE_BUCKETS; i++)
+    {
+        os->sizeHistogram[i] = 0;
+    }
+}
+
+void countOverdrawSpan(OverdrawStats *os, int y, int x1, int x2)
+{
+    unsigned short *p, *end;
+
+    if (y < 0 || y >= os->height) return;
+
+    x1 = max(0, x1);
+    x2 = min(os->width - 1, x2);
+
+    if (x1 > x2) return;
+
+    p = &os->counts[y * os->width + x1];
+    end = p + (x2 - x1);
+
+    // a pixel's first write is what covers it, the rest is overdraw
+    for (; p <= end; p++)
+    {
+        if (!*p) os->coveredPixels++;
+        if (*p < 65535) (*p)++;
+    }
+
+    os->currentArea += x2 - x1 + 1;
+    os->used = unionRect(os->used, createRect(x1, y, x2, y));
+}
+
+void endOverdrawTriangle(OverdrawStats *os)
+{
+    int bucket = 0, area = os->currentArea;
+
+    while (area > 0 && bucket < OVERDRAW_SIZE_BUCKETS - 1)
+    {
+        area >>= 1;
+        bucket++;
+    }
+
+    os->sizeHistogram[bucket]++;
+    os->pixelWrites += os->currentArea;
+    os->triangles++;
+    os->currentArea = 0;
+}
+
+void finishOverdrawFrame(OverdrawStats *os)
+{
+    int x, y;
+
+    if (!os) return;
+
+    os->maxCount = 0;
+
+    for (y = os->used.y1; y <= os->used.y2; y++)
+    {
+        for (x = os->used.x1; x <= os->used.x2; x++)
+        {
+            os->maxCount = max(os->maxCount, os->counts[y * os->width + x]);
+        }
+    }
+}
+
+float getOverdrawRatio(OverdrawStats *os)
+{
+    // 1.0 means every covered pixel was written exactly once
+    if (!os || !os->coveredPixels) return 0.0f;
+
+    return os->pixelWrites / (float)os->coveredPixels;
+}
+
+float getPixelsPerTriangle(OverdrawStats *os)
+{
+    if (!os || !os->triangles) return 0.0f;
+
+    return os->pixelWrites / (float)os->triangles;
+}
+
+void drawOverdrawHeatmap(OverdrawStats *os, FrameBuffer *fb, float opacity)
+{
+    int x, y, count, r, g, b;
+    unsigned char *p;
+    Rect rect;
+
+    if (!os || !fb) return;
+
+    rect = clipRect(os->used, fb->width, fb->height);
+    opacity = max(0.0f, min(1.0f, opacity));
+
+    // blue for 1 write, through green and yellow to red for 4 or more
+    for (y = rect.y1; y <= rect.y2 && y < os->height; y++)
+    {
+        p = &fb->pixels[3 * (y * fb->width + rect.x1)];
+
+        for (x = rect.x1; x <= rect.x2 && x < os->width; x++, p += 3)
+        {
+            if (!(count = os->counts[y * os->width + x])) continue;
+
+            if (count == 1)      { r = 0;   g = 0;   b = 255; }
+            else if (count == 2) { r = 0;   g = 255; b = 0;   }
+            else if (count == 3) { r = 255; g = 255; b = 0;   }
+            else                 { r = 255; g = 0;   b = 0;   }
+
+            p[0] = p[0] + (r - p[0]) * opacity;
+            p[1] = p[1] + (g - p[1]) * opacity;
+            p[2] = p[2] + (b - p[2]) * opacity;
+        }
+    }
+}
+
+void reportOverdrawStats(OverdrawStats *os)
+{
+    int i;
+    char msg[256] = "", bucket[32];
+
+    if (!os) return;
+
+    sprintf(msg, "triangles %d, writes %d, covered %d, overdraw %.2f, max %d, px/tri %.1f",
+            os->triangles, os->pixelWrites, os->coveredPixels,
+            getOverdrawRatio(os), os->maxCount, getPixelsPerTriangle(os));
+    DEBUG_MSG_FROM(msg, "reportOverdrawStats");
+
+    // triangle counts by size: 0 px, 1 px, 2-3 px, 4-7 px, ...
+    strcpy(msg, "sizes:");
+
+    for (i = 0; i < OVERDRAW_SIZE_BUCKETS; i++)
+    {
+        sprintf(bucket, " %d", os->sizeHistogram[i]);
+        strcat(msg, bucket);
+    }
+
+    DEBUG_MSG_FROM(msg, "reportOverdrawStats");
+}
+
+void destroyOverdrawStats(OverdrawStats *os)
+{
+    if (!os) return;
+
+    free(os->counts);
+    free(os);
+}
@@ -0,0 +1,399 @@
+#define BVH_LEAF_FACES     4  // nodes with this many faces or fewer are never split
+#define BVH_MAX_LEAF_FACES 16 // nodes with more faces are split even if SAH prefers a leaf
+#define BVH_BINS           12
+#define BVH_MAX_DEPTH      48 // deeper nodes are split at the middle to keep the tree shallow
+// past BVH_MAX_DEPTH the faces are halved down to the leaves in fewer than 32 more levels,
+// and a traversal holds at most one node for every level of the tree and one more
+#define BVH_STACK_SIZE     (BVH_MAX_DEPTH + 32 + 1)
+
+typedef struct PickResultStruct
+{
+    Mesh *mesh;     // NULL when nothing was hit
+    int faceIndex;
+    float distance; // from the camera to the hit point, in world units
+}PickResult;
+
+BVH *buildMeshBVH(Mesh *mesh);
+int buildBVHNode(BVH *bvh, Vector3 *faceMin, Vector3 *faceMax, Vector3 *centroids, int first, int count, int depth);
+int getBVHBin(float value, float start, float extent);
+float boundsSurfaceArea(Vector3 boundsMin, Vector3 boundsMax);
+int rayHitsBounds(Vector3 origin, Vector3 inverseDirection, Vector3 boundsMin, Vector3 boundsMax, float maxDistance);
+float rayTriangleDistance(Vector3 origin, Vector3 direction, Vector3 v0, Vector3 v1, Vector3 v2);
+int pickMeshFace(Mesh *mesh, Vector3 origin, Vector3 direction, float *distance);
+PickResult pickFace(Screen *screen, Camera *camera, int x, int y);
+
+BVH *buildMeshBVH(Mesh *mesh)
+{
+    int i, j;
+    Vector3 *faceMin, *faceMax, *centroids, v;
+    BVH *ptr = NULL;
+
+    if (!mesh || mesh->faceCount <= 0) return NULL;
+
+    freeMeshBVH(mesh);
+
+    ptr = malloc(sizeof *ptr);
+    faceMin = malloc(sizeof *faceMin * mesh->faceCount);
+    faceMax = malloc(sizeof *faceMax * mesh->faceCount);
+    centroids = malloc(sizeof *centroids * mesh->faceCount);
+
+    if (ptr)
+    {
+        // a binary tree with at most one face per leaf has fewer than 2n nodes
+        ptr->nodeCount = 0;
+        ptr->nodes = malloc(sizeof *(ptr->nodes) * 2 * mesh->faceCount);
+        ptr->faceIndices = malloc(sizeof *(ptr->faceIndices) * mesh->faceCount);
+    }
+
+    if (!ptr || !ptr->nodes || !ptr->faceIndices || !faceMin || !faceMax || !centroids)
+    {
+        if (ptr)
+        {
+            free(ptr->nodes);
+            free(ptr->faceIndices);
+            free(ptr);
+        }
+
+        free(faceMin);
+        free(faceMax);
+        free(centroids);
+        DEBUG_MSG_FROM("Failed: Couldn't allocate memory for the BVH.", "buildMeshBVH");
+        return NULL;
+    }
+
+    for (i = 0; i < mesh->faceCount; i++)
+    {
+        ptr->faceIndices[i] = i;
+        faceMin[i] = faceMax[i] = getMeshVertex(mesh, mesh->faces[i].indices[0]);
+
+        for (j = 1; j < 3; j++)
+        {
+            v = getMeshVertex(mesh, mesh->faces[i].indices[j]);
+            faceMin[i] = minVector3(faceMin[i], v);
+            faceMax[i] = maxVector3(faceMax[i], v);
+        }
+
+        centroids[i] = scaleVector3(addVector3(faceMin[i], faceMax[i]), 0.5f);
+    }
+
+    buildBVHNode(ptr, faceMin, faceMax, centroids, 0, mesh->faceCount, 0);
+
+    free(faceMin);
+    free(faceMax);
+    free(centroids);
+
+    mesh->bvh = ptr;
+
+    return ptr;
+}
+
+int buildBVHNode(BVH *bvh, Vector3 *faceMin, Vector3 *faceMax, Vector3 *centroids, int first, int count, int depth)
+{
+    int i, j, b, axis, temp, split, leftCount;
+    int bestAxis = -1, bestSplit = 0;
+    int binCount[BVH_BINS], countBelow[BVH_BINS];
+    float start, extent, cost, bestCost = 0.0f;
+    float areaBelow[BVH_BINS];
+    Vector3 binMin[BVH_BINS], binMax[BVH_BINS];
+    Vector3 centroidMin, centroidMax, sweepMin, sweepMax;
+    int *faces = bvh->faceIndices;
+    int nodeIndex = bvh->nodeCount++;
+    BVHNode *node = &bvh->nodes[nodeIndex];
+
+    node->boundsMin = faceMin[faces[first]];
+    node->boundsMax = faceMax[faces[first]];
+    centroidMin = centroidMax = centroids[faces[first]];
+
+    for (i = first + 1; i < first + count; i++)
+    {
+        node->boundsMin = minVector3(node->boundsMin, faceMin[faces[i]]);
+        node->boundsMax = maxVector3(node->boundsMax, faceMax[faces[i]]);
+        centroidMin = minVector3(centroidMin, centroids[faces[i]]);
+        centroidMax = maxVector3(centroidMax, centroids[faces[i]]);
+    }
+
+    node->first = first;
+    node->count = count;
+
+    if (count <= BVH_LEAF_FACES) return nodeIndex;
+
+    // binned surface area heuristic: the centroids are sorted into bins along each
+    // axis, and the cheapest bin boundary is chosen by sweeping the bins from both ends
+    if (depth < BVH_MAX_DEPTH)
+    {
+        for (axis = 0; axis < 3; axis++)
+        {
+            start = getVector3Component(centroidMin, axis);
+            extent = getVector3Component(centroidMax, axis) - start;
+
+            if (extent <= 0.0f) continue;
+
+            for (b = 0; b < BVH_BINS; b++)
+            {
+                binCount[b] = 0;
+            }
+
+            for (i = first; i < first + count; i++)
+            {
+                b = getBVHBin(getVector3Component(centroids[faces[i]], axis), start, extent);
+
+                if (binCount[b]++)
+                {
+                    binMin[b] = minVector3(binMin[b], faceMin[faces[i]]);
+                    binMax[b] = maxVector3(binMax[b], faceMax[faces[i]]);
+                }
+                else
+                {
+                    binMin[b] = faceMin[faces[i]];
+                    binMax[b] = faceMax[faces[i]];
+                }
+            }
+
+            leftCount = 0;
+
+            for (b = 0; b < BVH_BINS - 1; b++)
+            {
+                if (binCount[b])
+                {
+                    sweepMin = leftCount ? minVector3(sweepMin, binMin[b]) : binMin[b];
+                    sweepMax = leftCount ? maxVector3(sweepMax, binMax[b]) : binMax[b];
+                    leftCount += binCount[b];
+                }
+
+                countBelow[b] = leftCount;
+                areaBelow[b] = leftCount ? boundsSurfaceArea(sweepMin, sweepMax) : 0.0f;
+            }
+
+            leftCount = 0; // counts the faces above the boundary in this sweep
+
+            for (b = BVH_BINS - 1; b > 0; b--)
+            {
+                if (binCount[b])
+                {
+                    sweepMin = leftCount ? minVector3(sweepMin, binMin[b]) : binMin[b];
+                    sweepMax = leftCount ? maxVector3(sweepMax, binMax[b]) : binMax[b];
+                    leftCount += binCount[b];
+                }
+
+                if (!leftCount || !countBelow[b - 1]) continue;
+
+                cost = areaBelow[b - 1] * countBelow[b - 1] + boundsSurfaceArea(sweepMin, sweepMax) * leftCount;
+
+                if (bestAxis < 0 || cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = b;
+                }
+            }
+        }
+
+        // a leaf costs one intersection test per face over the whole node's area
+        if (count <= BVH_MAX_LEAF_FACES &&
+            (bestAxis < 0 || bestCost >= count * boundsSurfaceArea(node->boundsMin, node->boundsMax)))
+            return nodeIndex;
+    }
+
+    split = count / 2;
+
+    if (bestAxis >= 0)
+    {
+        start = getVector3Component(centroidMin, bestAxis);
+        extent = getVector3Component(centroidMax, bestAxis) - start;
+        i = first;
+        j = first + count - 1;
+
+        while (i <= j)
+        {
+            if (getBVHBin(getVector3Component(centroids[faces[i]], bestAxis), start, extent) < bestSplit)
+                i++;
+            else
+            {
+                temp = faces[i];
+                faces[i] = faces[j];
+                faces[j--] = temp;
+            }
+        }
+
+        if (i > first && i < first + count)
+            split = i - first;
+    }
+
+    node->count = 0;
+    buildBVHNode(bvh, faceMin, faceMax, centroids, first, split, depth + 1);
+    temp = buildBVHNode(bvh, faceMin, faceMax, centroids, first + split, count - split, depth + 1);
+    bvh->nodes[nodeIndex].first = temp;
+
+    return nodeIndex;
+}
+
+int getBVHBin(float value, float start, float extent)
+{
+    int bin = (int)((value - start) / extent * BVH_BINS);
+
+    return max(0, min(BVH_BINS - 1, bin));
+}
+
+float boundsSurfaceArea(Vector3 boundsMin, Vector3 boundsMax)
+{
+    Vector3 size = subtractVector3(boundsMax, boundsMin);
+
+    return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+int rayHitsBounds(Vector3 origin, Vector3 inverseDirection, Vector3 boundsMin, Vector3 boundsMax, float maxDistance)
+{
+    int axis;
+    float t1, t2, o, inv, tNear = 0.0f, tFar = maxDistance;
+
+    // slab test: the ray is inside the box where it is between all three pairs of planes
+    for (axis = 0; axis < 3; axis++)
+    {
+        o = getVector3Component(origin, axis);
+        inv = getVector3Component(inverseDirection, axis);
+        t1 = (getVector3Component(boundsMin, axis) - o) * inv;
+        t2 = (getVector3Component(boundsMax, axis) - o) * inv;
+
+        tNear = max(tNear, min(t1, t2));
+        tFar = min(tFar, max(t1, t2));
+    }
+
+    return tNear <= tFar;
+}
+
+float rayTriangleDistance(Vector3 origin, Vector3 direction, Vector3 v0, Vector3 v1, Vector3 v2)
+{
+    // Moller-Trumbore, returns the distance along the ray or -1 for a miss
+    float det, inverseDet, u, v, t;
+    Vector3 edge1 = subtractVector3(v1, v0);
+    Vector3 edge2 = subtractVector3(v2, v0);
+    Vector3 p = crossProductVector3(direction, edge2);
+    Vector3 s, q;
+
+    det = dotProductVector3(edge1, p);
+
+    if (det > -0.0000001f && det < 0.0000001f) return -1.0f;
+
+    inverseDet = 1.0f / det;
+    s = subtractVector3(origin, v0);
+    u = dotProductVector3(s, p) * inverseDet;
+
+    if (u < 0.0f || u > 1.0f) return -1.0f;
+
+    q = crossProductVector3(s, edge1);
+    v = dotProductVector3(direction, q) * inverseDet;
+
+    if (v < 0.0f || u + v > 1.0f) return -1.0f;
+
+    t = dotProductVector3(edge2, q) * inverseDet;
+
+    return (t > 0.0f) ? t : -1.0f;
+}
+
+int pickMeshFace(Mesh *mesh, Vector3 origin, Vector3 direction, float *distance)
+{
+    int i, face, nodeIndex, hit = -1, stackSize = 0;
+    int stack[BVH_STACK_SIZE];
+    float t;
+    Vector3 inverseDirection;
+    BVHNode *node;
+    Face *f;
+
+    // a huge value stands in for the infinity of a zero direction component
+    inverseDirection.x = (direction.x != 0.0f) ? 1.0f / direction.x : 1e30f;
+    inverseDirection.y = (direction.y != 0.0f) ? 1.0f / direction.y : 1e30f;
+    inverseDirection.z = (direction.z != 0.0f) ? 1.0f / direction.z : 1e30f;
+
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        nodeIndex = stack[--stackSize];
+        node = &mesh->bvh->nodes[nodeIndex];
+
+        if (!rayHitsBounds(origin, inverseDirection, node->boundsMin, node->boundsMax, *distance))
+            continue;
+
+        if (node->count)
+        {
+            for (i = node->first; i < node->first + node->count; i++)
+            {
+                face = mesh->bvh->faceIndices[i];
+                f = &mesh->faces[face];
+                t = rayTriangleDistance(origin, direction, getMeshVertex(mesh, f->indices[0]),
+                    getMeshVertex(mesh, f->indices[1]), getMeshVertex(mesh, f->indices[2]));
+
+                // the distance only shrinks, so later boxes are tested against the closest hit
+                if (t >= 0.0f && t < *distance)
+                {
+                    *distance = t;
+                    hit = face;
+                }
+            }
+        }
+        else if (stackSize + 2 > BVH_STACK_SIZE)
+        {
+            DEBUG_MSG_FROM("Failed: The BVH is deeper than the traversal stack.", "pickMeshFace");
+            return hit;
+        }
+        else
+        {
+            stack[stackSize++] = node->first;
+            stack[stackSize++] = nodeIndex + 1;
+        }
+    }
+
+    return hit;
+}
+
+PickResult pickFace(Screen *screen, Camera *camera, int x, int y)
+{
+    int i, face;
+    float distance, worldDistance;
+    Vector3 nearPoint, farPoint, origin, end, direction, hitPoint;
+    Matrix4x4 inverseViewProjection, worldMatrix;
+    Mesh *mesh;
+    PickResult result;
+
+    result.mesh = NULL;
+    result.faceIndex = -1;
+    result.distance = -1.0f;
+
+    // the pixel center on the near and far planes, in the same space project() maps into
+    inverseViewProjection = Invert(getViewProjectionMatrix(screen, camera));
+    nearPoint = createVector3((x + 0.5f) / screen->width - 0.5f, 0.5f - (y + 0.5f) / screen->height, 0.0f);
+    farPoint = nearPoint;
+    farPoint.z = 1.0f;
+    nearPoint = transformVector3ByMatrix(nearPoint, inverseViewProjection);
+    farPoint = transformVector3ByMatrix(farPoint, inverseViewProjection);
+
+    for (i = 0; i < trianglePool.meshCount; i++)
+    {
+        mesh = trianglePool.meshes[i];
+
+        if (!mesh->bvh && !buildMeshBVH(mesh)) continue;
+
+        // the ray is moved into the mesh's object space instead of moving every vertex
+        worldMatrix = getMeshWorldMatrix(mesh);
+        origin = transformVector3ByMatrix(nearPoint, Invert(worldMatrix));
+        end = transformVector3ByMatrix(farPoint, Invert(worldMatrix));
+        distance = magnitudeVector3(subtractVector3(end, origin));
+        direction = normalizeVector3(subtractVector3(end, origin));
+
+        face = pickMeshFace(mesh, origin, direction, &distance);
+
+        if (face < 0) continue;
+
+        hitPoint = addVector3(origin, scaleVector3(direction, distance));
+        worldDistance = magnitudeVector3(subtractVector3(transformVector3ByMatrix(hitPoint, worldMatrix), camera->position));
+
+        if (!result.mesh || worldDistance < result.distance)
+        {
+            result.mesh = mesh;
+            result.faceIndex = face;
+            result.distance = worldDistance;
+        }
+    }
+
+    return result;
+}
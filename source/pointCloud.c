@@ -0,0 +1,349 @@
+#define POINT_CLOUD_COLORS (1 << 0) // binary file flag: per point colors follow the positions
+
+#define POINT_BATCH    256 // points projected together before splatting
+#define POINT_MAX_SIZE 8   // largest splat, in pixels, when the size is attenuated
+
+typedef struct PointCloudStruct
+{
+    int pointCount;
+
+    // positions are stored per axis, so the projection loop walks three
+    // tightly packed arrays instead of striding over Vector3 structs
+    float *x;
+    float *y;
+    float *z;
+
+    unsigned char *colors; // 3 bytes per point, RGB, NULL if the points use the cloud's color
+    unsigned char r;
+    unsigned char g;
+    unsigned char b;
+
+    Vector3 position;
+    Matrix4x4 orientation;
+
+    Rect screenBounds; // pixels covered by the splats on the last render
+}PointCloud;
+
+PointCloud *newPointCloud(int pointCount, short hasColors);
+PointCloud *loadPointCloud(char fileName[256]);
+PointCloud *readPointCloudFromObj(char fileName[256]);
+PointCloud *readPointCloudFromBinary(FILE *f);
+int savePointCloud(PointCloud *pc, char fileName[256]);
+int setPointCloudPoint(PointCloud *pc, int pointNum, Vector3 point);
+int renderPointCloud(PointCloud *pc, Screen *screen, Camera *camera, FrameBuffer *fb, float pointSize, short attenuate);
+void destroyPointCloud(PointCloud *pc);
+
+PointCloud *newPointCloud(int pointCount, short hasColors)
+{
+    PointCloud *ptr = NULL;
+
+    if (pointCount <= 0) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    ptr->pointCount = pointCount;
+    ptr->x = malloc(sizeof *(ptr->x) * pointCount);
+    ptr->y = malloc(sizeof *(ptr->y) * pointCount);
+    ptr->z = malloc(sizeof *(ptr->z) * pointCount);
+    ptr->colors = hasColors ? malloc(3 * pointCount) : NULL;
+
+    if (!ptr->x || !ptr->y || !ptr->z || (hasColors && !ptr->colors))
+    {
+        destroyPointCloud(ptr);
+        return NULL;
+    }
+
+    ptr->r = ptr->g = ptr->b = 255;
+    ptr->position = createVector3(0.0f, 0.0f, 0.0f);
+    ptr->orientation = createTranslationMatrix(0.0f, 0.0f, 0.0f);
+    ptr->screenBounds = createEmptyRect();
+
+    return ptr;
+}
+
+PointCloud *loadPointCloud(char fileName[256])
+{
+    char magic[4];
+    PointCloud *ptr = NULL;
+    FILE *f = fopen(fileName, "rb");
+
+    if (!f)
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't open the point cloud file.", "loadPointCloud");
+        return NULL;
+    }
+
+    // binary files start with "PCL1", anything else is read as an OBJ file's vertices
+    if (fread(magic, 1, 4, f) == 4 && !strncmp(magic, "PCL1", 4))
+    {
+        ptr = readPointCloudFromBinary(f);
+        fclose(f);
+        return ptr;
+    }
+
+    fclose(f);
+
+    return readPointCloudFromObj(fileName);
+}
+
+PointCloud *readPointCloudFromObj(char fileName[256])
+{
+    int count = 0, hasColors = 0, i = 0;
+    float r, g, b;
+    char line[256];
+    Vector3 vec;
+    PointCloud *ptr = NULL;
+    FILE *f = fopen(fileName, "r");
+
+    if (!f)
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't open the point cloud file.", "readPointCloudFromObj");
+        return NULL;
+    }
+
+    // vertex lines may carry a color as 3 more values between 0 and 1,
+    // the cloud gets per point colors if any of its vertices has one
+    while (fgets(line, sizeof line, f))
+    {
+        if (line[0] == 'v' && line[1] == ' ')
+        {
+            count++;
+
+            if (!hasColors && sscanf(line, "%*s %*f %*f %*f %f %f %f", &r, &g, &b) == 7)
+                hasColors = 1;
+        }
+    }
+
+    if (!(ptr = newPointCloud(count, hasColors)))
+    {
+        fclose(f);
+        DEBUG_MSG_FROM("Failed: Couldn't create the point cloud.", "readPointCloudFromObj");
+        return NULL;
+    }
+
+    rewind(f);
+
+    while (i < count && fgets(line, sizeof line, f))
+    {
+        if (line[0] != 'v' || line[1] != ' ') continue;
+
+        r = g = b = 1.0f;
+
+        if (sscanf(line, "%*s %f %f %f %f %f %f", &vec.x, &vec.y, &vec.z, &r, &g, &b) < 4)
+        {
+            fclose(f);
+            destroyPointCloud(ptr);
+            DEBUG_MSG_FROM("Failed: Parsing a vertex failed.", "readPointCloudFromObj");
+            return NULL;
+        }
+
+        ptr->x[i] = vec.x;
+        ptr->y[i] = vec.y;
+        ptr->z[i] = vec.z;
+
+        if (hasColors)
+        {
+            ptr->colors[3 * i]     = (unsigned char)(max(0.0f, min(1.0f, r)) * 255.0f + 0.5f);
+            ptr->colors[3 * i + 1] = (unsigned char)(max(0.0f, min(1.0f, g)) * 255.0f + 0.5f);
+            ptr->colors[3 * i + 2] = (unsigned char)(max(0.0f, min(1.0f, b)) * 255.0f + 0.5f);
+        }
+
+        i++;
+    }
+
+    fclose(f);
+
+    return ptr;
+}
+
+PointCloud *readPointCloudFromBinary(FILE *f)
+{
+    int count, fileFlags;
+    PointCloud *ptr = NULL;
+
+    // after the magic: point count, flags, then all x, all y and all z
+    // values as floats, then the RGB bytes if the colors flag is set
+    if (fread(&count, sizeof count, 1, f) != 1 || fread(&fileFlags, sizeof fileFlags, 1, f) != 1)
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't read the point cloud header.", "readPointCloudFromBinary");
+        return NULL;
+    }
+
+    if (!(ptr = newPointCloud(count, fileFlags & POINT_CLOUD_COLORS)))
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't create the point cloud.", "readPointCloudFromBinary");
+        return NULL;
+    }
+
+    if (fread(ptr->x, sizeof *(ptr->x), count, f) != (size_t)count ||
+        fread(ptr->y, sizeof *(ptr->y), count, f) != (size_t)count ||
+        fread(ptr->z, sizeof *(ptr->z), count, f) != (size_t)count ||
+        (ptr->colors && fread(ptr->colors, 3, count, f) != (size_t)count))
+    {
+        destroyPointCloud(ptr);
+        DEBUG_MSG_FROM("Failed: The point cloud file is truncated.", "readPointCloudFromBinary");
+        return NULL;
+    }
+
+    return ptr;
+}
+
+int savePointCloud(PointCloud *pc, char fileName[256])
+{
+    int fileFlags, result = 0;
+    FILE *f;
+
+    if (!pc) return -1;
+
+    if (!(f = fopen(fileName, "wb")))
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't open the point cloud file.", "savePointCloud");
+        return -2;
+    }
+
+    fileFlags = pc->colors ? POINT_CLOUD_COLORS : 0;
+
+    // the values are written in the machine's byte order
+    if (fwrite("PCL1", 1, 4, f) != 4 ||
+        fwrite(&pc->pointCount, sizeof pc->pointCount, 1, f) != 1 ||
+        fwrite(&fileFlags, sizeof fileFlags, 1, f) != 1 ||
+        fwrite(pc->x, sizeof *(pc->x), pc->pointCount, f) != (size_t)pc->pointCount ||
+        fwrite(pc->y, sizeof *(pc->y), pc->pointCount, f) != (size_t)pc->pointCount ||
+        fwrite(pc->z, sizeof *(pc->z), pc->pointCount, f) != (size_t)pc->pointCount ||
+        (pc->colors && fwrite(pc->colors, 3, pc->pointCount, f) != (size_t)pc->pointCount))
+        result = -3;
+
+    fclose(f);
+
+    return result;
+}
+
+int setPointCloudPoint(PointCloud *pc, int pointNum, Vector3 point)
+{
+    if (!pc) return -1;
+    if (pointNum < 0 || pointNum >= pc->pointCount) return -2;
+
+    pc->x[pointNum] = point.x;
+    pc->y[pointNum] = point.y;
+    pc->z[pointNum] = point.z;
+
+    return 0;
+}
+
+int renderPointCloud(PointCloud *pc, Screen *screen, Camera *camera, FrameBuffer *fb, float pointSize, short attenuate)
+{
+    int i, j, n, px, py, x1, y1, x2, y2, size, drawn = 0;
+    int minX, minY, maxX, maxY;
+    float sx[POINT_BATCH], sy[POINT_BATCH], sz[POINT_BATCH], sw[POINT_BATCH];
+    float halfWidth, halfHeight, invW, *depth;
+    float m11, m12, m13, m14, m21, m22, m23, m24, m31, m32, m33, m34, m41, m42, m43, m44;
+    unsigned char cloudColor[3], *color, *p;
+    Matrix4x4 matrix;
+
+    if (!pc || !screen || !camera || !fb) return -1;
+
+    // the splats are resolved against the depth buffer, nearest point wins
+    if (enableFrameBufferDepth(fb))
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't allocate the depth buffer.", "renderPointCloud");
+        return -2;
+    }
+
+    matrix = multiplyMatrices(multiplyMatrices(pc->orientation,
+        createTranslationMatrix(pc->position.x, pc->position.y, pc->position.z)),
+        getViewProjectionMatrix(screen, camera));
+
+    // the matrix is kept in locals so the batch loop doesn't go through the struct
+    m11 = matrix.m11; m12 = matrix.m12; m13 = matrix.m13; m14 = matrix.m14;
+    m21 = matrix.m21; m22 = matrix.m22; m23 = matrix.m23; m24 = matrix.m24;
+    m31 = matrix.m31; m32 = matrix.m32; m33 = matrix.m33; m34 = matrix.m34;
+    m41 = matrix.m41; m42 = matrix.m42; m43 = matrix.m43; m44 = matrix.m44;
+
+    halfWidth = fb->width / 2.0f;
+    halfHeight = fb->height / 2.0f;
+    minX = minY = 1000000;
+    maxX = maxY = -1000000;
+    size = max(1, pointSize);
+    cloudColor[0] = pc->r;
+    cloudColor[1] = pc->g;
+    cloudColor[2] = pc->b;
+
+    for (i = 0; i < pc->pointCount; i += POINT_BATCH)
+    {
+        n = min(POINT_BATCH, pc->pointCount - i);
+
+        // projection of a whole batch, the same arithmetic for every
+        // point and no branches, as project() does for one vertex
+        for (j = 0; j < n; j++)
+        {
+            sx[j] = pc->x[i + j] * m11 + pc->y[i + j] * m21 + pc->z[i + j] * m31 + m41;
+            sy[j] = pc->x[i + j] * m12 + pc->y[i + j] * m22 + pc->z[i + j] * m32 + m42;
+            sz[j] = pc->x[i + j] * m13 + pc->y[i + j] * m23 + pc->z[i + j] * m33 + m43;
+            sw[j] = pc->x[i + j] * m14 + pc->y[i + j] * m24 + pc->z[i + j] * m34 + m44;
+        }
+
+        for (j = 0; j < n; j++)
+        {
+            if (sw[j] < 0.0001f) continue; // behind the camera
+
+            invW = 1.0f / sw[j];
+            sz[j] *= invW;
+
+            if (sz[j] < 0.0f || sz[j] > 1.0f) continue;
+
+            if (attenuate)
+                size = max(1, min(POINT_MAX_SIZE, pointSize * invW));
+
+            x1 = floor(sx[j] * invW * fb->width + halfWidth) - size / 2;
+            y1 = floor(-sy[j] * invW * fb->height + halfHeight) - size / 2;
+            x2 = min(fb->width - 1, x1 + size - 1);
+            y2 = min(fb->height - 1, y1 + size - 1);
+            x1 = max(0, x1);
+            y1 = max(0, y1);
+
+            if (x1 > x2 || y1 > y2) continue;
+
+            color = pc->colors ? &pc->colors[3 * (i + j)] : cloudColor;
+
+            for (py = y1; py <= y2; py++)
+            {
+                depth = &fb->depth[py * fb->width + x1];
+                p = &fb->pixels[3 * (py * fb->width + x1)];
+
+                for (px = x1; px <= x2; px++, depth++, p += 3)
+                {
+                    if (sz[j] >= *depth) continue;
+
+                    *depth = sz[j];
+                    p[0] = color[0];
+                    p[1] = color[1];
+                    p[2] = color[2];
+                }
+            }
+
+            minX = min(minX, x1);
+            minY = min(minY, y1);
+            maxX = max(maxX, x2);
+            maxY = max(maxY, y2);
+            drawn++;
+        }
+    }
+
+    pc->screenBounds = drawn ? createRect(minX, minY, maxX, maxY) : createEmptyRect();
+    markDirtyRect(&dirtyRegion, pc->screenBounds);
+
+    return drawn;
+}
+
+void destroyPointCloud(PointCloud *pc)
+{
+    if (!pc) return;
+
+    free(pc->x);
+    free(pc->y);
+    free(pc->z);
+    free(pc->colors);
+    free(pc);
+}
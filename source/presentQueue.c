@@ -0,0 +1,220 @@
+#define PRESENT_SINK_CANVAS 0
+#define PRESENT_SINK_FILE   1
+
+#define MAX_PRESENT_BUFFERS 3
+
+typedef struct PresentQueueStruct
+{
+    int bufferCount;
+    FrameBuffer *buffers[MAX_PRESENT_BUFFERS];
+    Rect drawn[MAX_PRESENT_BUFFERS];   // area of the last frame rendered into each buffer
+    Rect present[MAX_PRESENT_BUFFERS]; // area of each queued frame that has to be presented
+
+    int framesInFlight; // how many completed frames may wait for presenting
+    int rowsPerStep;    // rows presented by one step, 0 = the whole frame at once
+
+    int back;       // the buffer being rendered into
+    int head;       // the oldest completed frame
+    int queued;     // number of completed frames waiting
+    int presentRow; // next row of the head frame to present
+
+    short sink;
+    short x;
+    short y;
+    FILE *file;
+    short format;
+    unsigned char *encoded;
+}PresentQueue;
+
+PresentQueue *newPresentQueue(short width, short height, int bufferCount, int framesInFlight);
+void setPresentCanvasSink(PresentQueue *pq, short x, short y);
+int setPresentFileSink(PresentQueue *pq, FILE *file, short format, int fps);
+FrameBuffer *acquireBackBuffer(PresentQueue *pq);
+Rect getBackBufferClearRect(PresentQueue *pq, Rect drawn);
+void submitBackBuffer(PresentQueue *pq, Rect drawn, Rect present);
+int stepPresentQueue(PresentQueue *pq);
+void flushPresentQueue(PresentQueue *pq);
+void destroyPresentQueue(PresentQueue *pq);
+
+PresentQueue *newPresentQueue(short width, short height, int bufferCount, int framesInFlight)
+{
+    int i;
+    PresentQueue *ptr = NULL;
+
+    if (bufferCount < 2 || bufferCount > MAX_PRESENT_BUFFERS) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    ptr->encoded = malloc(3 * width * height);
+
+    if (!ptr->encoded)
+    {
+        free(ptr);
+        return NULL;
+    }
+
+    for (i = 0; i < bufferCount; i++)
+    {
+        ptr->buffers[i] = newFrameBuffer(width, height);
+
+        if (!ptr->buffers[i])
+        {
+            while (i--) destroyFrameBuffer(ptr->buffers[i]);
+            free(ptr->encoded);
+            free(ptr);
+            return NULL;
+        }
+
+        ptr->drawn[i] = ptr->present[i] = createEmptyRect();
+    }
+
+    // one buffer is always being rendered into, the rest can hold completed frames,
+    // so at most bufferCount - 1 of them wait while the next one is rendered
+    ptr->bufferCount = bufferCount;
+    ptr->framesInFlight = max(1, min(bufferCount - 1, framesInFlight));
+    ptr->rowsPerStep = 16;
+
+    ptr->back = 0;
+    ptr->head = 0;
+    ptr->queued = 0;
+    ptr->presentRow = -1;
+
+    ptr->sink = PRESENT_SINK_CANVAS;
+    ptr->x = ptr->y = 0;
+    ptr->file = NULL;
+    ptr->format = FRAME_FORMAT_PPM;
+
+    return ptr;
+}
+
+void setPresentCanvasSink(PresentQueue *pq, short x, short y)
+{
+    if (!pq) return;
+
+    flushPresentQueue(pq);
+
+    pq->sink = PRESENT_SINK_CANVAS;
+    pq->x = x;
+    pq->y = y;
+}
+
+int setPresentFileSink(PresentQueue *pq, FILE *file, short format, int fps)
+{
+    if (!pq || !file) return -1;
+
+    flushPresentQueue(pq);
+
+    pq->sink = PRESENT_SINK_FILE;
+    pq->file = file;
+    pq->format = format;
+
+    if (writeFrameStreamHeader(pq->buffers[0], file, format, fps)) return -2;
+
+    return 0;
+}
+
+FrameBuffer *acquireBackBuffer(PresentQueue *pq)
+{
+    if (!pq) return NULL;
+
+    // up to framesInFlight completed frames wait while the next one is rendered, and
+    // the drawing presents them a few rows at a time; backpressure: with one more
+    // waiting (with framesInFlight at bufferCount - 1 the back buffer itself still
+    // holds a frame) the oldest one is presented right away before rendering continues
+    while (pq->queued > pq->framesInFlight)
+    {
+        stepPresentQueue(pq);
+    }
+
+    return pq->buffers[pq->back];
+}
+
+Rect getBackBufferClearRect(PresentQueue *pq, Rect drawn)
+{
+    // the back buffer still holds the frame rendered into it bufferCount frames ago
+    return unionRect(pq->drawn[pq->back], drawn);
+}
+
+void submitBackBuffer(PresentQueue *pq, Rect drawn, Rect present)
+{
+    if (!pq) return;
+
+    pq->drawn[pq->back] = drawn;
+    pq->present[pq->back] = present;
+    pq->queued++;
+
+    if (pq->presentRow < 0)
+        pq->presentRow = 0;
+
+    pq->back = (pq->back + 1) % pq->bufferCount;
+}
+
+int stepPresentQueue(PresentQueue *pq)
+{
+    int rows;
+    Rect rect;
+    FrameBuffer *fb;
+
+    if (!pq || !pq->queued) return 0;
+
+    fb = pq->buffers[pq->head];
+    rect = clipRect(pq->present[pq->head], fb->width, fb->height);
+
+    if (pq->sink == PRESENT_SINK_FILE)
+    {
+        // a file receives the whole frame in one write
+        if (pq->file && !encodeFrameBuffer(fb, pq->format, pq->encoded))
+            writeEncodedFrame(fb, pq->file, pq->format, pq->encoded);
+
+        pq->presentRow = rect.y2 + 1;
+    }
+    else
+    {
+        rows = (pq->rowsPerStep > 0) ? pq->rowsPerStep : fb->height;
+        rect.y1 = max(rect.y1, pq->presentRow);
+
+        if (rect.y1 <= rect.y2)
+        {
+            rect.y2 = min(rect.y2, rect.y1 + rows - 1);
+            presentFrameBuffer(fb, rect, pq->x, pq->y);
+        }
+
+        pq->presentRow = rect.y2 + 1;
+    }
+
+    if (pq->presentRow > min(pq->present[pq->head].y2, fb->height - 1))
+    {
+        // the head frame is done, move on to the next completed one
+        pq->head = (pq->head + 1) % pq->bufferCount;
+        pq->queued--;
+        pq->presentRow = pq->queued ? 0 : -1;
+    }
+
+    return pq->queued;
+}
+
+void flushPresentQueue(PresentQueue *pq)
+{
+    if (!pq) return;
+
+    while (stepPresentQueue(pq));
+}
+
+void destroyPresentQueue(PresentQueue *pq)
+{
+    int i;
+
+    if (!pq) return;
+
+    flushPresentQueue(pq);
+
+    for (i = 0; i < pq->bufferCount; i++)
+    {
+        destroyFrameBuffer(pq->buffers[i]);
+    }
+
+    free(pq->encoded);
+    free(pq);
+}
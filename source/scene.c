@@ -0,0 +1,557 @@
+#define SCENE_MAX_DEPTH 6 // octree levels below the root
+
+typedef struct SceneObjectStruct
+{
+    Mesh *mesh;
+    Vector3 localCenter; // bounding sphere of the mesh in object space
+    float localRadius;
+    Vector3 center;      // the same sphere in world space, as of the last update
+    float radius;
+
+    int node;      // octree node the object is linked into
+    int next;      // next object in the same node, -1 for none
+    int previous;
+    int drawnFrame; // the last frame renderScene drew the object in
+    Mesh *occluder; // drawn into the scene's occlusion buffer in the object's place, NULL if none
+}SceneObject;
+
+typedef struct SceneStruct
+{
+    int objectCount;
+    int objectCapacity;
+    SceneObject *objects; // indexed by object handle
+
+    // Loose octree over a cube, stored level by level: the children of the
+    // cell (x, y, z) on one level are the cells (2x..2x+1, ...) on the next.
+    // Every cell's loose bounds are twice its size, so an object is placed in
+    // the cell containing its center on the deepest level where the object's
+    // radius is at most half of the cell size, and it never has to straddle.
+    short depth;
+    Vector3 origin; // minimum corner of the root cell
+    float size;     // edge length of the root cell
+    int nodeCount;
+    int levelStart[SCENE_MAX_DEPTH + 1];
+    int *firstObject; // first object of each node, -1 for none
+    int *subtreeCount; // objects in each node and all of its descendants
+
+    int *stack;   // nodes still to visit during a query
+    int *results; // object handles found by the last query
+    int *drawn;   // objects drawn on the last renderScene
+    int drawnCount;
+    int settledCount; // objects below this have had their faces hidden once
+    int frame;
+
+    // when set, the objects with an occluder are drawn into this buffer
+    // first, and the other objects hidden behind them are skipped
+    OcclusionBuffer *occlusion;
+}Scene;
+
+Scene *newScene(Vector3 center, float size, short depth);
+int addSceneObject(Scene *scene, Mesh *mesh);
+void updateSceneObject(Scene *scene, int handle);
+void moveSceneObject(Scene *scene, int handle, Vector3 position);
+void setSceneOccluder(Scene *scene, int handle, Mesh *occluder);
+int findSceneNode(Scene *scene, Vector3 center, float radius);
+void getSceneNodeBounds(Scene *scene, int node, Vector3 *boundsMin, Vector3 *boundsMax);
+int getSceneNodeLevel(Scene *scene, int node);
+int getSceneNodeParent(Scene *scene, int node);
+void linkSceneObject(Scene *scene, int handle, int node);
+void unlinkSceneObject(Scene *scene, int handle);
+int querySceneFrustum(Scene *scene, Camera *camera);
+int querySceneRange(Scene *scene, Vector3 center, float radius);
+int pushSceneChildren(Scene *scene, int node, int stackSize, int inside);
+int renderScene(Scene *scene, Screen *screen, Camera *camera);
+void hideMeshFaces(TrianglePool *tp, Mesh *mesh);
+void destroyScene(Scene *scene);
+
+Scene *newScene(Vector3 center, float size, short depth)
+{
+    int i, cells = 1;
+    Scene *ptr = NULL;
+
+    if (size <= 0.0f || depth < 0 || depth > SCENE_MAX_DEPTH) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    ptr->depth = depth;
+    ptr->size = size;
+    ptr->origin = subtractVector3(center, createVector3(size / 2.0f, size / 2.0f, size / 2.0f));
+    ptr->nodeCount = 0;
+
+    for (i = 0; i <= depth; i++)
+    {
+        ptr->levelStart[i] = ptr->nodeCount;
+        ptr->nodeCount += cells;
+        cells *= 8;
+    }
+
+    ptr->objectCount = 0;
+    ptr->objectCapacity = 64;
+    ptr->objects = malloc(sizeof *(ptr->objects) * ptr->objectCapacity);
+    ptr->results = malloc(sizeof *(ptr->results) * ptr->objectCapacity);
+    ptr->drawn = malloc(sizeof *(ptr->drawn) * ptr->objectCapacity);
+    ptr->firstObject = malloc(sizeof *(ptr->firstObject) * ptr->nodeCount);
+    ptr->subtreeCount = malloc(sizeof *(ptr->subtreeCount) * ptr->nodeCount);
+    ptr->stack = malloc(sizeof *(ptr->stack) * (7 * depth + 1)); // 7 siblings wait per level
+
+    if (!ptr->objects || !ptr->results || !ptr->drawn || !ptr->firstObject ||
+        !ptr->subtreeCount || !ptr->stack)
+    {
+        destroyScene(ptr);
+        return NULL;
+    }
+
+    for (i = 0; i < ptr->nodeCount; i++)
+    {
+        ptr->firstObject[i] = -1;
+        ptr->subtreeCount[i] = 0;
+    }
+
+    ptr->drawnCount = 0;
+    ptr->settledCount = 0;
+    ptr->frame = 0;
+    ptr->occlusion = NULL;
+
+    return ptr;
+}
+
+int addSceneObject(Scene *scene, Mesh *mesh)
+{
+    int capacity, *results, *drawn;
+    SceneObject *objects, *object;
+
+    if (!scene || !mesh || mesh->vertexCount <= 0) return -1;
+
+    if (scene->objectCount == scene->objectCapacity)
+    {
+        capacity = 2 * scene->objectCapacity;
+
+        if (!(objects = realloc(scene->objects, sizeof *objects * capacity))) return -2;
+        scene->objects = objects;
+
+        if (!(results = realloc(scene->results, sizeof *results * capacity))) return -2;
+        scene->results = results;
+
+        if (!(drawn = realloc(scene->drawn, sizeof *drawn * capacity))) return -2;
+        scene->drawn = drawn;
+
+        scene->objectCapacity = capacity;
+    }
+
+    object = &scene->objects[scene->objectCount];
+    object->mesh = mesh;
+    object->node = -1;
+    object->drawnFrame = -1;
+    object->occluder = NULL;
+    getMeshBoundingSphere(mesh, &object->localCenter, &object->localRadius);
+
+    scene->objectCount++;
+    updateSceneObject(scene, scene->objectCount - 1);
+
+    return scene->objectCount - 1;
+}
+
+void updateSceneObject(Scene *scene, int handle)
+{
+    int node;
+    SceneObject *object;
+    Matrix4x4 world;
+
+    if (!scene || handle < 0 || handle >= scene->objectCount) return;
+
+    // to be called whenever the mesh's position or orientation changes,
+    // most moves stay inside the same loose cell and relink nothing
+    object = &scene->objects[handle];
+    world = getMeshWorldMatrix(object->mesh);
+    object->center = transformVector3ByMatrix(object->localCenter, world);
+    object->radius = object->localRadius * getMatrixMaxScale(world);
+
+    node = findSceneNode(scene, object->center, object->radius);
+
+    if (node == object->node) return;
+
+    if (object->node >= 0)
+        unlinkSceneObject(scene, handle);
+
+    linkSceneObject(scene, handle, node);
+}
+
+void moveSceneObject(Scene *scene, int handle, Vector3 position)
+{
+    if (!scene || handle < 0 || handle >= scene->objectCount) return;
+
+    scene->objects[handle].mesh->position = position;
+    updateSceneObject(scene, handle);
+}
+
+void setSceneOccluder(Scene *scene, int handle, Mesh *occluder)
+{
+    if (!scene || handle < 0 || handle >= scene->objectCount) return;
+
+    // the mesh itself or a simpler one that stays inside of it,
+    // placed with the object mesh's position and orientation
+    scene->objects[handle].occluder = occluder;
+}
+
+int findSceneNode(Scene *scene, Vector3 center, float radius)
+{
+    int level = 0, cells = 1, x, y, z;
+    float cellSize = scene->size;
+    Vector3 local = subtractVector3(center, scene->origin);
+
+    // the root takes everything that is too big for a cell or outside of the scene
+    if (local.x < 0.0f || local.y < 0.0f || local.z < 0.0f ||
+        local.x >= scene->size || local.y >= scene->size || local.z >= scene->size)
+        return 0;
+
+    while (level < scene->depth && radius <= cellSize / 4.0f)
+    {
+        level++;
+        cells *= 2;
+        cellSize /= 2.0f;
+    }
+
+    x = min(cells - 1, floor(local.x / cellSize));
+    y = min(cells - 1, floor(local.y / cellSize));
+    z = min(cells - 1, floor(local.z / cellSize));
+
+    return scene->levelStart[level] + (z * cells + y) * cells + x;
+}
+
+void getSceneNodeBounds(Scene *scene, int node, Vector3 *boundsMin, Vector3 *boundsMax)
+{
+    int level = getSceneNodeLevel(scene, node), cells = 1 << level, local = node - scene->levelStart[level];
+    float cellSize = scene->size / cells;
+    Vector3 corner;
+
+    corner.x = scene->origin.x + (local % cells) * cellSize;
+    corner.y = scene->origin.y + ((local / cells) % cells) * cellSize;
+    corner.z = scene->origin.z + (local / (cells * cells)) * cellSize;
+
+    // loose bounds: half a cell further out on every side
+    *boundsMin = subtractVector3(corner, createVector3(cellSize / 2.0f, cellSize / 2.0f, cellSize / 2.0f));
+    *boundsMax = addVector3(corner, createVector3(1.5f * cellSize, 1.5f * cellSize, 1.5f * cellSize));
+}
+
+int getSceneNodeLevel(Scene *scene, int node)
+{
+    int level = scene->depth;
+
+    while (node < scene->levelStart[level]) level--;
+
+    return level;
+}
+
+int getSceneNodeParent(Scene *scene, int node)
+{
+    int level, cells, local, x, y, z;
+
+    if (node <= 0) return -1;
+
+    level = getSceneNodeLevel(scene, node);
+    cells = 1 << level;
+    local = node - scene->levelStart[level];
+    x = (local % cells) / 2;
+    y = ((local / cells) % cells) / 2;
+    z = (local / (cells * cells)) / 2;
+    cells /= 2;
+
+    return scene->levelStart[level - 1] + (z * cells + y) * cells + x;
+}
+
+void linkSceneObject(Scene *scene, int handle, int node)
+{
+    SceneObject *object = &scene->objects[handle];
+
+    object->node = node;
+    object->previous = -1;
+    object->next = scene->firstObject[node];
+
+    if (object->next >= 0)
+        scene->objects[object->next].previous = handle;
+
+    scene->firstObject[node] = handle;
+
+    for (; node >= 0; node = getSceneNodeParent(scene, node))
+    {
+        scene->subtreeCount[node]++;
+    }
+}
+
+void unlinkSceneObject(Scene *scene, int handle)
+{
+    int node;
+    SceneObject *object = &scene->objects[handle];
+
+    if (object->previous >= 0)
+        scene->objects[object->previous].next = object->next;
+    else
+        scene->firstObject[object->node] = object->next;
+
+    if (object->next >= 0)
+        scene->objects[object->next].previous = object->previous;
+
+    for (node = object->node; node >= 0; node = getSceneNodeParent(scene, node))
+    {
+        scene->subtreeCount[node]--;
+    }
+
+    object->node = -1;
+}
+
+int querySceneFrustum(Scene *scene, Camera *camera)
+{
+    int i, node, handle, count = 0, stackSize = 0;
+    short inside, outside;
+    float nearest, farthest;
+    Vector3 boundsMin, boundsMax;
+    Plane *plane;
+    SceneObject *object;
+
+    // expects world space frustum planes: setCameraFrustum(camera, getViewProjectionMatrix(...))
+    if (!scene || !camera || !scene->subtreeCount[0]) return 0;
+
+    // positive entries are nodes to test, negative ones (-node - 1)
+    // are inside the view with everything below them
+    scene->stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        node = scene->stack[--stackSize];
+
+        if (node < 0)
+        {
+            node = -node - 1;
+
+            for (handle = scene->firstObject[node]; handle >= 0; handle = scene->objects[handle].next)
+            {
+                scene->results[count++] = handle;
+            }
+
+            stackSize = pushSceneChildren(scene, node, stackSize, 1);
+            continue;
+        }
+
+        // the root is always tested object by object, it also holds the objects outside of the octree
+        if (node > 0)
+        {
+            getSceneNodeBounds(scene, node, &boundsMin, &boundsMax);
+            inside = 1;
+            outside = 0;
+
+            for (i = 0; i < 6 && !outside; i++)
+            {
+                plane = &camera->frustum[i];
+
+                // the box corners farthest along and against the plane normal
+                farthest = plane->d + plane->normal.x * (plane->normal.x > 0.0f ? boundsMax.x : boundsMin.x)
+                                    + plane->normal.y * (plane->normal.y > 0.0f ? boundsMax.y : boundsMin.y)
+                                    + plane->normal.z * (plane->normal.z > 0.0f ? boundsMax.z : boundsMin.z);
+                nearest = plane->d + plane->normal.x * (plane->normal.x > 0.0f ? boundsMin.x : boundsMax.x)
+                                   + plane->normal.y * (plane->normal.y > 0.0f ? boundsMin.y : boundsMax.y)
+                                   + plane->normal.z * (plane->normal.z > 0.0f ? boundsMin.z : boundsMax.z);
+
+                if (farthest < 0.0f) outside = 1;
+                else if (nearest < 0.0f) inside = 0;
+            }
+
+            if (outside) continue;
+
+            // a cell completely in view takes its whole subtree without more tests
+            if (inside)
+            {
+                scene->stack[stackSize++] = -node - 1;
+                continue;
+            }
+        }
+
+        for (handle = scene->firstObject[node]; handle >= 0; handle = object->next)
+        {
+            object = &scene->objects[handle];
+
+            for (i = 0; i < 6; i++)
+            {
+                if (dotProductVector3(camera->frustum[i].normal, object->center) + camera->frustum[i].d < -object->radius)
+                    break;
+            }
+
+            if (i == 6) scene->results[count++] = handle;
+        }
+
+        stackSize = pushSceneChildren(scene, node, stackSize, 0);
+    }
+
+    return count;
+}
+
+int querySceneRange(Scene *scene, Vector3 center, float radius)
+{
+    int i, node, handle, count = 0, stackSize = 0;
+    float distance, d;
+    Vector3 boundsMin, boundsMax;
+    SceneObject *object;
+
+    if (!scene || !scene->subtreeCount[0]) return 0;
+
+    scene->stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        node = scene->stack[--stackSize];
+
+        if (node > 0)
+        {
+            getSceneNodeBounds(scene, node, &boundsMin, &boundsMax);
+
+            // squared distance from the center to the loose box
+            distance = 0.0f;
+
+            for (i = 0; i < 3; i++)
+            {
+                d = getVector3Component(center, i);
+
+                if (d < getVector3Component(boundsMin, i)) d -= getVector3Component(boundsMin, i);
+                else if (d > getVector3Component(boundsMax, i)) d -= getVector3Component(boundsMax, i);
+                else d = 0.0f;
+
+                distance += d * d;
+            }
+
+            if (distance > radius * radius) continue;
+        }
+
+        for (handle = scene->firstObject[node]; handle >= 0; handle = object->next)
+        {
+            object = &scene->objects[handle];
+            d = radius + object->radius;
+
+            if (dotProductVector3(subtractVector3(object->center, center), subtractVector3(object->center, center)) <= d * d)
+                scene->results[count++] = handle;
+        }
+
+        stackSize = pushSceneChildren(scene, node, stackSize, 0);
+    }
+
+    return count;
+}
+
+int pushSceneChildren(Scene *scene, int node, int stackSize, int inside)
+{
+    int i, level, cells, local, x, y, z, first, child;
+
+    level = getSceneNodeLevel(scene, node);
+
+    if (level == scene->depth) return stackSize;
+
+    // the first child is at twice the coordinates on the next level,
+    // the other seven are one step along x, y or z from it
+    cells = 1 << level;
+    local = node - scene->levelStart[level];
+    x = 2 * (local % cells);
+    y = 2 * ((local / cells) % cells);
+    z = 2 * (local / (cells * cells));
+    cells *= 2;
+    first = scene->levelStart[level + 1] + (z * cells + y) * cells + x;
+
+    // empty subtrees are left out
+    for (i = 0; i < 8; i++)
+    {
+        child = first + (i & 1) + ((i >> 1) & 1) * cells + (i >> 2) * cells * cells;
+
+        if (scene->subtreeCount[child])
+            scene->stack[stackSize++] = inside ? -child - 1 : child;
+    }
+
+    return stackSize;
+}
+
+int renderScene(Scene *scene, Screen *screen, Camera *camera)
+{
+    int i, count, drawnCount;
+    SceneObject *object;
+
+    if (!scene) return -1;
+
+    // renderMesh replaces the camera's planes with object space ones,
+    // so the query runs on world space planes before any mesh is drawn
+    setCameraFrustum(camera, getViewProjectionMatrix(screen, camera));
+
+    // the pool adds faces as visible, so an object that was never
+    // drawn would show stale projections until it's hidden once
+    for (; scene->settledCount < scene->objectCount; scene->settledCount++)
+    {
+        hideMeshFaces(&trianglePool, scene->objects[scene->settledCount].mesh);
+    }
+
+    count = querySceneFrustum(scene, camera);
+    scene->frame++;
+
+    if (scene->occlusion)
+    {
+        beginOcclusionFrame(scene->occlusion, screen, camera);
+
+        for (i = 0; i < count; i++)
+        {
+            object = &scene->objects[scene->results[i]];
+
+            if (object->occluder)
+                addOccluderMesh(scene->occlusion, object->occluder, getMeshWorldMatrix(object->mesh));
+        }
+    }
+
+    for (i = 0, drawnCount = 0; i < count; i++)
+    {
+        object = &scene->objects[scene->results[i]];
+
+        // occluders are never tested, they would be hidden by themselves
+        if (scene->occlusion && !object->occluder &&
+            isSphereOccluded(scene->occlusion, object->center, object->radius))
+            continue;
+
+        object->drawnFrame = scene->frame;
+        renderMesh(screen, camera, object->mesh);
+        scene->results[drawnCount++] = scene->results[i];
+    }
+
+    count = drawnCount;
+
+    // the pool still holds the triangles of objects that went out of view or got hidden
+    for (i = 0; i < scene->drawnCount; i++)
+    {
+        object = &scene->objects[scene->drawn[i]];
+
+        if (object->drawnFrame != scene->frame)
+            hideMeshFaces(&trianglePool, object->mesh);
+    }
+
+    memcpy(scene->drawn, scene->results, sizeof *(scene->drawn) * count);
+    scene->drawnCount = count;
+
+    return count;
+}
+
+void hideMeshFaces(TrianglePool *tp, Mesh *mesh)
+{
+    int i;
+
+    for (i = 0; i < mesh->faceCount; i++)
+    {
+        tp->triangles[mesh->faces[i].poolIndex].drawState = 0;
+    }
+}
+
+void destroyScene(Scene *scene)
+{
+    // the meshes belong to the caller
+    if (!scene) return;
+
+    free(scene->objects);
+    free(scene->results);
+    free(scene->drawn);
+    free(scene->firstObject);
+    free(scene->subtreeCount);
+    free(scene->stack);
+    free(scene);
+}
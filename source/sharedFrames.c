@@ -0,0 +1,153 @@
+#define SHARED_FRAMES_MAGIC   0x53463353 // "S3FS" read as a little endian integer
+#define SHARED_FRAMES_VERSION 1
+
+#define MAX_SHARED_FRAME_SLOTS 8
+
+// Layout of the file, every header field an unsigned 32 bit integer in the native byte order:
+//   0 magic, 1 version, 2 width, 3 height, 4 slot count, 5 bytes per slot,
+//   6 offset of the first slot, 7 sequence number of the latest complete frame,
+//   8... sequence number of the frame in each slot, 0 while the slot is being written
+// followed by the slots, each holding the RGB pixels of one frame, rows from top to bottom.
+//
+// A reader takes the latest sequence number s, reads slot s % slot count if its sequence
+// number is s, and checks that the slot's number is still s after reading the pixels.
+// If it isn't, the writer came around the ring while the frame was being read.
+#define SHARED_FRAMES_HEADER_FIELDS 8
+
+typedef struct SharedFramesStruct
+{
+    FILE *file;
+    short width;
+    short height;
+    unsigned int slotCount;
+    unsigned int slotSize;
+    unsigned int dataOffset;
+
+    unsigned int sequence;  // frames published so far
+    unsigned int published;
+    unsigned int dropped;   // frames left out because a write failed
+}SharedFrames;
+
+SharedFrames *newSharedFrames(char fileName[256], short width, short height, int slotCount);
+int writeSharedFramesField(SharedFrames *sf, long field, unsigned int value);
+unsigned int publishSharedFrame(SharedFrames *sf, FrameBuffer *fb);
+void destroySharedFrames(SharedFrames *sf);
+
+SharedFrames *newSharedFrames(char fileName[256], short width, short height, int slotCount)
+{
+    unsigned int i, header[SHARED_FRAMES_HEADER_FIELDS + MAX_SHARED_FRAME_SLOTS];
+    unsigned char zero[256];
+    unsigned long size, written, chunk;
+    SharedFrames *ptr = NULL;
+
+    if (width <= 0 || height <= 0 || slotCount < 2 || slotCount > MAX_SHARED_FRAME_SLOTS) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    // on Linux a file in /dev/shm lives only in shared memory, and a
+    // reader can map it and use the frames without copying them
+    if (!(ptr->file = fopen(fileName, "w+b")))
+    {
+        DEBUG_MSG_FROM("Failed: Could not create the shared frame file.", "newSharedFrames");
+        free(ptr);
+        return NULL;
+    }
+
+    ptr->width = width;
+    ptr->height = height;
+    ptr->slotCount = slotCount;
+    ptr->slotSize = 3 * width * height;
+    ptr->dataOffset = sizeof header; // same for every slot count, 64 bytes
+    ptr->sequence = ptr->published = ptr->dropped = 0;
+
+    header[0] = SHARED_FRAMES_MAGIC;
+    header[1] = SHARED_FRAMES_VERSION;
+    header[2] = width;
+    header[3] = height;
+    header[4] = ptr->slotCount;
+    header[5] = ptr->slotSize;
+    header[6] = ptr->dataOffset;
+    header[7] = 0;
+
+    for (i = 0; i < MAX_SHARED_FRAME_SLOTS; i++)
+    {
+        header[SHARED_FRAMES_HEADER_FIELDS + i] = 0;
+    }
+
+    memset(zero, 0, sizeof zero);
+
+    // the whole file is allocated up front, so that publishing a frame never grows it
+    size = (unsigned long)ptr->slotCount * ptr->slotSize;
+
+    if (fwrite(header, sizeof header, 1, ptr->file) != 1)
+    {
+        destroySharedFrames(ptr);
+        return NULL;
+    }
+
+    for (written = 0; written < size; written += chunk)
+    {
+        chunk = min(sizeof zero, size - written);
+
+        if (fwrite(zero, 1, chunk, ptr->file) != chunk)
+        {
+            DEBUG_MSG_FROM("Failed: Could not allocate the frame slots.", "newSharedFrames");
+            destroySharedFrames(ptr);
+            return NULL;
+        }
+    }
+
+    fflush(ptr->file);
+
+    return ptr;
+}
+
+int writeSharedFramesField(SharedFrames *sf, long field, unsigned int value)
+{
+    if (fseek(sf->file, field * sizeof value, SEEK_SET)) return -1;
+    if (fwrite(&value, sizeof value, 1, sf->file) != 1) return -2;
+
+    return 0;
+}
+
+unsigned int publishSharedFrame(SharedFrames *sf, FrameBuffer *fb)
+{
+    unsigned int sequence, slot;
+
+    if (!sf || !fb || fb->width != sf->width || fb->height != sf->height) return 0;
+
+    // the oldest slot is overwritten without waiting for the readers: a reader
+    // that is still in it will notice and skip the frame, so a slow reader
+    // only loses frames and never slows down the rendering
+    sequence = sf->sequence + 1;
+    slot = sequence % sf->slotCount;
+
+    // the seek between the writes flushes each of them out before the next one,
+    // so a reader sees the slot marked busy before its pixels change
+    if (writeSharedFramesField(sf, SHARED_FRAMES_HEADER_FIELDS + slot, 0) ||
+        fseek(sf->file, sf->dataOffset + slot * sf->slotSize, SEEK_SET) ||
+        fwrite(fb->pixels, 1, sf->slotSize, sf->file) != sf->slotSize ||
+        writeSharedFramesField(sf, SHARED_FRAMES_HEADER_FIELDS + slot, sequence) ||
+        writeSharedFramesField(sf, 7, sequence) ||
+        fflush(sf->file))
+    {
+        // the slot stays marked busy, readers skip it until it's written again
+        sf->dropped++;
+        return 0;
+    }
+
+    sf->sequence = sequence;
+    sf->published++;
+
+    return sequence;
+}
+
+void destroySharedFrames(SharedFrames *sf)
+{
+    if (!sf) return;
+
+    if (sf->file) fclose(sf->file);
+    free(sf);
+}
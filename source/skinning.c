@@ -0,0 +1,454 @@
+#define MAX_SKIN_BONES     64
+#define MAX_BONE_WEIGHTS   4
+#define SKIN_CHUNK_VERTICES 1024
+
+typedef struct MorphTargetStruct
+{
+    float weight;
+
+    // only the vertices the target moves, as offsets from the bind pose
+    int count;
+    int *indices;
+    float *dx;
+    float *dy;
+    float *dz;
+}MorphTarget;
+
+typedef struct SkinStruct
+{
+    Mesh *mesh;
+    int vertexCount;
+
+    // the undeformed mesh, one array per component so that the
+    // vertex loop reads each of them straight through
+    float *bindX, *bindY, *bindZ;
+    float *bindNormalX, *bindNormalY, *bindNormalZ;
+
+    // the bind pose with the active morph targets added, only used while one is active
+    float *morphX, *morphY, *morphZ;
+
+    // MAX_BONE_WEIGHTS influences per vertex, the largest weight first,
+    // a weight of 0 ends the list and a vertex without any stays in place
+    unsigned char *boneIndices;
+    float *boneWeights;
+
+    int boneCount;
+    Matrix4x4 inverseBind[MAX_SKIN_BONES]; // model space to bone space in the bind pose
+    Matrix4x4 pose[MAX_SKIN_BONES];        // bone space to model space in the current pose
+    Matrix4x4 palette[MAX_SKIN_BONES];     // the two combined, once per update
+
+    int morphCount;
+    MorphTarget *morphs;
+
+    unsigned int version;        // changed by every change to the pose, weights or morph targets
+    unsigned int appliedVersion; // the version the mesh was last deformed to
+}Skin;
+
+Skin *newSkin(Mesh *mesh, int boneCount);
+int setSkinVertexWeights(Skin *skin, int vertex, int count, int *bones, float *weights);
+int setBoneBindPose(Skin *skin, int bone, Matrix4x4 bindPose);
+int setBonePose(Skin *skin, int bone, Matrix4x4 pose);
+int addMorphTarget(Skin *skin, Vector3 *offsets);
+int setMorphWeight(Skin *skin, int morph, float weight);
+int updateSkin(Skin *skin);
+void applyMorphTargets(Skin *skin);
+void deformSkinVertices(Skin *skin, int first, int count, short morphed);
+void updateSkinFaceNormals(Skin *skin, int firstFace, int count);
+void destroySkin(Skin *skin);
+
+Skin *newSkin(Mesh *mesh, int boneCount)
+{
+    int i, n;
+    Skin *ptr = NULL;
+
+    if (!mesh || boneCount <= 0 || boneCount > MAX_SKIN_BONES) return NULL;
+
+    // compressed meshes are read-only, and a BSP only holds for a rigid mesh
+    if (!mesh->vertices || mesh->bsp)
+    {
+        DEBUG_MSG_FROM("Failed: The mesh can't be deformed.", "newSkin");
+        return NULL;
+    }
+
+    // one generated normal per face and smooth vertex normals, both deformed with the mesh
+    if (generateMeshNormals(mesh, MESH_NORMALS_GENERATE) < 0) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    n = mesh->vertexCount;
+    ptr->mesh = mesh;
+    ptr->vertexCount = n;
+    ptr->bindX = malloc(sizeof *(ptr->bindX) * n);
+    ptr->bindY = malloc(sizeof *(ptr->bindY) * n);
+    ptr->bindZ = malloc(sizeof *(ptr->bindZ) * n);
+    ptr->bindNormalX = malloc(sizeof *(ptr->bindNormalX) * n);
+    ptr->bindNormalY = malloc(sizeof *(ptr->bindNormalY) * n);
+    ptr->bindNormalZ = malloc(sizeof *(ptr->bindNormalZ) * n);
+    ptr->morphX = ptr->morphY = ptr->morphZ = NULL;
+    ptr->boneIndices = malloc(sizeof *(ptr->boneIndices) * n * MAX_BONE_WEIGHTS);
+    ptr->boneWeights = malloc(sizeof *(ptr->boneWeights) * n * MAX_BONE_WEIGHTS);
+    ptr->morphCount = 0;
+    ptr->morphs = NULL;
+
+    if (!ptr->bindX || !ptr->bindY || !ptr->bindZ || !ptr->bindNormalX || !ptr->bindNormalY ||
+        !ptr->bindNormalZ || !ptr->boneIndices || !ptr->boneWeights)
+    {
+        destroySkin(ptr);
+        return NULL;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        ptr->bindX[i] = mesh->vertices[i].x;
+        ptr->bindY[i] = mesh->vertices[i].y;
+        ptr->bindZ[i] = mesh->vertices[i].z;
+        ptr->bindNormalX[i] = mesh->vertexNormals[i].x;
+        ptr->bindNormalY[i] = mesh->vertexNormals[i].y;
+        ptr->bindNormalZ[i] = mesh->vertexNormals[i].z;
+    }
+
+    memset(ptr->boneIndices, 0, sizeof *(ptr->boneIndices) * n * MAX_BONE_WEIGHTS);
+    memset(ptr->boneWeights, 0, sizeof *(ptr->boneWeights) * n * MAX_BONE_WEIGHTS);
+
+    // every bone starts at the origin, unmoved
+    ptr->boneCount = boneCount;
+
+    for (i = 0; i < boneCount; i++)
+    {
+        ptr->inverseBind[i] = ptr->pose[i] = createTranslationMatrix(0.0f, 0.0f, 0.0f);
+    }
+
+    ptr->version = 1;
+    ptr->appliedVersion = 0;
+
+    return ptr;
+}
+
+int setSkinVertexWeights(Skin *skin, int vertex, int count, int *bones, float *weights)
+{
+    int i, j, bone;
+    float total = 0.0f, weight;
+    unsigned char *vertexBones;
+    float *vertexWeights;
+
+    if (!skin) return -1;
+    if (vertex < 0 || vertex >= skin->vertexCount) return -2;
+    if (count < 0 || count > MAX_BONE_WEIGHTS) return -3;
+
+    for (i = 0; i < count; i++)
+    {
+        if (bones[i] < 0 || bones[i] >= skin->boneCount || weights[i] < 0.0f) return -3;
+
+        total += weights[i];
+    }
+
+    vertexBones = &skin->boneIndices[vertex * MAX_BONE_WEIGHTS];
+    vertexWeights = &skin->boneWeights[vertex * MAX_BONE_WEIGHTS];
+
+    for (i = 0; i < MAX_BONE_WEIGHTS; i++)
+    {
+        vertexBones[i] = 0;
+        vertexWeights[i] = 0.0f;
+    }
+
+    // normalized and sorted from the largest down, so that the
+    // vertex loop can stop at the first unused influence
+    for (i = 0; i < count && total > 0.0f; i++)
+    {
+        bone = bones[i];
+        weight = weights[i] / total;
+
+        for (j = i; j > 0 && vertexWeights[j - 1] < weight; j--)
+        {
+            vertexBones[j] = vertexBones[j - 1];
+            vertexWeights[j] = vertexWeights[j - 1];
+        }
+
+        vertexBones[j] = bone;
+        vertexWeights[j] = weight;
+    }
+
+    skin->version++;
+
+    return 0;
+}
+
+int setBoneBindPose(Skin *skin, int bone, Matrix4x4 bindPose)
+{
+    if (!skin) return -1;
+    if (bone < 0 || bone >= skin->boneCount) return -2;
+
+    skin->inverseBind[bone] = Invert(bindPose);
+    skin->version++;
+
+    return 0;
+}
+
+int setBonePose(Skin *skin, int bone, Matrix4x4 pose)
+{
+    if (!skin) return -1;
+    if (bone < 0 || bone >= skin->boneCount) return -2;
+
+    skin->pose[bone] = pose;
+    skin->version++;
+
+    return 0;
+}
+
+int addMorphTarget(Skin *skin, Vector3 *offsets)
+{
+    int i, count = 0;
+    MorphTarget *morphs, *morph;
+
+    if (!skin || !offsets) return -1;
+
+    if (!skin->morphX)
+    {
+        skin->morphX = malloc(sizeof *(skin->morphX) * skin->vertexCount);
+        skin->morphY = malloc(sizeof *(skin->morphY) * skin->vertexCount);
+        skin->morphZ = malloc(sizeof *(skin->morphZ) * skin->vertexCount);
+
+        if (!skin->morphX || !skin->morphY || !skin->morphZ)
+        {
+            free(skin->morphX);
+            free(skin->morphY);
+            free(skin->morphZ);
+            skin->morphX = skin->morphY = skin->morphZ = NULL;
+            return -2;
+        }
+    }
+
+    if (!(morphs = realloc(skin->morphs, sizeof *morphs * (skin->morphCount + 1)))) return -2;
+
+    skin->morphs = morphs;
+    morph = &morphs[skin->morphCount];
+
+    // a target usually moves a part of the mesh, the rest is left out
+    for (i = 0; i < skin->vertexCount; i++)
+    {
+        if (offsets[i].x != 0.0f || offsets[i].y != 0.0f || offsets[i].z != 0.0f) count++;
+    }
+
+    morph->weight = 0.0f;
+    morph->count = count;
+    morph->indices = malloc(sizeof *(morph->indices) * (count > 0 ? count : 1));
+    morph->dx = malloc(sizeof *(morph->dx) * (count > 0 ? count : 1));
+    morph->dy = malloc(sizeof *(morph->dy) * (count > 0 ? count : 1));
+    morph->dz = malloc(sizeof *(morph->dz) * (count > 0 ? count : 1));
+
+    if (!morph->indices || !morph->dx || !morph->dy || !morph->dz)
+    {
+        free(morph->indices);
+        free(morph->dx);
+        free(morph->dy);
+        free(morph->dz);
+        return -2;
+    }
+
+    for (i = 0, count = 0; i < skin->vertexCount; i++)
+    {
+        if (offsets[i].x == 0.0f && offsets[i].y == 0.0f && offsets[i].z == 0.0f) continue;
+
+        morph->indices[count] = i;
+        morph->dx[count] = offsets[i].x;
+        morph->dy[count] = offsets[i].y;
+        morph->dz[count] = offsets[i].z;
+        count++;
+    }
+
+    return skin->morphCount++;
+}
+
+int setMorphWeight(Skin *skin, int morph, float weight)
+{
+    if (!skin) return -1;
+    if (morph < 0 || morph >= skin->morphCount) return -2;
+
+    if (skin->morphs[morph].weight != weight)
+    {
+        skin->morphs[morph].weight = weight;
+        skin->version++;
+    }
+
+    return 0;
+}
+
+int updateSkin(Skin *skin)
+{
+    int i, first;
+    short morphed = 0;
+    Mesh *mesh;
+
+    if (!skin) return -1;
+
+    mesh = skin->mesh;
+
+    // an unchanged pose leaves the mesh as it is, so a paused
+    // animation costs the same as a static mesh
+    if (skin->appliedVersion == skin->version) return 0;
+
+    // the palette is worked out once for all of the vertices
+    for (i = 0; i < skin->boneCount; i++)
+    {
+        skin->palette[i] = multiplyMatrices(skin->inverseBind[i], skin->pose[i]);
+    }
+
+    for (i = 0; i < skin->morphCount; i++)
+    {
+        if (skin->morphs[i].weight != 0.0f) morphed = 1;
+    }
+
+    if (morphed) applyMorphTargets(skin);
+
+    // a vertex chunk writes only its own vertices and a face chunk only its own faces'
+    // normals, so the chunks of each loop are independent of each other
+    for (first = 0; first < skin->vertexCount; first += SKIN_CHUNK_VERTICES)
+    {
+        deformSkinVertices(skin, first, min(SKIN_CHUNK_VERTICES, skin->vertexCount - first), morphed);
+    }
+
+    for (first = 0; first < mesh->faceCount; first += NORMAL_CHUNK_FACES)
+    {
+        updateSkinFaceNormals(skin, first, min(NORMAL_CHUNK_FACES, mesh->faceCount - first));
+    }
+
+    // the cached lighting and the picking hierarchy were made for the old shape
+    mesh->lightingVersion = 0;
+    freeMeshBVH(mesh);
+
+    skin->appliedVersion = skin->version;
+
+    return 0;
+}
+
+void applyMorphTargets(Skin *skin)
+{
+    int i, j, n = skin->vertexCount;
+    float weight;
+    MorphTarget *morph;
+
+    memcpy(skin->morphX, skin->bindX, sizeof *(skin->morphX) * n);
+    memcpy(skin->morphY, skin->bindY, sizeof *(skin->morphY) * n);
+    memcpy(skin->morphZ, skin->bindZ, sizeof *(skin->morphZ) * n);
+
+    for (i = 0; i < skin->morphCount; i++)
+    {
+        morph = &skin->morphs[i];
+        weight = morph->weight;
+
+        if (weight == 0.0f) continue;
+
+        for (j = 0; j < morph->count; j++)
+        {
+            skin->morphX[morph->indices[j]] += weight * morph->dx[j];
+            skin->morphY[morph->indices[j]] += weight * morph->dy[j];
+            skin->morphZ[morph->indices[j]] += weight * morph->dz[j];
+        }
+    }
+}
+
+void deformSkinVertices(Skin *skin, int first, int count, short morphed)
+{
+    int i, k;
+    float x, y, z, nx, ny, nz, ox, oy, oz, onx, ony, onz, w;
+    float *srcX = morphed ? skin->morphX : skin->bindX;
+    float *srcY = morphed ? skin->morphY : skin->bindY;
+    float *srcZ = morphed ? skin->morphZ : skin->bindZ;
+    unsigned char *bones;
+    float *weights;
+    Matrix4x4 *m;
+    Mesh *mesh = skin->mesh;
+
+    // written straight into the vertices renderMesh projects
+    for (i = first; i < first + count; i++)
+    {
+        x = srcX[i];
+        y = srcY[i];
+        z = srcZ[i];
+        nx = skin->bindNormalX[i];
+        ny = skin->bindNormalY[i];
+        nz = skin->bindNormalZ[i];
+
+        bones = &skin->boneIndices[i * MAX_BONE_WEIGHTS];
+        weights = &skin->boneWeights[i * MAX_BONE_WEIGHTS];
+
+        if (weights[0] <= 0.0f)
+        {
+            mesh->vertices[i] = createVector3(x, y, z);
+            mesh->vertexNormals[i] = createVector3(nx, ny, nz);
+            continue;
+        }
+
+        ox = oy = oz = onx = ony = onz = 0.0f;
+
+        // the bones are affine, so the w component is left out
+        for (k = 0; k < MAX_BONE_WEIGHTS && weights[k] > 0.0f; k++)
+        {
+            m = &skin->palette[bones[k]];
+            w = weights[k];
+
+            ox += w * (x * m->m11 + y * m->m21 + z * m->m31 + m->m41);
+            oy += w * (x * m->m12 + y * m->m22 + z * m->m32 + m->m42);
+            oz += w * (x * m->m13 + y * m->m23 + z * m->m33 + m->m43);
+
+            onx += w * (nx * m->m11 + ny * m->m21 + nz * m->m31);
+            ony += w * (nx * m->m12 + ny * m->m22 + nz * m->m32);
+            onz += w * (nx * m->m13 + ny * m->m23 + nz * m->m33);
+        }
+
+        mesh->vertices[i] = createVector3(ox, oy, oz);
+        mesh->vertexNormals[i] = normalizeVector3(createVector3(onx, ony, onz));
+    }
+}
+
+void updateSkinFaceNormals(Skin *skin, int firstFace, int count)
+{
+    int i;
+    Face *face;
+    Vector3 v0, v1, v2;
+    Mesh *mesh = skin->mesh;
+
+    // every face has a normal of its own since newSkin generated them
+    for (i = firstFace; i < firstFace + count; i++)
+    {
+        face = &mesh->faces[i];
+        v0 = mesh->vertices[face->indices[0]];
+        v1 = mesh->vertices[face->indices[1]];
+        v2 = mesh->vertices[face->indices[2]];
+
+        mesh->normals[face->normal] =
+            normalizeVector3(crossProductVector3(subtractVector3(v1, v0), subtractVector3(v2, v0)));
+    }
+}
+
+void destroySkin(Skin *skin)
+{
+    int i;
+
+    // the mesh keeps the shape of the last update
+    if (!skin) return;
+
+    for (i = 0; i < skin->morphCount; i++)
+    {
+        free(skin->morphs[i].indices);
+        free(skin->morphs[i].dx);
+        free(skin->morphs[i].dy);
+        free(skin->morphs[i].dz);
+    }
+
+    free(skin->morphs);
+    free(skin->morphX);
+    free(skin->morphY);
+    free(skin->morphZ);
+    free(skin->boneIndices);
+    free(skin->boneWeights);
+    free(skin->bindX);
+    free(skin->bindY);
+    free(skin->bindZ);
+    free(skin->bindNormalX);
+    free(skin->bindNormalY);
+    free(skin->bindNormalZ);
+    free(skin);
+}
@@ -20,14 +20,58 @@ typedef struct CameraStruct
 
 typedef struct FaceStruct
 {
-    short indices[3];
-    short normal;
+    int indices[3];
+    int normal;
     int poolIndex;
 }Face;
 
+typedef struct QuantizedVertexStruct
+{
+    unsigned short x; // 0 - 65535 across the mesh bounds on each axis
+    unsigned short y;
+    unsigned short z;
+}QuantizedVertex;
+
+typedef struct BVHNodeStruct
+{
+    Vector3 boundsMin;
+    Vector3 boundsMax;
+    int first; // leaf: first entry in faceIndices, inner node: index of the right child
+    int count; // number of faces in a leaf, 0 for inner nodes
+}BVHNode;
+
+typedef struct BVHStruct
+{
+    int nodeCount;
+    BVHNode *nodes;   // depth first order, the left child follows its parent
+    int *faceIndices; // faces of the leaves, grouped leaf by leaf
+}BVH;
+
+typedef struct BSPNodeStruct
+{
+    Vector3 normal; // splitting plane: dot(normal, point) = d
+    float d;
+    int firstFace;  // faces lying on the plane, as a range of faceIndices
+    int faceCount;
+    int front;      // child node indices, -1 for none
+    int back;
+}BSPNode;
+
+typedef struct BSPStruct
+{
+    int nodeCount;
+    BSPNode *nodes;   // the root is node 0
+    int *faceIndices; // faces of the nodes, grouped node by node
+
+    // scratch space for ordering the faces each frame
+    int *stack;
+    int *drawOrder;
+    int *slots;
+}BSP;
+
 typedef struct MeshStruct
 {
-    char name[256];
+    char *name;
 
     int vertexCount;
     Vector3* vertices;
@@ -38,10 +82,31 @@ typedef struct MeshStruct
 
     int normalCount;
     Vector3* normals;
+    Vector3* vertexNormals; // smooth, angle weighted normals, NULL unless generated
 
     Vector3 position;
     Vector3 rotation;
     Matrix4x4 orientation;
+
+    Rect screenBounds; // pixels covered by the projected vertices on the last render
+    Vector3 objectSpaceCamera; // camera position relative to the mesh on the last render
+
+    BVH *bvh; // for picking, built on first use, NULL until then
+    BSP *bsp; // back to front face order for rigid meshes, NULL unless built
+
+    // compressed storage set up by compressMesh(), which frees vertices and normals
+    QuantizedVertex *quantizedVertices;
+    unsigned int *quantizedNormals; // octahedral encoding, 16 bits per component
+    Vector3 quantizationOrigin;     // minimum corner of the bounds
+    Vector3 quantizationScale;      // size of one quantization step on each axis
+
+    // shading by the lights of lightSet, kept until the lights or the world matrix change
+    float *vertexLighting;        // for meshes with vertex normals, NULL otherwise
+    float *faceLighting;          // the shading each face is drawn with
+    int lightingVertexCount;      // the sizes the arrays were allocated for
+    int lightingFaceCount;
+    unsigned int lightingVersion; // lightSet.version of the cached values, 0 to recompute
+    Matrix4x4 lightingMatrix;     // the world matrix of the cached values
 }Mesh;
 
 typedef struct MeshFileStruct
@@ -64,49 +129,150 @@ typedef struct ScreenStruct
     short height;
 }Screen;
 
+typedef struct MeshInstanceStruct
+{
+    Matrix4x4 world;           // object to world transform
+    unsigned char r;           // color when fully lit
+    unsigned char g;
+    unsigned char b;
+    short lod;                 // INSTANCE_LOD_*, picked by renderInstanceBatch each frame
+    Vector3 *projections;      // screen positions of the mesh's vertices, a part of the batch's array
+    int *slots;                // pool index of each face of the mesh, a part of the batch's array
+    Vector3 objectSpaceCamera; // camera position relative to the instance on the last render
+    Rect screenBounds;         // pixels covered by the projected vertices on the last render
+}MeshInstance;
+
 typedef struct TriangleObjStruct
 {
     Mesh *mesh;
     Face *face;
+    MeshInstance *instance; // NULL unless the face belongs to an instance of a shared mesh
     short drawState;
     float shading;
     float faceDist;
 }TriangleObj;
 
+#define MAX_POOL_MESHES 64
+
+// an instanced triangle keeps its projected vertices and pool index in its
+// instance, the faces of the shared mesh can't hold them for every instance
+#define TRIANGLE_PROJECTIONS(to) ((to)->instance ? (to)->instance->projections : (to)->mesh->vertexProjections)
+#define TRIANGLE_SLOT(to) (*((to)->instance ? &(to)->instance->slots[(to)->face - (to)->mesh->faces] : &(to)->face->poolIndex))
+
+// the color of a triangle at its shading, green unless its instance has a color
+#define SHADE_TRIANGLE(to, shading, R, G, B)                                                    \
+    if ((to)->instance)                                                                         \
+    {                                                                                           \
+        R = floor((to)->instance->r * (shading));                                               \
+        G = floor((to)->instance->g * (shading));                                               \
+        B = floor((to)->instance->b * (shading));                                               \
+    }                                                                                           \
+    else                                                                                        \
+    {                                                                                           \
+        R = B = 0;                                                                              \
+        G = floor(255.0f * (shading));                                                          \
+    }
+
 typedef struct TrianglePoolStruct
 {
     int triCount;
     int maxTriCount;
     TriangleObj *triangles;
+
+    int meshCount;
+    Mesh *meshes[MAX_POOL_MESHES]; // every mesh that has triangles in the pool
 }TrianglePool;
 
 void setCameraFrustum(Camera *camera, Matrix4x4 matrix);
 void setCoefficients(Plane *pl, float a, float b, float c, float d);
 int pointInCameraFrustum(Camera *camera, Vector3 vec);
 Screen createScreen(short width, short height);
-Face createFace(short v1, short v2, short v3);
-Face createFaceWithNormal(short v1, short v2, short v3, short normal);
+Face createFace(int v1, int v2, int v3);
+Face createFaceWithNormal(int v1, int v2, int v3, int normal);
 void drawPointOnScreen(Screen *ptr, Point2D point);
 Mesh *newMesh(char meshName[256], int vertexCount, int faceCount, int normalCount);
 MeshFile getMeshFileInfo(char fileName[256]);
 Mesh *readMeshFromFile(char fileName[256]);
+int parseFaceLine(char line[256], Face *face);
+Mesh *loadMesh(char fileName[256], float weldEpsilon, short normalMode, int *removedVertices);
+int weldMeshVertices(Mesh *mesh, float epsilon);
+int generateMeshNormals(Mesh *mesh, short normalMode);
+void computeFaceNormals(Mesh *mesh, int firstFace, int count);
+int buildVertexCorners(Mesh *mesh, int **offsets, int **corners);
+void gatherVertexNormals(Mesh *mesh, int *offsets, int *corners, int firstVertex, int count);
 int setMeshVertex(Mesh *mesh, int vertexNum, Vector3 vertex);
 int setMeshFace(Mesh *mesh, int faceNum, Face face);
 int setMeshNormal(Mesh *mesh, int normalNum, Vector3 normal);
 void setMeshOrientation(Mesh *mesh, Vector3 orientation);
+int compressMesh(Mesh *mesh);
+Vector3 getMeshVertex(Mesh *mesh, int vertexNum);
+Vector3 getMeshNormal(Mesh *mesh, int normalNum);
+Matrix4x4 getMeshDequantizationMatrix(Mesh *mesh);
+void getMeshBoundingSphere(Mesh *mesh, Vector3 *center, float *radius);
+unsigned int encodeOctahedralNormal(Vector3 normal);
+Vector3 decodeOctahedralNormal(unsigned int encoded);
+Matrix4x4 getMeshWorldMatrix(Mesh *mesh);
+Matrix4x4 getViewProjectionMatrix(Screen *screen, Camera *camera);
 void renderMesh(Screen *screen, Camera *camera, Mesh *mesh);
+void updateMeshOrientation(Mesh *mesh);
+short updateMeshShading(Mesh *mesh, Matrix4x4 worldMatrix, Matrix4x4 inverseWorld);
+void renderMeshView(Screen *screen, Camera *camera, Mesh *mesh, Matrix4x4 viewProjectionMatrix,
+                    Matrix4x4 worldMatrix, Matrix4x4 inverseWorld, short shade);
+int updateMeshLighting(Mesh *mesh, Matrix4x4 worldMatrix, Matrix4x4 inverseWorld);
+void renderMeshFacesPlain(Camera *camera, Mesh *mesh, Matrix4x4 worldMatrix, Vector3 invertedCamera);
+void renderQuantizedMeshFacesPlain(Camera *camera, Mesh *mesh, Matrix4x4 worldMatrix, Vector3 invertedCamera);
+void renderMeshFacesShaded(Camera *camera, Mesh *mesh, Matrix4x4 worldMatrix, Vector3 invertedCamera);
+void renderQuantizedMeshFacesShaded(Camera *camera, Mesh *mesh, Matrix4x4 worldMatrix, Vector3 invertedCamera);
+void renderMeshFacesCulled(Camera *camera, Mesh *mesh, Matrix4x4 worldMatrix, Vector3 invertedCamera);
+void renderQuantizedMeshFacesCulled(Camera *camera, Mesh *mesh, Matrix4x4 worldMatrix, Vector3 invertedCamera);
+void renderMeshFacesCulledShaded(Camera *camera, Mesh *mesh, Matrix4x4 worldMatrix, Vector3 invertedCamera);
+void renderQuantizedMeshFacesCulledShaded(Camera *camera, Mesh *mesh, Matrix4x4 worldMatrix, Vector3 invertedCamera);
+void renderMeshFacesLit(Camera *camera, Mesh *mesh, Matrix4x4 worldMatrix, Vector3 invertedCamera);
+void renderQuantizedMeshFacesLit(Camera *camera, Mesh *mesh, Matrix4x4 worldMatrix, Vector3 invertedCamera);
+void renderMeshFacesCulledLit(Camera *camera, Mesh *mesh, Matrix4x4 worldMatrix, Vector3 invertedCamera);
+void renderQuantizedMeshFacesCulledLit(Camera *camera, Mesh *mesh, Matrix4x4 worldMatrix, Vector3 invertedCamera);
 void fillTriangle(Triangle triangle, float rr, float gg, float bb);
+void rasterizeTriangleToFrameBuffer(Triangle triangle, FrameBuffer *fb, short width, short height,
+                                    unsigned char r, unsigned char g, unsigned char b);
+void rasterizeTriangleToCanvas(Triangle triangle, FrameBuffer *fb, short width, short height,
+                               unsigned char r, unsigned char g, unsigned char b);
+void rasterizeTriangleToVisibility(Triangle triangle, FrameBuffer *fb, short width, short height,
+                                   unsigned char r, unsigned char g, unsigned char b);
+void writeVisibilitySpan(int y, int x1, int x2);
+int triangleCoversPixel(Triangle triangle, int x, int y);
+void rasterizeTriangleCountingOverdraw(Triangle triangle, FrameBuffer *fb, short width, short height,
+                                       unsigned char r, unsigned char g, unsigned char b);
 void destroyMesh(Mesh *mesh);
+void freeMeshBVH(Mesh *mesh);
+void orderMeshFacesByBSP(TrianglePool *tp, Mesh *mesh, Vector3 invertedCamera);
+void freeMeshBSP(Mesh *mesh);
 
 void createPool(TrianglePool *this, int maxTriCount);
 void addMeshFacesToPool(TrianglePool *tp, Mesh *mesh);
 void addTriangleToPool(TrianglePool *tp, Mesh *mesh, Face *face);
+void registerPoolMesh(TrianglePool *tp, Mesh *mesh);
+void removeTriangleFromPool(TrianglePool *tp, int index);
 void setTriangleInPool(TrianglePool *tp, int index, short drawState, float shading, float faceDist);
 void resetTrianglePool(TrianglePool *tp);
+void clearRenderTarget(unsigned char r, unsigned char g, unsigned char b);
+void presentRenderTarget(short x, short y);
 void drawTrianglesFromPool(TrianglePool *tp);
+void drawPoolToFrameBuffer(TrianglePool *tp);
+void drawPoolToFrameBufferPresenting(TrianglePool *tp);
+void drawPoolToCanvas(TrianglePool *tp);
+void drawPoolToCanvasPresenting(TrianglePool *tp);
+void drawPoolToVisibilityBuffer(TrianglePool *tp, VisibilityBuffer *vb);
+void drawPoolCountingOverdraw(TrianglePool *tp);
+void resolveVisibilityBuffer(TrianglePool *tp, VisibilityBuffer *vb, FrameBuffer *fb);
 void sortTrianglePoolInsertion(TrianglePool *tp);
 void freeTrianglePool(TrianglePool *tp);
 
+#define MESH_NORMALS_FROM_FILE 0 // keep the normals of the file, generate only the missing ones
+#define MESH_NORMALS_GENERATE  1 // replace the normals of the file with generated ones
+
+#define NORMAL_CHUNK_FACES    4096
+#define NORMAL_CHUNK_VERTICES 4096
+
 // Written according to the following tutorial:
 // https://www.davrous.com/2013/06/13/
 // tutorial-series-learning-how-to-write-a-3d-soft-engine-from-scratch-in-c-
@@ -129,6 +295,29 @@ Screen screen;
 
 TrianglePool trianglePool;
 
+// when set, triangles are rasterized into this buffer instead of the canvas
+FrameBuffer *renderTarget = NULL;
+
+// completed frames waiting to be presented, stepped while the next frame is being drawn
+PresentQueue *presentQueue = NULL;
+const int PRESENT_STEP_INTERVAL = 64; // triangles drawn between present steps
+
+// screen areas drawn by renderMesh, for clearing and presenting only what changed,
+// empty to begin with and the whole frame once the area passes half of it
+DirtyRegion dirtyRegion = { { 0, 0, -1, -1 }, { 0, 0, -1, -1 }, 0.5f };
+
+// when set together with renderTarget, the pool is drawn in two passes: triangle
+// ids and depth into this buffer first, then the visible pixels are shaded into renderTarget
+VisibilityBuffer *visibilityBuffer = NULL;
+
+// the triangle being written into the visibility buffer, its depth is
+// visibilityDepth.x * x + visibilityDepth.y * y + visibilityDepth.z at a pixel center
+unsigned int visibilityId;
+Vector3 visibilityDepth;
+
+// when set, drawTrianglesFromPool counts the writes to every pixel, for finding overdraw
+OverdrawStats *overdrawStats = NULL;
+
 short mode = 3;
 int inspectFace = 0;
 
@@ -224,7 +413,7 @@ Screen createScreen(short width, short height)
     return screen;
 }
 
-Face createFace(short v1, short v2, short v3)
+Face createFace(int v1, int v2, int v3)
 {
     Face face;
 
@@ -236,7 +425,7 @@ Face createFace(short v1, short v2, short v3)
     return face;
 }
 
-Face createFaceWithNormal(short v1, short v2, short v3, short normal)
+Face createFaceWithNormal(int v1, int v2, int v3, int normal)
 {
     Face face;
 
@@ -300,8 +489,9 @@ Mesh *newMesh(char meshName[256], int vertexCount, int faceCount, int normalCoun
         return NULL;
     }
 
+    // a mesh may come without normals, they are generated after loading
     ptr->normalCount = normalCount;
-    ptr->normals = malloc(sizeof *(ptr->normals) * ptr->normalCount);
+    ptr->normals = malloc(sizeof *(ptr->normals) * (normalCount > 0 ? normalCount : 1));
 
     if (!ptr->normals)
     {
@@ -315,6 +505,30 @@ Mesh *newMesh(char meshName[256], int vertexCount, int faceCount, int normalCoun
     ptr->position = createVector3(0.0f, 0.0f, 0.0f);
     ptr->rotation = createVector3(0.0f, 0.0f, 0.0f);
     ptr->orientation = createTranslationMatrix(0.0f, 0.0f, 0.0f);
+    ptr->screenBounds = createEmptyRect();
+    ptr->objectSpaceCamera = createVector3(0.0f, 0.0f, 0.0f);
+    ptr->vertexNormals = NULL;
+    ptr->bvh = NULL;
+    ptr->bsp = NULL;
+    ptr->quantizedVertices = NULL;
+    ptr->quantizedNormals = NULL;
+    ptr->vertexLighting = NULL;
+    ptr->faceLighting = NULL;
+    ptr->lightingVertexCount = ptr->lightingFaceCount = 0;
+    ptr->lightingVersion = 0;
+
+    // only as long as the name needs, instead of a fixed 256 bytes in every mesh
+    ptr->name = malloc(strlen(meshName) + 1);
+
+    if (!ptr->name)
+    {
+        free(ptr->vertices);
+        free(ptr->vertexProjections);
+        free(ptr->faces);
+        free(ptr->normals);
+        free(ptr);
+        return NULL;
+    }
 
     strcpy(ptr->name, meshName);
 
@@ -406,13 +620,8 @@ Mesh *readMeshFromFile(char fileName[256])
             }
             else if (line[0] == 'f' && line[1] == ' ') // this line is a face
             {
-                if ((read = sscanf(line, "%*s %hd//%*hd %hd//%*hd %hd//%hd",
-                                &face.indices[0], &face.indices[1], &face.indices[2], &face.normal)) == 7)
+                if (parseFaceLine(line, &face))
                 {
-                    face.indices[0]--; // the file uses indices starting from 1, but
-                    face.indices[1]--; //     this program uses indices starting from 0
-                    face.indices[2]--; //     so the indices read from the file have to
-                    face.normal--;     //     be decremented by 1
                     setMeshFace(mesh, faceNum++, face);
                 }
                 else
@@ -436,15 +645,339 @@ Mesh *readMeshFromFile(char fileName[256])
 
     fclose(f);
 
+    // faces without a normal in the file get one generated from their vertices
+    if (generateMeshNormals(mesh, MESH_NORMALS_FROM_FILE) < 0)
+    {
+        destroyMesh(mesh);
+        return NULL;
+    }
+
     return mesh;
 }
 
+int parseFaceLine(char line[256], Face *face)
+{
+    face->normal = 0; // faces without a normal end up with normal -1
+
+    // the face may be given as v//vn, v/vt/vn, v/vt or just v
+    if (sscanf(line, "%*s %d//%*d %d//%*d %d//%d",
+               &face->indices[0], &face->indices[1], &face->indices[2], &face->normal) != 7 &&
+        sscanf(line, "%*s %d/%*d/%*d %d/%*d/%*d %d/%*d/%d",
+               &face->indices[0], &face->indices[1], &face->indices[2], &face->normal) != 10 &&
+        sscanf(line, "%*s %d/%*d %d/%*d %d/%*d",
+               &face->indices[0], &face->indices[1], &face->indices[2]) != 7 &&
+        sscanf(line, "%*s %d %d %d",
+               &face->indices[0], &face->indices[1], &face->indices[2]) != 4)
+        return 0;
+
+    face->indices[0]--; // the file uses indices starting from 1, but
+    face->indices[1]--; //     this program uses indices starting from 0
+    face->indices[2]--; //     so the indices read from the file have to
+    face->normal--;     //     be decremented by 1
+
+    return 1;
+}
+
+Mesh *loadMesh(char fileName[256], float weldEpsilon, short normalMode, int *removedVertices)
+{
+    int removed = 0;
+    Mesh *mesh = readMeshFromFile(fileName);
+
+    if (!mesh) return NULL;
+
+    // welding has to happen before the normals are generated,
+    // so that faces sharing a position also share its smooth normal
+    if (weldEpsilon > 0.0f)
+        removed = weldMeshVertices(mesh, weldEpsilon);
+
+    if (removedVertices)
+        *removedVertices = removed;
+
+    if (generateMeshNormals(mesh, normalMode) < 0)
+    {
+        destroyMesh(mesh);
+        return NULL;
+    }
+
+    return mesh;
+}
+
+int weldMeshVertices(Mesh *mesh, float epsilon)
+{
+    int i, j, k, found, kept = 0, tableSize = 1;
+    int cx, cy, cz, dx, dy, dz, removed;
+    int *heads, *next, *remap;
+    unsigned int hash;
+    Vector3 vec;
+
+    if (!mesh || epsilon <= 0.0f || mesh->vertexCount < 2) return 0;
+
+    while (tableSize < 2 * mesh->vertexCount) tableSize <<= 1;
+
+    heads = malloc(sizeof *heads * tableSize);
+    next = malloc(sizeof *next * mesh->vertexCount);
+    remap = malloc(sizeof *remap * mesh->vertexCount);
+
+    if (!heads || !next || !remap)
+    {
+        free(heads);
+        free(next);
+        free(remap);
+        DEBUG_MSG_FROM("Failed: Couldn't allocate the spatial hash.", "weldMeshVertices");
+        return 0;
+    }
+
+    for (i = 0; i < tableSize; i++) heads[i] = -1;
+
+    // the vertices are hashed on a grid of epsilon sized cells, so a vertex
+    // can only be welded to vertices in its own or the neighbouring cells
+    for (i = 0; i < mesh->vertexCount; i++)
+    {
+        vec = mesh->vertices[i];
+        cx = floor(vec.x / epsilon);
+        cy = floor(vec.y / epsilon);
+        cz = floor(vec.z / epsilon);
+        found = -1;
+
+        for (dx = -1; dx <= 1 && found < 0; dx++)
+            for (dy = -1; dy <= 1 && found < 0; dy++)
+                for (dz = -1; dz <= 1 && found < 0; dz++)
+                {
+                    hash = ((unsigned int)(cx + dx) * 73856093u ^
+                            (unsigned int)(cy + dy) * 19349663u ^
+                            (unsigned int)(cz + dz) * 83492791u) & (tableSize - 1);
+
+                    for (k = heads[hash]; k >= 0; k = next[k])
+                    {
+                        if (magnitudeVector3(subtractVector3(mesh->vertices[k], vec)) <= epsilon)
+                        {
+                            found = k;
+                            break;
+                        }
+                    }
+                }
+
+        if (found >= 0)
+        {
+            remap[i] = found;
+            continue;
+        }
+
+        // kept vertices are compacted to the front of the array as they are found
+        hash = ((unsigned int)cx * 73856093u ^ (unsigned int)cy * 19349663u ^
+                (unsigned int)cz * 83492791u) & (tableSize - 1);
+        mesh->vertices[kept] = vec;
+        next[kept] = heads[hash];
+        heads[hash] = kept;
+        remap[i] = kept++;
+    }
+
+    for (i = 0; i < mesh->faceCount; i++)
+    {
+        for (j = 0; j < 3; j++)
+        {
+            mesh->faces[i].indices[j] = remap[mesh->faces[i].indices[j]];
+        }
+    }
+
+    removed = mesh->vertexCount - kept;
+    mesh->vertexCount = kept;
+    mesh->lightingVersion = 0;
+
+    free(heads);
+    free(next);
+    free(remap);
+
+    return removed;
+}
+
+int generateMeshNormals(Mesh *mesh, short normalMode)
+{
+    int i, first, missing = 0, *offsets = NULL, *corners = NULL;
+    Vector3 *normals;
+
+    if (!mesh) return -1;
+
+    for (i = 0; i < mesh->faceCount; i++)
+    {
+        if (normalMode == MESH_NORMALS_GENERATE || mesh->faces[i].normal < 0)
+            missing++;
+    }
+
+    if (missing)
+    {
+        if (normalMode == MESH_NORMALS_GENERATE)
+            mesh->normalCount = 0;
+
+        if (!(normals = realloc(mesh->normals, sizeof *normals * (mesh->normalCount + missing))))
+        {
+            DEBUG_MSG_FROM("Failed: Couldn't allocate the normals.", "generateMeshNormals");
+            return -1;
+        }
+
+        mesh->normals = normals;
+        first = mesh->normalCount;
+
+        for (i = 0; i < mesh->faceCount; i++)
+        {
+            if (normalMode == MESH_NORMALS_GENERATE || mesh->faces[i].normal < 0)
+                mesh->faces[i].normal = -1 - mesh->normalCount++; // marks the face as generated
+        }
+    }
+
+    // the smooth vertex normals are only built when the mesh is asked for generated normals
+    if (normalMode == MESH_NORMALS_GENERATE)
+    {
+        free(mesh->vertexNormals);
+        mesh->vertexNormals = malloc(sizeof *(mesh->vertexNormals) * mesh->vertexCount);
+
+        if (!mesh->vertexNormals || buildVertexCorners(mesh, &offsets, &corners))
+        {
+            DEBUG_MSG_FROM("Failed: Couldn't allocate the vertex normals.", "generateMeshNormals");
+            return -1;
+        }
+    }
+
+    // every face chunk writes only the normals of its own faces,
+    // so the chunks don't depend on each other
+    for (first = 0; first < mesh->faceCount; first += NORMAL_CHUNK_FACES)
+    {
+        computeFaceNormals(mesh, first, min(NORMAL_CHUNK_FACES, mesh->faceCount - first));
+    }
+
+    // and every vertex chunk only its own vertices, reading the faces around them
+    if (corners)
+    {
+        for (first = 0; first < mesh->vertexCount; first += NORMAL_CHUNK_VERTICES)
+        {
+            gatherVertexNormals(mesh, offsets, corners, first, min(NORMAL_CHUNK_VERTICES, mesh->vertexCount - first));
+        }
+
+        free(offsets);
+        free(corners);
+    }
+
+    mesh->lightingVersion = 0;
+
+    return missing;
+}
+
+void computeFaceNormals(Mesh *mesh, int firstFace, int count)
+{
+    int i;
+    Face *face;
+    Vector3 v0, v1, v2;
+
+    for (i = firstFace; i < firstFace + count; i++)
+    {
+        face = &mesh->faces[i];
+
+        if (face->normal >= 0) continue; // the normal came from the file
+
+        v0 = mesh->vertices[face->indices[0]];
+        v1 = mesh->vertices[face->indices[1]];
+        v2 = mesh->vertices[face->indices[2]];
+
+        face->normal = -1 - face->normal;
+        mesh->normals[face->normal] =
+            normalizeVector3(crossProductVector3(subtractVector3(v1, v0), subtractVector3(v2, v0)));
+    }
+}
+
+int buildVertexCorners(Mesh *mesh, int **offsets, int **corners)
+{
+    int i, j, v, *start, *list;
+
+    start = malloc(sizeof *start * (mesh->vertexCount + 1));
+    list = malloc(sizeof *list * (3 * mesh->faceCount + 1));
+
+    if (!start || !list)
+    {
+        free(start);
+        free(list);
+        return -1;
+    }
+
+    // the corners of vertex v are list[start[v]] to list[start[v + 1] - 1], each given
+    // as 3 * face + corner; they are counted first and then listed in face order
+    for (v = 0; v <= mesh->vertexCount; v++)
+    {
+        start[v] = 0;
+    }
+
+    for (i = 0; i < mesh->faceCount; i++)
+    {
+        for (j = 0; j < 3; j++)
+        {
+            start[mesh->faces[i].indices[j] + 1]++;
+        }
+    }
+
+    for (v = 0; v < mesh->vertexCount; v++)
+    {
+        start[v + 1] += start[v];
+    }
+
+    for (i = 0; i < mesh->faceCount; i++)
+    {
+        for (j = 0; j < 3; j++)
+        {
+            list[start[mesh->faces[i].indices[j]]++] = 3 * i + j;
+        }
+    }
+
+    // listing moved every start to where the next vertex's starts
+    for (v = mesh->vertexCount; v > 0; v--)
+    {
+        start[v] = start[v - 1];
+    }
+
+    start[0] = 0;
+
+    *offsets = start;
+    *corners = list;
+
+    return 0;
+}
+
+void gatherVertexNormals(Mesh *mesh, int *offsets, int *corners, int firstVertex, int count)
+{
+    int i, j, k;
+    float angle;
+    Face *face;
+    Vector3 sum, corner, edge1, edge2;
+
+    // every face adds its normal to its vertices, weighted by the angle of the face at
+    // the vertex, so that the result doesn't depend on how the surface is triangulated
+    for (i = firstVertex; i < firstVertex + count; i++)
+    {
+        sum = createVector3(0.0f, 0.0f, 0.0f);
+
+        for (k = offsets[i]; k < offsets[i + 1]; k++)
+        {
+            face = &mesh->faces[corners[k] / 3];
+            j = corners[k] % 3;
+
+            corner = mesh->vertices[face->indices[j]];
+            edge1 = normalizeVector3(subtractVector3(mesh->vertices[face->indices[(j + 1) % 3]], corner));
+            edge2 = normalizeVector3(subtractVector3(mesh->vertices[face->indices[(j + 2) % 3]], corner));
+            angle = acos(max(-1.0f, min(1.0f, dotProductVector3(edge1, edge2))));
+
+            sum = addVector3(sum, scaleVector3(mesh->normals[face->normal], angle));
+        }
+
+        mesh->vertexNormals[i] = normalizeVector3(sum);
+    }
+}
+
 int setMeshVertex(Mesh *mesh, int vertexNum, Vector3 vertex)
 {
     if (!mesh) return -1;
     if (vertexNum < 0 || vertexNum >= mesh->vertexCount) return -2;
+    if (!mesh->vertices) return -3; // compressed meshes are read-only
 
     mesh->vertices[vertexNum] = vertex;
+    mesh->lightingVersion = 0;
 
     return 0;
 }
@@ -463,8 +996,11 @@ int setMeshNormal(Mesh *mesh, int normalNum, Vector3 normal)
 {
     if (!mesh) return -1;
     if (normalNum < 0 || normalNum >= mesh->normalCount) return -2;
+    if (!mesh->normals) return -3;
 
-    mesh->normals[normalNum] = normal;
+    // normalized once here, so that shading doesn't need the magnitude of every normal
+    mesh->normals[normalNum] = normalizeVector3(normal);
+    mesh->lightingVersion = 0;
 
     return 0;
 }
@@ -474,259 +1010,714 @@ void setMeshOrientation(Mesh *mesh, Vector3 orientation)
     mesh->orientation = createRotationXYZMatrix(orientation.x, orientation.y, orientation.z);
 }
 
-void renderMesh(Screen *screen, Camera *camera, Mesh *mesh)
+int compressMesh(Mesh *mesh)
+{
+    int i;
+    Vector3 boundsMin, boundsMax, size, vec;
+
+    if (!mesh) return -1;
+    if (!mesh->vertices || !mesh->normals || mesh->vertexCount <= 0) return -2; // already compressed
+
+    mesh->quantizedVertices = malloc(sizeof *(mesh->quantizedVertices) * mesh->vertexCount);
+    mesh->quantizedNormals = malloc(sizeof *(mesh->quantizedNormals) * (mesh->normalCount > 0 ? mesh->normalCount : 1));
+
+    if (!mesh->quantizedVertices || !mesh->quantizedNormals)
+    {
+        free(mesh->quantizedVertices);
+        free(mesh->quantizedNormals);
+        mesh->quantizedVertices = NULL;
+        mesh->quantizedNormals = NULL;
+        DEBUG_MSG_FROM("Failed: Couldn't allocate memory for the compressed mesh.", "compressMesh");
+        return -3;
+    }
+
+    boundsMin = boundsMax = mesh->vertices[0];
+
+    for (i = 1; i < mesh->vertexCount; i++)
+    {
+        boundsMin = minVector3(boundsMin, mesh->vertices[i]);
+        boundsMax = maxVector3(boundsMax, mesh->vertices[i]);
+    }
+
+    size = subtractVector3(boundsMax, boundsMin);
+    mesh->quantizationOrigin = boundsMin;
+    mesh->quantizationScale = scaleVector3(size, 1.0f / 65535.0f);
+
+    // a flat axis has a size of 0, all of its vertices quantize to 0
+    for (i = 0; i < mesh->vertexCount; i++)
+    {
+        vec = subtractVector3(mesh->vertices[i], boundsMin);
+        mesh->quantizedVertices[i].x = (size.x > 0.0f) ? (unsigned short)(vec.x / size.x * 65535.0f + 0.5f) : 0;
+        mesh->quantizedVertices[i].y = (size.y > 0.0f) ? (unsigned short)(vec.y / size.y * 65535.0f + 0.5f) : 0;
+        mesh->quantizedVertices[i].z = (size.z > 0.0f) ? (unsigned short)(vec.z / size.z * 65535.0f + 0.5f) : 0;
+    }
+
+    for (i = 0; i < mesh->normalCount; i++)
+    {
+        mesh->quantizedNormals[i] = encodeOctahedralNormal(mesh->normals[i]);
+    }
+
+    free(mesh->vertices);
+    free(mesh->normals);
+    mesh->vertices = NULL;
+    mesh->normals = NULL;
+
+    // the BVH was built from the exact positions
+    freeMeshBVH(mesh);
+    mesh->lightingVersion = 0;
+
+    return 0;
+}
+
+Vector3 getMeshVertex(Mesh *mesh, int vertexNum)
+{
+    QuantizedVertex q;
+
+    if (mesh->vertices) return mesh->vertices[vertexNum];
+
+    q = mesh->quantizedVertices[vertexNum];
+
+    return createVector3(mesh->quantizationOrigin.x + q.x * mesh->quantizationScale.x,
+                         mesh->quantizationOrigin.y + q.y * mesh->quantizationScale.y,
+                         mesh->quantizationOrigin.z + q.z * mesh->quantizationScale.z);
+}
+
+Vector3 getMeshNormal(Mesh *mesh, int normalNum)
+{
+    if (mesh->normals) return mesh->normals[normalNum];
+
+    return decodeOctahedralNormal(mesh->quantizedNormals[normalNum]);
+}
+
+Matrix4x4 getMeshDequantizationMatrix(Mesh *mesh)
+{
+    // maps the 0 - 65535 quantized coordinates back to the object space
+    return createScaleTranslationMatrix(mesh->quantizationScale, mesh->quantizationOrigin);
+}
+
+unsigned int encodeOctahedralNormal(Vector3 normal)
+{
+    float x, y, sum = abs(normal.x) + abs(normal.y) + abs(normal.z);
+
+    if (sum <= 0.0f) return (32767 << 16) | 32767; // no direction, decodes to +z
+
+    // project onto the octahedron |x| + |y| + |z| = 1, and fold
+    // the lower half over the upper one to get a square
+    x = normal.x / sum;
+    y = normal.y / sum;
+
+    if (normal.z < 0.0f)
+    {
+        sum = x;
+        x = (1.0f - abs(y)) * ((x >= 0.0f) ? 1.0f : -1.0f);
+        y = (1.0f - abs(sum)) * ((y >= 0.0f) ? 1.0f : -1.0f);
+    }
+
+    return ((unsigned int)(x * 32767.0f + 32767.5f) << 16) | (unsigned int)(y * 32767.0f + 32767.5f);
+}
+
+Vector3 decodeOctahedralNormal(unsigned int encoded)
+{
+    float x = (int)(encoded >> 16) / 32767.0f - 1.0f;
+    float y = (int)(encoded & 0xFFFF) / 32767.0f - 1.0f;
+    float z = 1.0f - abs(x) - abs(y);
+    float temp;
+
+    if (z < 0.0f)
+    {
+        temp = x;
+        x = (1.0f - abs(y)) * ((x >= 0.0f) ? 1.0f : -1.0f);
+        y = (1.0f - abs(temp)) * ((y >= 0.0f) ? 1.0f : -1.0f);
+    }
+
+    return normalizeVector3(createVector3(x, y, z));
+}
+
+void getMeshBoundingSphere(Mesh *mesh, Vector3 *center, float *radius)
+{
+    int i;
+    Vector3 boundsMin, boundsMax, vertex;
+
+    boundsMin = boundsMax = getMeshVertex(mesh, 0);
+
+    for (i = 1; i < mesh->vertexCount; i++)
+    {
+        vertex = getMeshVertex(mesh, i);
+        boundsMin = minVector3(boundsMin, vertex);
+        boundsMax = maxVector3(boundsMax, vertex);
+    }
+
+    // centered on the bounding box, not the smallest sphere but close enough for culling
+    *center = lerpVector3(boundsMin, boundsMax, 0.5f);
+    *radius = 0.0f;
+
+    for (i = 0; i < mesh->vertexCount; i++)
+    {
+        *radius = max(*radius, magnitudeVector3(subtractVector3(getMeshVertex(mesh, i), *center)));
+    }
+}
+
+Matrix4x4 getMeshWorldMatrix(Mesh *mesh)
+{
+    return multiplyMatrices(mesh->orientation,
+        createTranslationMatrix(mesh->position.x, mesh->position.y, mesh->position.z));
+}
+
+Matrix4x4 getViewProjectionMatrix(Screen *screen, Camera *camera)
 {
-    int i, j;
-    Triangle tris;
-    float shading;
     Matrix4x4 viewMatrix = createLookAtMatrix(camera->position, camera->target, createVector3(0.0f, 1.0f, 0.0f));
     Matrix4x4 projectionMatrix =
         createPerspectiveMatrix(PI/3.0f, screen->width / (float)screen->height, 0.1f, 100.0f);
 
-    Matrix4x4 worldMatrix, tempMatrix, transformMatrix;
-    Vector3 invertedCamera, projectedVertex;
+    return multiplyMatrices(viewMatrix, projectionMatrix);
+}
+
+void renderMesh(Screen *screen, Camera *camera, Mesh *mesh)
+{
+    Matrix4x4 worldMatrix, inverseWorld;
+
+    updateMeshOrientation(mesh);
+
+    worldMatrix = getMeshWorldMatrix(mesh);
+    inverseWorld = Invert(worldMatrix);
+
+    renderMeshView(screen, camera, mesh, getViewProjectionMatrix(screen, camera), worldMatrix, inverseWorld,
+                   updateMeshShading(mesh, worldMatrix, inverseWorld));
+}
 
+void updateMeshOrientation(Mesh *mesh)
+{
     // perform rotation one by one for each axis
     // https://gamedev.stackexchange.com/questions/67199/how-to-rotate-an-object-around-world-aligned-axes/67269#67269
     mesh->orientation = multiplyMatrices(mesh->orientation, createRotationXYZMatrix(mesh->rotation.x, 0.0f, 0.0f));
     mesh->orientation = multiplyMatrices(mesh->orientation, createRotationXYZMatrix(0.0f, mesh->rotation.y, 0.0f));
     mesh->orientation = multiplyMatrices(mesh->orientation, createRotationXYZMatrix(0.0f, 0.0f, mesh->rotation.z));
     mesh->rotation = createVector3(0.0f, 0.0f, 0.0f);
+}
+
+short updateMeshShading(Mesh *mesh, Matrix4x4 worldMatrix, Matrix4x4 inverseWorld)
+{
+    // with lights the faces are shaded from the mesh's cached lighting, which
+    // the visibility buffer also reads, without lights by a light at the camera;
+    // every mode fills the faces, the mode only matters to the key handling
+    return (lightSet.count && !updateMeshLighting(mesh, worldMatrix, inverseWorld)) ? 2 : 1;
+}
 
-    worldMatrix =
-        multiplyMatrices(mesh->orientation,
-            createTranslationMatrix(mesh->position.x, mesh->position.y, mesh->position.z));
+// The part of renderMesh that depends on the view. The camera's position is
+// the point the faces are culled, shaded and sorted from, the projection
+// comes from viewProjectionMatrix. shade is what updateMeshShading returned.
+void renderMeshView(Screen *screen, Camera *camera, Mesh *mesh, Matrix4x4 viewProjectionMatrix,
+                    Matrix4x4 worldMatrix, Matrix4x4 inverseWorld, short shade)
+{
+    int i;
+    Matrix4x4 transformMatrix, vertexMatrix;
+    Vector3 invertedCamera, projectedVertex, vertex;
+    QuantizedVertex *quantized = mesh->quantizedVertices;
+    TriangleObj *triangle;
+    float minX, minY, maxX, maxY, previousDist = 0.0f;
+    int clipped = 0, drawn = 0;
 
-    tempMatrix = multiplyMatrices(worldMatrix, viewMatrix);
-    transformMatrix = multiplyMatrices(tempMatrix, projectionMatrix);
+    transformMatrix = multiplyMatrices(worldMatrix, viewProjectionMatrix);
 
-    invertedCamera = transformVector3ByMatrix(camera->position, Invert(worldMatrix));
+    invertedCamera = transformVector3ByMatrix(camera->position, inverseWorld);
+    mesh->objectSpaceCamera = invertedCamera;
 
     setCameraFrustum(camera, transformMatrix);
 
+    // compressed positions are projected as they are, with the
+    // dequantization scale and offset folded into the matrix
+    vertexMatrix = quantized ? multiplyMatrices(getMeshDequantizationMatrix(mesh), transformMatrix) : transformMatrix;
+
+    minX = minY = 1000000.0f;
+    maxX = maxY = -1000000.0f;
+
+    // pre-optimized version called project() once for every vertex
+    // of every face, amounting to total    2904 times
+    // for the suzanne.obj model that has    507 vertices
+
+    // optimized version calls project() only once for each vertex
+    // of the mesh, amounting to total       507 times, logically
+
+    // one call of project() amounts to       20 multiplications/divisions,
+    // which means that every frame        58080 multiplications/divisions took place
+    // instead of the minimum required     10140
+
     // reset the array of projections
     for (i = 0; i < mesh->vertexCount; i++)
     {
-        mesh->vertexProjections[i] = project(screen->width, screen->height, mesh->vertices[i], transformMatrix, &projectedVertex);
+        vertex = quantized ? createVector3(quantized[i].x, quantized[i].y, quantized[i].z) : mesh->vertices[i];
+        mesh->vertexProjections[i] = project(screen->width, screen->height, vertex, vertexMatrix, &projectedVertex);
+
+        // vertices outside of the depth range wrap around, so their
+        // screen position says nothing about what will be drawn
+        if (projectedVertex.z < 0.0f || projectedVertex.z > 1.0f)
+            clipped = 1;
+
+        minX = min(minX, mesh->vertexProjections[i].x);
+        minY = min(minY, mesh->vertexProjections[i].y);
+        maxX = max(maxX, mesh->vertexProjections[i].x);
+        maxY = max(maxY, mesh->vertexProjections[i].y);
     }
 
-    for (i = 0; i < mesh->faceCount; i ++)
-    {
-        if (flags & BACKFACE_CULLING &&
-                dotProductVector3(
-                    subtractVector3(mesh->vertices[mesh->faces[i].indices[0]], invertedCamera), mesh->normals[mesh->faces[i].normal]) >= 0.0f)
-        {
-            /*setTriangleInPool(&trianglePool, mesh->faces[i].poolIndex, 0, trianglePool.triangles[mesh->faces[i].poolIndex].shading,
-                trianglePool.triangles[mesh->faces[i].poolIndex].faceDist);*/
-            trianglePool.triangles[mesh->faces[i].poolIndex].drawState = 0;
-            continue;
-        }
+    // pad by a couple of pixels to cover the wireframe and vertex pens
+    if (clipped)
+        mesh->screenBounds = createRect(0, 0, screen->width - 1, screen->height - 1);
+    else
+        mesh->screenBounds = clipRect(createRect(floor(minX) - 2, floor(minY) - 2, ceil(maxX) + 2, ceil(maxY) + 2),
+                                      screen->width, screen->height);
 
-        // pre-optimized version called project() once for every vertex
-        // of every face, amounting to total    2904 times
-        // for the suzanne.obj model that has    507 vertices
+    markDirtyRect(&dirtyRegion, mesh->screenBounds);
 
-        // optimized version calls project() only once for each vertex
-        // of the mesh, amounting to total       507 times, logically
+    // the culling and shading settings don't change during the frame, so
+    // the face loop variant is picked once instead of tested for every face,
+    // with a visibility buffer the shading is left for the visible pixels,
+    // unless the overdraw diagnostics draw the pool the painter's way instead
+    if (visibilityBuffer && renderTarget && !overdrawStats) shade = 0;
 
-        // one call of project() amounts to       20 multiplications/divisions,
-        // which means that every frame        58080 multiplications/divisions took place
-        // instead of the minimum required     10140
-        /*for (j = 0; j < 3; j ++)
-        {
-            if (mesh->vertexProjections[mesh->faces[i].indices[j]].x <= 0.0f)
-            {*/
-                //if (sign(projectedVertex.y) != sign(mesh->vertices[mesh->faces[i].indices[j]].y))
-                    /*if (projectedVertex.x < -0.5 || projectedVertex.x > 0.5 ||
-                        projectedVertex.y < -0.5 || projectedVertex.y > 0.5)*/
-                //if (projectedVertex.z < 0.01f)
-                //if (!pointInCameraFrustum(camera, projectedVertex)/* || projectedVertex.x < -0.5 || projectedVertex.x > 0.5 || projectedVertex.y < -0.5 || projectedVertex.y > 0.5*/)
-                /*{
-                    trianglePool.triangles[mesh->faces[i].poolIndex].drawState = 0;
-                    goto SKIP;
-                }
-            }
-        }*/
+    if (mesh->bsp)
+        orderMeshFacesByBSP(&trianglePool, mesh, invertedCamera);
+
+    switch ((quantized ? 6 : 0) + ((flags & BACKFACE_CULLING) ? 3 : 0) + shade)
+    {
+        case 0: renderMeshFacesPlain(camera, mesh, worldMatrix, invertedCamera); break;
+        case 1: renderMeshFacesShaded(camera, mesh, worldMatrix, invertedCamera); break;
+        case 2: renderMeshFacesLit(camera, mesh, worldMatrix, invertedCamera); break;
+        case 3: renderMeshFacesCulled(camera, mesh, worldMatrix, invertedCamera); break;
+        case 4: renderMeshFacesCulledShaded(camera, mesh, worldMatrix, invertedCamera); break;
+        case 5: renderMeshFacesCulledLit(camera, mesh, worldMatrix, invertedCamera); break;
+        case 6: renderQuantizedMeshFacesPlain(camera, mesh, worldMatrix, invertedCamera); break;
+        case 7: renderQuantizedMeshFacesShaded(camera, mesh, worldMatrix, invertedCamera); break;
+        case 8: renderQuantizedMeshFacesLit(camera, mesh, worldMatrix, invertedCamera); break;
+        case 9: renderQuantizedMeshFacesCulled(camera, mesh, worldMatrix, invertedCamera); break;
+        case 10: renderQuantizedMeshFacesCulledShaded(camera, mesh, worldMatrix, invertedCamera); break;
+        case 11: renderQuantizedMeshFacesCulledLit(camera, mesh, worldMatrix, invertedCamera); break;
+    }
 
+    // the BSP order is exact within the mesh: each face keeps its distance, raised to the
+    // previous drawn face's where needed, so the sort still places the mesh among the
+    // others by distance and the ties keep the BSP order (the insertion sort is stable)
+    if (mesh->bsp && mesh->bsp->slots[0] >= 0)
+    {
+        for (i = 0; i < mesh->faceCount; i++)
         {
-            Vector3 vec1;
-            Vector3 vec2 = createVector3(0.0f, 0.0f, 1.0f);
+            triangle = &trianglePool.triangles[mesh->bsp->slots[i]];
 
-            vec1 = mesh->normals[mesh->faces[i].normal];
-            // vec2 = transformVector3ByMatrix(createVector3(10*sin(frame/80.0), 10, 10*cos(frame/80.0)), Invert(worldMatrix));
-            vec2 = transformVector3ByMatrix(createVector3(camera->position.x, camera->position.y, camera->position.z), Invert(worldMatrix));
+            if (!triangle->drawState) continue;
 
-            shading = max(0.0f, dotProductVector3(vec1, vec2) / (magnitudeVector3(vec1) * magnitudeVector3(vec2)));
+            if (drawn && triangle->faceDist < previousDist) triangle->faceDist = previousDist;
 
-            setTriangleInPool(&trianglePool, mesh->faces[i].poolIndex, 1, shading, dotProductVector3(
-                transformVector3ByMatrix(mesh->vertices[mesh->faces[i].indices[0]], worldMatrix), camera->position));
+            previousDist = triangle->faceDist;
+            drawn = 1;
         }
-        /*tris.p1 = mesh->vertexProjections[mesh->faces[i].indices[0]];
-        tris.p2 = mesh->vertexProjections[mesh->faces[i].indices[1]];
-        tris.p3 = mesh->vertexProjections[mesh->faces[i].indices[2]];
+    }
+}
+
+int updateMeshLighting(Mesh *mesh, Matrix4x4 worldMatrix, Matrix4x4 inverseWorld)
+{
+    int i, vertexCount = mesh->vertexNormals ? mesh->vertexCount : 0;
+    float *lighting;
+    Light objectLights[MAX_LIGHTS];
+    Face *face;
 
-        fillTriangle(tris, 0, 255 * shading, 0);
+    // a mesh that didn't move under lights that didn't change keeps its lighting,
+    // so the lights cost nothing per frame until one of them changes
+    if (mesh->lightingVersion == lightSet.version && mesh->lightingFaceCount == mesh->faceCount &&
+        mesh->lightingVertexCount == vertexCount &&
+        !memcmp(&mesh->lightingMatrix, &worldMatrix, sizeof worldMatrix))
+        return 0;
 
-        // if mode is 1 or 2, draw the lines between the vertices
-        if (mode && mode < 3)
+    if (mesh->lightingFaceCount != mesh->faceCount)
+    {
+        if (!(lighting = realloc(mesh->faceLighting, sizeof *lighting * (mesh->faceCount > 0 ? mesh->faceCount : 1))))
         {
-            setpen(255, 255, 255, 0, 1);
-            moveto(vertices[0].x, vertices[0].y);
-            lineto(vertices[1].x, vertices[1].y);
-            lineto(vertices[2].x, vertices[2].y);
-            lineto(vertices[0].x, vertices[0].y);
+            DEBUG_MSG_FROM("Failed: Couldn't allocate the face lighting.", "updateMeshLighting");
+            return -1;
         }
 
-        // if mode is 0 or 1, draw the vertices as pink dots
-        if (mode <= 1)
+        mesh->faceLighting = lighting;
+        mesh->lightingFaceCount = mesh->faceCount;
+    }
+
+    if (mesh->lightingVertexCount != vertexCount)
+    {
+        if (!(lighting = realloc(mesh->vertexLighting, sizeof *lighting * (vertexCount > 0 ? vertexCount : 1))))
         {
-            setpen(255, 0, 255, 0, 3);
-            drawPointOnScreen(screen, vertices[0]);
-            drawPointOnScreen(screen, vertices[1]);
-            drawPointOnScreen(screen, vertices[2]);
+            DEBUG_MSG_FROM("Failed: Couldn't allocate the vertex lighting.", "updateMeshLighting");
+            return -1;
         }
-        */
 
+        mesh->vertexLighting = lighting;
+        mesh->lightingVertexCount = vertexCount;
+    }
 
-        /*setpen(255 * shading, 0, 255 * shading, 0, 5);
-        moveto(vertices[0].x, vertices[0].y);
-        lineto(vertices[1].x, vertices[1].y);
-        lineto(vertices[2].x, vertices[2].y);
-        lineto(vertices[0].x, vertices[0].y);*/
+    transformLights(inverseWorld, getMatrixMaxScale(worldMatrix), objectLights);
 
-        /*if (i == inspectFace)
+    if (vertexCount)
+    {
+        // smooth meshes are lit at their vertices, and a face is
+        // filled with the mean of its vertices' lighting
+        for (i = 0; i < vertexCount; i++)
         {
-            setpen(0, 255, 255, 0, 3);
-            moveto(vertices[0].x, vertices[0].y);
-            lineto(vertices[1].x, vertices[1].y);
-            lineto(vertices[2].x, vertices[2].y);
-            lineto(vertices[0].x, vertices[0].y);
-        }*/
+            mesh->vertexLighting[i] = shadeWithLights(getMeshVertex(mesh, i), mesh->vertexNormals[i], objectLights);
+        }
 
-        //SKIP:
+        for (i = 0; i < mesh->faceCount; i++)
+        {
+            face = &mesh->faces[i];
+            mesh->faceLighting[i] = (mesh->vertexLighting[face->indices[0]] + mesh->vertexLighting[face->indices[1]] +
+                                     mesh->vertexLighting[face->indices[2]]) / 3.0f;
+        }
     }
+    else
+    {
+        // flat meshes are lit at the center of each face
+        for (i = 0; i < mesh->faceCount; i++)
+        {
+            face = &mesh->faces[i];
+            mesh->faceLighting[i] = shadeWithLights(
+                scaleVector3(addVector3(getMeshVertex(mesh, face->indices[0]),
+                             addVector3(getMeshVertex(mesh, face->indices[1]), getMeshVertex(mesh, face->indices[2]))), 1.0f / 3.0f),
+                getMeshNormal(mesh, face->normal), objectLights);
+        }
+    }
+
+    mesh->lightingVersion = lightSet.version;
+    mesh->lightingMatrix = worldMatrix;
+
+    return 0;
 }
 
-void fillTriangle(Triangle triangle, float rr, float gg, float bb)
-{
-    float h, x, y, ang, size, sideLength;
-    float a, b, c, a2, b2, c2, ang1, ang2, ang3;
-    const float triangleSize = 150.0f;
+// Generates a face loop variant for renderMesh. CULL and SHADE are
+// constants, so each variant is compiled without the branches it doesn't
+// need. SHADE 0 leaves the shading to the visibility buffer, 1 lights
+// the faces from the camera, 2 takes the cached lighting.
+// VERTEX and NORMAL fetch the object space vertex and normal of an index.
+// The distance the pool is sorted by is the dot product of the face's first
+// vertex in world space and the camera position, worked out from the object
+// space vertex with a vector made once per call, as in INSTANCE_FACE_LOOP.
+#define MESH_FACE_LOOP(NAME, CULL, SHADE, VERTEX, NORMAL)                                      \
+void NAME(Camera *camera, Mesh *mesh, Matrix4x4 worldMatrix, Vector3 invertedCamera)            \
+{                                                                                               \
+    int i;                                                                                      \
+    float shading = 0.0f, cameraMagnitude = magnitudeVector3(invertedCamera), distOffset;       \
+    Face *face;                                                                                 \
+    Vector3 normal, vertex, distAxis, eye = camera->position;                                   \
+    Matrix4x4 m = worldMatrix;                                                                  \
+                                                                                                \
+    distAxis = createVector3(m.m11 * eye.x + m.m12 * eye.y + m.m13 * eye.z,                     \
+                             m.m21 * eye.x + m.m22 * eye.y + m.m23 * eye.z,                     \
+                             m.m31 * eye.x + m.m32 * eye.y + m.m33 * eye.z);                    \
+    distOffset = m.m41 * eye.x + m.m42 * eye.y + m.m43 * eye.z;                                 \
+                                                                                                \
+    for (i = 0; i < mesh->faceCount; i++)                                                       \
+    {                                                                                           \
+        face = &mesh->faces[i];                                                                 \
+        normal = NORMAL(mesh, face->normal);                                                    \
+        vertex = VERTEX(mesh, face->indices[0]);                                                \
+                                                                                                \
+        if (CULL && dotProductVector3(subtractVector3(vertex, invertedCamera), normal) >= 0.0f) \
+        {                                                                                       \
+            trianglePool.triangles[face->poolIndex].drawState = 0;                              \
+            continue;                                                                           \
+        }                                                                                       \
+                                                                                                \
+        if (SHADE == 1) /* the normals are normalized when they are set */                      \
+            shading = max(0.0f, dotProductVector3(normal, invertedCamera) / cameraMagnitude);   \
+        else if (SHADE == 2)                                                                    \
+            shading = mesh->faceLighting[i];                                                    \
+                                                                                                \
+        setTriangleInPool(&trianglePool, face->poolIndex, 1, shading,                           \
+                          dotProductVector3(vertex, distAxis) + distOffset);                    \
+    }                                                                                           \
+}
+
+#define FLOAT_VERTEX(mesh, index) ((mesh)->vertices[index])
+#define FLOAT_NORMAL(mesh, index) ((mesh)->normals[index])
 
-    Triangle tri2;
+MESH_FACE_LOOP(renderMeshFacesPlain, 0, 0, FLOAT_VERTEX, FLOAT_NORMAL)
+MESH_FACE_LOOP(renderMeshFacesShaded, 0, 1, FLOAT_VERTEX, FLOAT_NORMAL)
+MESH_FACE_LOOP(renderMeshFacesCulled, 1, 0, FLOAT_VERTEX, FLOAT_NORMAL)
+MESH_FACE_LOOP(renderMeshFacesCulledShaded, 1, 1, FLOAT_VERTEX, FLOAT_NORMAL)
+MESH_FACE_LOOP(renderMeshFacesLit, 0, 2, FLOAT_VERTEX, FLOAT_NORMAL)
+MESH_FACE_LOOP(renderMeshFacesCulledLit, 1, 2, FLOAT_VERTEX, FLOAT_NORMAL)
 
-    Vector3 vec = crossProductVector3(
-        subtractVector3(createVector3(triangle.p2.x, triangle.p2.y, 0),
-                        createVector3(triangle.p1.x, triangle.p1.y, 0)),
-        subtractVector3(createVector3(triangle.p3.x, triangle.p3.y, 0),
-                        createVector3(triangle.p1.x, triangle.p1.y, 0)));
-    if (vec.z > 0.0f)
+// compressed meshes decode the vertices and normals as the faces need them
+MESH_FACE_LOOP(renderQuantizedMeshFacesPlain, 0, 0, getMeshVertex, getMeshNormal)
+MESH_FACE_LOOP(renderQuantizedMeshFacesShaded, 0, 1, getMeshVertex, getMeshNormal)
+MESH_FACE_LOOP(renderQuantizedMeshFacesCulled, 1, 0, getMeshVertex, getMeshNormal)
+MESH_FACE_LOOP(renderQuantizedMeshFacesCulledShaded, 1, 1, getMeshVertex, getMeshNormal)
+MESH_FACE_LOOP(renderQuantizedMeshFacesLit, 0, 2, getMeshVertex, getMeshNormal)
+MESH_FACE_LOOP(renderQuantizedMeshFacesCulledLit, 1, 2, getMeshVertex, getMeshNormal)
+
+void fillTriangle(Triangle triangle, float rr, float gg, float bb)
+{
+    // the triangle is filled one pixel row at a time, so no pre-rendered
+    // triangle sprites are needed and neighbouring triangles leave no holes
+    if (renderTarget)
     {
-        Triangle temp;
-        temp = triangle;
-        triangle.p2 = temp.p3;
-        triangle.p3 = temp.p2;
+        rasterizeTriangleToFrameBuffer(triangle, renderTarget, renderTarget->width, renderTarget->height, rr, gg, bb);
+        return;
     }
 
-    a = distance(triangle.p1.x, triangle.p1.y, triangle.p2.x, triangle.p2.y);
-    b = distance(triangle.p2.x, triangle.p2.y, triangle.p3.x, triangle.p3.y);
-    c = distance(triangle.p3.x, triangle.p3.y, triangle.p1.x, triangle.p1.y);
+    rasterizeTriangleToCanvas(triangle, NULL, screen.width, screen.height, rr, gg, bb);
+}
 
-    a2 = a * a;
-    b2 = b * b;
-    c2 = c * c;
+// Generates a triangle rasterizer that hands every covered pixel row
+// from x1 to x2 on row y to the SPAN statement. The spans are clipped
+// to the width, rows to the height. BEGIN runs once before the first
+// span, only for triangles that cover at least one pixel.
+#define RASTERIZE_TRIANGLE(NAME, BEGIN, SPAN)                                                   \
+void NAME(Triangle triangle, FrameBuffer *fb, short width, short height,                        \
+          unsigned char r, unsigned char g, unsigned char b)                                    \
+{                                                                                               \
+    int y, x1, x2, yStart, yEnd;                                                                \
+    float sampleY, xLong, xShort, longSlope, topSlope, bottomSlope, minX, maxX;                 \
+    Vector3 top = triangle.p1, mid = triangle.p2, bottom = triangle.p3, temp;                   \
+                                                                                                \
+    /* sort the vertices from top to bottom */                                                  \
+    if (mid.y < top.y)       { temp = top; top = mid;    mid = temp; }                          \
+    if (bottom.y < top.y)    { temp = top; top = bottom; bottom = temp; }                       \
+    if (bottom.y < mid.y)    { temp = mid; mid = bottom; bottom = temp; }                       \
+                                                                                                \
+    if (bottom.y - top.y <= 0.0f) return; /* zero height, nothing to fill */                    \
+                                                                                                \
+    /* a pixel row is covered if its center (y + 0.5) is inside the triangle */                 \
+    yStart = max(0, ceil(top.y - 0.5f));                                                        \
+    yEnd = min(height - 1, ceil(bottom.y - 0.5f) - 1);                                          \
+                                                                                                \
+    if (yStart > yEnd) return; /* between two pixel rows, or off the screen */                  \
+                                                                                                \
+    minX = (top.x < mid.x) ? top.x : mid.x;                                                     \
+    maxX = (top.x < mid.x) ? mid.x : top.x;                                                     \
+    if (bottom.x < minX) minX = bottom.x;                                                       \
+    if (bottom.x > maxX) maxX = bottom.x;                                                       \
+                                                                                                \
+    x1 = max(0, ceil(minX - 0.5f));                                                             \
+    x2 = min(width, ceil(maxX - 0.5f)) - 1;                                                     \
+                                                                                                \
+    if (x1 > x2) return; /* between two pixel columns, or off the screen */                     \
+                                                                                                \
+    /* distant triangles often have a single pixel center in their bounds, */                   \
+    /* one coverage test decides if it's drawn without the edge setup */                        \
+    if (x1 == x2 && yStart == yEnd)                                                             \
+    {                                                                                           \
+        if (!triangleCoversPixel(triangle, x1, yStart)) return;                                 \
+                                                                                                \
+        y = yStart;                                                                             \
+        BEGIN;                                                                                  \
+        SPAN;                                                                                   \
+        return;                                                                                 \
+    }                                                                                           \
+                                                                                                \
+    /* collinear vertices leave no area to fill */                                              \
+    if ((mid.x - top.x) * (bottom.y - top.y) == (mid.y - top.y) * (bottom.x - top.x)) return;   \
+                                                                                                \
+    longSlope = (bottom.x - top.x) / (bottom.y - top.y);                                        \
+    topSlope = (mid.y - top.y > 0.0f) ? (mid.x - top.x) / (mid.y - top.y) : 0.0f;               \
+    bottomSlope = (bottom.y - mid.y > 0.0f) ? (bottom.x - mid.x) / (bottom.y - mid.y) : 0.0f;   \
+                                                                                                \
+    BEGIN;                                                                                      \
+                                                                                                \
+    for (y = yStart; y <= yEnd; y++)                                                            \
+    {                                                                                           \
+        sampleY = y + 0.5f;                                                                     \
+        xLong = top.x + (sampleY - top.y) * longSlope;                                          \
+                                                                                                \
+        if (sampleY < mid.y)                                                                    \
+            xShort = top.x + (sampleY - top.y) * topSlope;                                      \
+        else                                                                                    \
+            xShort = mid.x + (sampleY - mid.y) * bottomSlope;                                   \
+                                                                                                \
+        /* same rule horizontally: fill the pixels whose centers are between the edges */       \
+        x1 = max(0, ceil(min(xLong, xShort) - 0.5f));                                           \
+        x2 = min(width, ceil(max(xLong, xShort) - 0.5f)) - 1;                                   \
+                                                                                                \
+        if (x1 <= x2)                                                                           \
+        {                                                                                       \
+            SPAN;                                                                               \
+        }                                                                                       \
+    }                                                                                           \
+}
 
-    ang1 = acos((a2 + c2 - b2) / max(0.0001f, (float)(2.0f*a*c))); // illegal division by 0
-    ang2 = acos((a2 + b2 - c2) / max(0.0001f, (float)(2.0f*a*b)));
-    ang3 = acos((b2 + c2 - a2) / max(0.0001f, (float)(2.0f*b*c)));
+RASTERIZE_TRIANGLE(rasterizeTriangleToFrameBuffer, ;, fillFrameBufferSpan(fb, y, x1, x2, r, g, b))
 
-    SET_TRIANGLE(0, 0, rr, gg, bb);
-    SendActivationEvent("tri.0");
+// on the canvas the pen is set only for triangles that draw something
+RASTERIZE_TRIANGLE(rasterizeTriangleToCanvas, setpen(r, g, b, 0, 1),
+    if (x1 == x2) putpixel(x1, y); else { moveto(x1, y); lineto(x2, y); })
 
-    switch (largestOf3(ang1, ang2, ang3))
-    {
-        case 0:
-            tri2 = triangle;
-            break;
+// the frame buffer and color parameters are unused, the span goes to visibilityBuffer
+RASTERIZE_TRIANGLE(rasterizeTriangleToVisibility, ;, writeVisibilitySpan(y, x1, x2))
 
-        case 1:
-            tri2.p1 = triangle.p2;
-            tri2.p2 = triangle.p3;
-            tri2.p3 = triangle.p1;
-            break;
+// draws like the frame buffer or canvas rasterizer, depending on fb, and counts the writes
+RASTERIZE_TRIANGLE(rasterizeTriangleCountingOverdraw, if (!fb) setpen(r, g, b, 0, 1),
+    countOverdrawSpan(overdrawStats, y, x1, x2);
+    if (fb) fillFrameBufferSpan(fb, y, x1, x2, r, g, b);
+    else if (x1 == x2) putpixel(x1, y); else { moveto(x1, y); lineto(x2, y); })
 
-        case 2:
-            tri2.p1 = triangle.p3;
-            tri2.p2 = triangle.p1;
-            tri2.p3 = triangle.p2;
-            break;
-    }
+int triangleCoversPixel(Triangle triangle, int x, int y)
+{
+    int i;
+    float area, edge, px = x + 0.5f, py = y + 0.5f;
+    Vector3 p[3], from, to;
 
-    a = distance(tri2.p1.x, tri2.p1.y, tri2.p2.x, tri2.p2.y);
-    b = distance(tri2.p2.x, tri2.p2.y, tri2.p3.x, tri2.p3.y);
-    c = distance(tri2.p3.x, tri2.p3.y, tri2.p1.x, tri2.p1.y);
+    p[0] = triangle.p1;
+    p[1] = triangle.p2;
+    p[2] = triangle.p3;
 
-    a2 = a * a;
-    b2 = b * b;
-    c2 = c * c;
+    area = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[1].y - p[0].y) * (p[2].x - p[0].x);
 
-    ang1 = acos((a2 + c2 - b2) / max(0.0001f, (float)(2.0f*a*c)));
-    ang2 = acos((a2 + b2 - c2) / max(0.0001f, (float)(2.0f*a*b)));
-    ang3 = acos((b2 + c2 - a2) / max(0.0001f, (float)(2.0f*b*c)));
+    if (area == 0.0f) return 0;
 
-    ang = degtorad(direction(tri2.p2.x, tri2.p2.y, tri2.p3.x, tri2.p3.y));
-    h = distance(tri2.p1.x, tri2.p1.y, tri2.p2.x, tri2.p2.y);
-    sideLength = cos(ang2) * h;
+    for (i = 0; i < 3; i++)
+    {
+        from = p[i];
+        to = p[(i + 1) % 3];
 
-    x = cos(ang) * sideLength;
-    y = sin(ang) * sideLength;
+        // positive on the inside of the edge, whichever way the triangle winds
+        edge = (to.x - from.x) * (py - from.y) - (to.y - from.y) * (px - from.x);
 
-    size = (ang3 <= PI / 4.0f)
-        ?distance(tri2.p2.x + x, tri2.p2.y - y, tri2.p3.x, tri2.p3.y)/triangleSize
-        :distance(tri2.p2.x + x, tri2.p2.y - y, tri2.p1.x, tri2.p1.y)/triangleSize;
+        if (area < 0.0f) edge = -edge;
 
-    SET_TRIANGLE((radtodeg(ang3) / 2.0f), (direction(tri2.p2.x + x, tri2.p2.y - y,
-                                                   tri2.p3.x, tri2.p3.y)/2.0f),
-                                                   rr, gg, bb);
+        if (edge < 0.0f) return 0;
 
-    // Draw around the triangle to fix holes left between triangles
-    /*setpen(rr, gg, bb, 0, 5);
-    moveto(tri2.p2.x + x, tri2.p2.y - y);
-    lineto(tri2.p1.x, tri2.p1.y);
-    lineto(tri2.p2.x, tri2.p2.y);
-    lineto(tri2.p3.x, tri2.p3.y);
-    lineto(tri2.p1.x, tri2.p1.y);*/
+        // a center exactly on an edge belongs to the triangle on its left or above it,
+        // like in the span rasterizer (screen y grows downwards, so a left edge goes up
+        // and a top edge goes right when the inside is positive)
+        if (edge == 0.0f)
+        {
+            if (area < 0.0f) { from = to; to = p[i]; }
+            if (!(to.y < from.y || (to.y == from.y && to.x > from.x))) return 0;
+        }
+    }
 
-    SendActivationEvent("tri.0");
-    draw_from("tri", tri2.p2.x + x, tri2.p2.y - y, size);
+    return 1;
+}
 
-    size = ((ang1 - (PI / 2.0f - ang3)) <= PI / 4.0f)
-        ?distance(tri2.p2.x + x, tri2.p2.y - y, tri2.p1.x, tri2.p1.y)/triangleSize
-        :distance(tri2.p2.x + x, tri2.p2.y - y, tri2.p2.x, tri2.p2.y)/triangleSize;
+void writeVisibilitySpan(int y, int x1, int x2)
+{
+    int x, offset = y * visibilityBuffer->width;
+    float z = visibilityDepth.x * (x1 + 0.5f) + visibilityDepth.y * (y + 0.5f) + visibilityDepth.z;
 
-     SET_TRIANGLE(((radtodeg(ang1) - (90.0f - radtodeg(ang3))) / 2.0f),
-        (direction(tri2.p2.x + x, tri2.p2.y - y,
-                        tri2.p1.x, tri2.p1.y)/2.0f),
-                        rr, gg, bb);
-    SendActivationEvent("tri.0");
-    draw_from("tri", tri2.p2.x + x, tri2.p2.y - y, size);
+    for (x = x1; x <= x2; x++, z += visibilityDepth.x)
+    {
+        if (z < visibilityBuffer->depth[offset + x])
+        {
+            visibilityBuffer->depth[offset + x] = z;
+            visibilityBuffer->ids[offset + x] = visibilityId;
+        }
+    }
 
-    /*setpen(rr, gg, bb, 0, 2);
-    moveto(tri2.p2.x + x, tri2.p2.y - y);
-    lineto(tri2.p1.x, tri2.p1.y);*/
-    //setpen(0, 255, 0, 0, 1);
+    visibilityBuffer->used = unionRect(visibilityBuffer->used, createRect(x1, y, x2, y));
 }
 
 void destroyMesh(Mesh *mesh)
 {
     if (!mesh) return;
 
+    free(mesh->name);
     free(mesh->vertices);
     free(mesh->vertexProjections);
     free(mesh->faces);
+    free(mesh->normals);
+    free(mesh->vertexNormals);
+    free(mesh->quantizedVertices);
+    free(mesh->quantizedNormals);
+    free(mesh->vertexLighting);
+    free(mesh->faceLighting);
+    freeMeshBVH(mesh);
+    freeMeshBSP(mesh);
     free(mesh);
 }
 
+void orderMeshFacesByBSP(TrianglePool *tp, Mesh *mesh, Vector3 invertedCamera)
+{
+    int i, node, slotCount = 0, faceCount = 0, stackSize = 0;
+    BSP *bsp = mesh->bsp;
+    BSPNode *n;
+
+    // the pool slots of the mesh's triangles, in pool order
+    for (i = 0; i < tp->triCount && slotCount < mesh->faceCount; i++)
+    {
+        if (tp->triangles[i].mesh == mesh && !tp->triangles[i].instance)
+            bsp->slots[slotCount++] = i;
+    }
+
+    if (slotCount < mesh->faceCount) // not in the pool, or only partly
+    {
+        bsp->slots[0] = -1;
+        return;
+    }
+
+    // in-order walk: the subtree on the far side of each plane first, then the
+    // plane's own faces, then the near side. Negative entries mark a node whose
+    // faces are to be emitted, positive ones a node still to be expanded.
+    bsp->stack[stackSize++] = 0;
+
+    while (stackSize > 0)
+    {
+        node = bsp->stack[--stackSize];
+
+        if (node < 0)
+        {
+            n = &bsp->nodes[-node - 1];
+
+            for (i = n->firstFace; i < n->firstFace + n->faceCount; i++)
+            {
+                bsp->drawOrder[faceCount++] = bsp->faceIndices[i];
+            }
+
+            continue;
+        }
+
+        n = &bsp->nodes[node];
+
+        // pushed in reverse, the far side gets popped first
+        if (dotProductVector3(n->normal, invertedCamera) >= n->d)
+        {
+            if (n->front >= 0) bsp->stack[stackSize++] = n->front;
+            bsp->stack[stackSize++] = -node - 1;
+            if (n->back >= 0) bsp->stack[stackSize++] = n->back;
+        }
+        else
+        {
+            if (n->back >= 0) bsp->stack[stackSize++] = n->back;
+            bsp->stack[stackSize++] = -node - 1;
+            if (n->front >= 0) bsp->stack[stackSize++] = n->front;
+        }
+    }
+
+    // the faces take over the mesh's slots from back to front, the face
+    // loop fills in the rest of the entries through the new pool indices
+    for (i = 0; i < faceCount; i++)
+    {
+        tp->triangles[bsp->slots[i]].face = &mesh->faces[bsp->drawOrder[i]];
+        mesh->faces[bsp->drawOrder[i]].poolIndex = bsp->slots[i];
+    }
+}
+
+void freeMeshBSP(Mesh *mesh)
+{
+    if (!mesh || !mesh->bsp) return;
+
+    free(mesh->bsp->nodes);
+    free(mesh->bsp->faceIndices);
+    free(mesh->bsp->stack);
+    free(mesh->bsp->drawOrder);
+    free(mesh->bsp->slots);
+    free(mesh->bsp);
+    mesh->bsp = NULL;
+}
+
+void freeMeshBVH(Mesh *mesh)
+{
+    if (!mesh || !mesh->bvh) return;
+
+    free(mesh->bvh->nodes);
+    free(mesh->bvh->faceIndices);
+    free(mesh->bvh);
+    mesh->bvh = NULL;
+}
+
 
 
 void createPool(TrianglePool *this, int maxTriCount)
@@ -742,6 +1733,7 @@ void createPool(TrianglePool *this, int maxTriCount)
 
         this->triCount = 0;
         this->maxTriCount = maxTriCount;
+        this->meshCount = 0;
     }
 }
 
@@ -751,6 +1743,8 @@ void addMeshFacesToPool(TrianglePool *tp, Mesh *mesh)
     {
         int i;
 
+        registerPoolMesh(tp, mesh);
+
         for (i = 0; i < mesh->faceCount; i++)
         {
             addTriangleToPool(tp, mesh, &mesh->faces[i]);
@@ -758,6 +1752,24 @@ void addMeshFacesToPool(TrianglePool *tp, Mesh *mesh)
     }
 }
 
+void registerPoolMesh(TrianglePool *tp, Mesh *mesh)
+{
+    int i;
+
+    for (i = 0; i < tp->meshCount; i++)
+    {
+        if (tp->meshes[i] == mesh) return;
+    }
+
+    if (tp->meshCount >= MAX_POOL_MESHES)
+    {
+        DEBUG_MSG_FROM("Failed: Too many meshes in the pool.", "registerPoolMesh");
+        return;
+    }
+
+    tp->meshes[tp->meshCount++] = mesh;
+}
+
 void addTriangleToPool(TrianglePool *tp, Mesh *mesh, Face *face)
 {
     if (tp && tp->triangles)
@@ -766,12 +1778,29 @@ void addTriangleToPool(TrianglePool *tp, Mesh *mesh, Face *face)
         temp->mesh = mesh;
         temp->drawState = 1;
         temp->face = face;
+        temp->instance = NULL;
         temp->shading = 0.0f;
         temp->faceDist = 0.0f;
         temp->face->poolIndex = tp->triCount++;
     }
 }
 
+void removeTriangleFromPool(TrianglePool *tp, int index)
+{
+    if (tp && tp->triangles && index < tp->triCount && index >= 0)
+    {
+        // the last triangle takes the place of the removed one, the
+        // pool gets sorted again anyway before the next time it's drawn
+        tp->triCount--;
+
+        if (index < tp->triCount)
+        {
+            tp->triangles[index] = tp->triangles[tp->triCount];
+            TRIANGLE_SLOT(&tp->triangles[index]) = index;
+        }
+    }
+}
+
 void setTriangleInPool(TrianglePool *tp, int index, short drawState, float shading, float faceDist)
 {
     if (tp && tp->triangles && index < tp->triCount && index >= 0)
@@ -788,33 +1817,212 @@ void resetTrianglePool(TrianglePool *tp)
     if (tp)
     {
         tp->triCount = 0;
+        tp->meshCount = 0;
     }
 }
 
+void clearRenderTarget(unsigned char r, unsigned char g, unsigned char b)
+{
+    if (!renderTarget) return;
+
+    // before anything is drawn this frame, the dirty rect is what last frame drew over
+    clearFrameBufferRect(renderTarget, getDirtyRect(&dirtyRegion, renderTarget->width, renderTarget->height), r, g, b);
+}
+
+void presentRenderTarget(short x, short y)
+{
+    if (!renderTarget) return;
+
+    // last frame's area is presented too, to erase what has moved away from it
+    presentFrameBuffer(renderTarget, getDirtyRect(&dirtyRegion, renderTarget->width, renderTarget->height), x, y);
+    endDirtyFrame(&dirtyRegion);
+}
+
 void drawTrianglesFromPool(TrianglePool *tp)
+{
+    if (!tp || !tp->triangles) return;
+
+    // diagnostics go first, they measure the painter's ordering of the pool
+    if (overdrawStats)
+    {
+        drawPoolCountingOverdraw(tp);
+        return;
+    }
+
+    if (renderTarget && visibilityBuffer)
+    {
+        drawPoolToVisibilityBuffer(tp, visibilityBuffer);
+        resolveVisibilityBuffer(tp, visibilityBuffer, renderTarget);
+        return;
+    }
+
+    // the render target and the present queue stay the same for the whole
+    // pass, so the loop variant is picked here instead of for every triangle
+    if (renderTarget)
+    {
+        if (presentQueue) drawPoolToFrameBufferPresenting(tp);
+        else drawPoolToFrameBuffer(tp);
+    }
+    else
+    {
+        if (presentQueue) drawPoolToCanvasPresenting(tp);
+        else drawPoolToCanvas(tp);
+    }
+
+    // resetTrianglePool(tp);
+}
+
+// Generates a triangle pool drawing loop. TO_FRAME_BUFFER selects between
+// the render target and the canvas, PRESENT whether the present queue is
+// given a step every PRESENT_STEP_INTERVAL triangles.
+#define DRAW_POOL(NAME, TO_FRAME_BUFFER, PRESENT)                                               \
+void NAME(TrianglePool *tp)                                                                     \
+{                                                                                               \
+    int i;                                                                                      \
+    unsigned char r, g, b;                                                                      \
+    Vector3 *projections;                                                                       \
+    Triangle tri;                                                                               \
+    TriangleObj *to;                                                                            \
+    FrameBuffer *fb = renderTarget;                                                             \
+                                                                                                \
+    for (i = 0; i < tp->triCount; i++)                                                          \
+    {                                                                                           \
+        to = &tp->triangles[i];                                                                 \
+                                                                                                \
+        if (PRESENT && !(i % PRESENT_STEP_INTERVAL))                                            \
+            stepPresentQueue(presentQueue);                                                     \
+                                                                                                \
+        if (!to->drawState) continue;                                                           \
+                                                                                                \
+        projections = TRIANGLE_PROJECTIONS(to);                                                 \
+        tri.p1 = projections[to->face->indices[0]];                                             \
+        tri.p2 = projections[to->face->indices[1]];                                             \
+        tri.p3 = projections[to->face->indices[2]];                                             \
+        SHADE_TRIANGLE(to, to->shading, r, g, b)                                                \
+                                                                                                \
+        if (TO_FRAME_BUFFER)                                                                    \
+            rasterizeTriangleToFrameBuffer(tri, fb, fb->width, fb->height, r, g, b);            \
+        else                                                                                    \
+            rasterizeTriangleToCanvas(tri, NULL, screen.width, screen.height, r, g, b);         \
+    }                                                                                           \
+}
+
+DRAW_POOL(drawPoolToFrameBuffer, 1, 0)
+DRAW_POOL(drawPoolToFrameBufferPresenting, 1, 1)
+DRAW_POOL(drawPoolToCanvas, 0, 0)
+DRAW_POOL(drawPoolToCanvasPresenting, 0, 1)
+
+void drawPoolCountingOverdraw(TrianglePool *tp)
 {
     int i;
+    unsigned char r, g, b;
+    Vector3 *projections;
     Triangle tri;
-    TriangleObj to;
+    TriangleObj *to;
+    FrameBuffer *fb = renderTarget;
 
-    if (tp && tp->triangles)
+    beginOverdrawFrame(overdrawStats);
+
+    for (i = 0; i < tp->triCount; i++)
     {
-        for (i = 0; i < tp->triCount; i++)
+        to = &tp->triangles[i];
+
+        if (presentQueue && !(i % PRESENT_STEP_INTERVAL))
+            stepPresentQueue(presentQueue);
+
+        if (!to->drawState) continue;
+
+        projections = TRIANGLE_PROJECTIONS(to);
+        tri.p1 = projections[to->face->indices[0]];
+        tri.p2 = projections[to->face->indices[1]];
+        tri.p3 = projections[to->face->indices[2]];
+        SHADE_TRIANGLE(to, to->shading, r, g, b)
+
+        rasterizeTriangleCountingOverdraw(tri, fb, fb ? fb->width : screen.width, fb ? fb->height : screen.height, r, g, b);
+        endOverdrawTriangle(overdrawStats);
+    }
+
+    finishOverdrawFrame(overdrawStats);
+}
+
+void drawPoolToVisibilityBuffer(TrianglePool *tp, VisibilityBuffer *vb)
+{
+    int i;
+    Vector3 edge1, edge2, normal, *projections;
+    Triangle tri;
+    TriangleObj *to;
+
+    clearVisibilityBuffer(vb);
+
+    // the depth test decides what is visible, so the pool doesn't need to be sorted
+    for (i = 0; i < tp->triCount; i++)
+    {
+        to = &tp->triangles[i];
+
+        if (presentQueue && !(i % PRESENT_STEP_INTERVAL))
+            stepPresentQueue(presentQueue);
+
+        if (!to->drawState) continue;
+
+        projections = TRIANGLE_PROJECTIONS(to);
+        tri.p1 = projections[to->face->indices[0]];
+        tri.p2 = projections[to->face->indices[1]];
+        tri.p3 = projections[to->face->indices[2]];
+
+        // triangles reaching outside of the depth range have no meaningful depth
+        if (tri.p1.z < 0.0f || tri.p1.z > 1.0f || tri.p2.z < 0.0f || tri.p2.z > 1.0f ||
+            tri.p3.z < 0.0f || tri.p3.z > 1.0f)
+            continue;
+
+        // the depth changes linearly over the screen, along the plane of the projected triangle
+        edge1 = subtractVector3(tri.p2, tri.p1);
+        edge2 = subtractVector3(tri.p3, tri.p1);
+        normal = crossProductVector3(edge1, edge2);
+
+        if (normal.z > -0.000001f && normal.z < 0.000001f) continue; // seen edge-on
+
+        visibilityDepth.x = -normal.x / normal.z;
+        visibilityDepth.y = -normal.y / normal.z;
+        visibilityDepth.z = tri.p1.z - visibilityDepth.x * tri.p1.x - visibilityDepth.y * tri.p1.y;
+        visibilityId = i + 1;
+
+        rasterizeTriangleToVisibility(tri, NULL, vb->width, vb->height, 0, 0, 0);
+    }
+}
+
+void resolveVisibilityBuffer(TrianglePool *tp, VisibilityBuffer *vb, FrameBuffer *fb)
+{
+    int x, y, offset;
+    unsigned int id;
+    float shading;
+    Vector3 normal, eye;
+    Rect rect = clipRect(vb->used, fb->width, fb->height);
+    TriangleObj *to;
+    unsigned char *p;
+
+    // every covered pixel is shaded once, however many triangles were drawn over it
+    for (y = rect.y1; y <= rect.y2; y++)
+    {
+        offset = y * vb->width;
+        p = &fb->pixels[3 * (y * fb->width + rect.x1)];
+
+        for (x = rect.x1; x <= rect.x2; x++, p += 3)
         {
-            to = tp->triangles[i];
+            if (!(id = vb->ids[offset + x])) continue;
 
-            if (to.drawState)
-            {
-                tri.p1 = to.mesh->vertexProjections[to.face->indices[0]];
-                tri.p2 = to.mesh->vertexProjections[to.face->indices[1]];
-                tri.p3 = to.mesh->vertexProjections[to.face->indices[2]];
+            to = &tp->triangles[id - 1];
+            normal = getMeshNormal(to->mesh, to->face->normal);
+            eye = to->instance ? to->instance->objectSpaceCamera : to->mesh->objectSpaceCamera;
 
-                fillTriangle(tri, 0.0f, floor(255.0f * to.shading), 0.0f);
-            }
+            // renderMesh has updated the lighting of the meshes drawn this frame
+            if (!to->instance && lightSet.count && to->mesh->lightingVersion == lightSet.version)
+                shading = to->mesh->faceLighting[to->face - to->mesh->faces];
+            else
+                shading = max(0.0f, dotProductVector3(normal, eye) / magnitudeVector3(eye));
+
+            SHADE_TRIANGLE(to, shading, p[0], p[1], p[2])
         }
     }
-
-    // resetTrianglePool(tp);
 }
 
 void sortTrianglePoolInsertion(TrianglePool *tp)
@@ -831,9 +2039,9 @@ void sortTrianglePoolInsertion(TrianglePool *tp)
         {
             temp = tp->triangles[j - 1];
             tp->triangles[j - 1] = tp->triangles[j];
-            tp->triangles[j - 1].face->poolIndex = j - 1;
+            TRIANGLE_SLOT(&tp->triangles[j - 1]) = j - 1;
             tp->triangles[j] = temp;
-            tp->triangles[j].face->poolIndex = j;
+            TRIANGLE_SLOT(&tp->triangles[j]) = j;
             j--;
         }
 
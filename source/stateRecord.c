@@ -0,0 +1,334 @@
+#define STATE_RECORD_VERSION 2
+
+// the parts of the state a frame of the recording holds, only the ones that changed
+#define STATE_FLAGS           (1 << 0) // flags
+#define STATE_MODE            (1 << 1) // mode
+#define STATE_CAMERA_POSITION (1 << 2)
+#define STATE_CAMERA_TARGET   (1 << 3)
+#define STATE_MESH_POSITION   (1 << 4)
+#define STATE_MESH_ORIENTATION (1 << 5) // the orientation matrix, however it was built
+#define STATE_MESH_ROTATION    (1 << 6) // the rotation renderMesh applies to the orientation next
+#define STATE_ALL              0x7f
+
+typedef struct RecordedStateStruct
+{
+    unsigned int flags;
+    short mode;
+    Vector3 cameraPosition;
+    Vector3 cameraTarget;
+    Vector3 meshPosition;
+    Matrix4x4 meshOrientation;
+    Vector3 meshRotation;
+}RecordedState;
+
+typedef struct StateRecorderStruct
+{
+    FILE *file;
+    Camera *camera;
+    Mesh *mesh;
+    RecordedState last; // the state as written so far
+    int frameCount;
+}StateRecorder;
+
+typedef struct StateReplayStruct
+{
+    Camera *camera;
+    Mesh *mesh;
+
+    unsigned char *data; // the whole recording, so that replaying doesn't wait for the disk
+    long size;
+    long offset;
+
+    int frameCount;
+    int currentFrame;
+    float *frameTimes;   // milliseconds spent on each replayed frame
+}StateReplay;
+
+StateRecorder *startStateRecording(char fileName[256], Camera *camera, Mesh *mesh);
+void getCurrentState(Camera *camera, Mesh *mesh, RecordedState *state);
+int recordFrameState(StateRecorder *rec);
+int stopStateRecording(StateRecorder *rec);
+StateReplay *openStateReplay(char fileName[256], Camera *camera, Mesh *mesh);
+int readReplayBytes(StateReplay *rp, void *dst, long size);
+int applyNextFrameState(StateReplay *rp);
+int runStateReplay(StateReplay *rp, Screen *screen, int maxFrames);
+void rewindStateReplay(StateReplay *rp);
+void reportStateReplay(StateReplay *rp);
+void destroyStateReplay(StateReplay *rp);
+
+StateRecorder *startStateRecording(char fileName[256], Camera *camera, Mesh *mesh)
+{
+    int header[2];
+    StateRecorder *ptr = NULL;
+
+    if (!camera || !mesh) return NULL;
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr) return NULL;
+
+    if (!(ptr->file = fopen(fileName, "wb")))
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't open the recording file.", "startStateRecording");
+        free(ptr);
+        return NULL;
+    }
+
+    // the frame count is filled in by stopStateRecording
+    header[0] = STATE_RECORD_VERSION;
+    header[1] = 0;
+
+    if (fwrite("S3RC", 1, 4, ptr->file) != 4 || fwrite(header, sizeof header, 1, ptr->file) != 1)
+    {
+        fclose(ptr->file);
+        free(ptr);
+        return NULL;
+    }
+
+    ptr->camera = camera;
+    ptr->mesh = mesh;
+    ptr->frameCount = 0;
+
+    return ptr;
+}
+
+void getCurrentState(Camera *camera, Mesh *mesh, RecordedState *state)
+{
+    state->flags = flags;
+    state->mode = mode;
+    state->cameraPosition = camera->position;
+    state->cameraTarget = camera->target;
+    state->meshPosition = mesh->position;
+    state->meshOrientation = mesh->orientation;
+    state->meshRotation = mesh->rotation;
+}
+
+int recordFrameState(StateRecorder *rec)
+{
+    unsigned char changes = 0;
+    RecordedState state, *last;
+    FILE *f;
+
+    if (!rec || !rec->file) return -1;
+
+    f = rec->file;
+    last = &rec->last;
+    getCurrentState(rec->camera, rec->mesh, &state);
+
+    // the first frame holds the whole state, the rest only what changed,
+    // a frame where nothing changed takes one byte
+    if (!rec->frameCount) changes = STATE_ALL;
+    else
+    {
+        if (state.flags != last->flags) changes |= STATE_FLAGS;
+        if (state.mode != last->mode) changes |= STATE_MODE;
+        if (memcmp(&state.cameraPosition, &last->cameraPosition, sizeof state.cameraPosition)) changes |= STATE_CAMERA_POSITION;
+        if (memcmp(&state.cameraTarget, &last->cameraTarget, sizeof state.cameraTarget)) changes |= STATE_CAMERA_TARGET;
+        if (memcmp(&state.meshPosition, &last->meshPosition, sizeof state.meshPosition)) changes |= STATE_MESH_POSITION;
+        if (memcmp(&state.meshOrientation, &last->meshOrientation, sizeof state.meshOrientation)) changes |= STATE_MESH_ORIENTATION;
+        if (memcmp(&state.meshRotation, &last->meshRotation, sizeof state.meshRotation)) changes |= STATE_MESH_ROTATION;
+    }
+
+    if (fwrite(&changes, 1, 1, f) != 1 ||
+        ((changes & STATE_FLAGS) && fwrite(&state.flags, sizeof state.flags, 1, f) != 1) ||
+        ((changes & STATE_MODE) && fwrite(&state.mode, sizeof state.mode, 1, f) != 1) ||
+        ((changes & STATE_CAMERA_POSITION) && fwrite(&state.cameraPosition, sizeof state.cameraPosition, 1, f) != 1) ||
+        ((changes & STATE_CAMERA_TARGET) && fwrite(&state.cameraTarget, sizeof state.cameraTarget, 1, f) != 1) ||
+        ((changes & STATE_MESH_POSITION) && fwrite(&state.meshPosition, sizeof state.meshPosition, 1, f) != 1) ||
+        ((changes & STATE_MESH_ORIENTATION) && fwrite(&state.meshOrientation, sizeof state.meshOrientation, 1, f) != 1) ||
+        ((changes & STATE_MESH_ROTATION) && fwrite(&state.meshRotation, sizeof state.meshRotation, 1, f) != 1))
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't write a frame.", "recordFrameState");
+        return -2;
+    }
+
+    // renderMesh uses the rotation up, so the next frame's rotation is compared to none
+    *last = state;
+    last->meshRotation = createVector3(0.0f, 0.0f, 0.0f);
+    rec->frameCount++;
+
+    return 0;
+}
+
+int stopStateRecording(StateRecorder *rec)
+{
+    int result = 0;
+
+    if (!rec) return -1;
+
+    if (fseek(rec->file, 4 + sizeof(int), SEEK_SET) ||
+        fwrite(&rec->frameCount, sizeof rec->frameCount, 1, rec->file) != 1)
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't write the frame count.", "stopStateRecording");
+        result = -2;
+    }
+
+    fclose(rec->file);
+    free(rec);
+
+    return result;
+}
+
+StateReplay *openStateReplay(char fileName[256], Camera *camera, Mesh *mesh)
+{
+    int header[2];
+    FILE *f;
+    StateReplay *ptr = NULL;
+
+    if (!camera || !mesh) return NULL;
+
+    if (!(f = fopen(fileName, "rb")))
+    {
+        DEBUG_MSG_FROM("Failed: Couldn't open the recording.", "openStateReplay");
+        return NULL;
+    }
+
+    ptr = malloc(sizeof *ptr);
+
+    if (!ptr)
+    {
+        fclose(f);
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    ptr->size = ftell(f) - 4 - sizeof header;
+    fseek(f, 0, SEEK_SET);
+
+    ptr->data = (ptr->size > 0) ? malloc(ptr->size) : NULL;
+    ptr->frameTimes = NULL;
+
+    if (!ptr->data || fread(header, 1, 4, f) != 4 || memcmp(header, "S3RC", 4) ||
+        fread(header, sizeof header, 1, f) != 1 || header[0] != STATE_RECORD_VERSION || header[1] <= 0 ||
+        fread(ptr->data, 1, ptr->size, f) != (size_t)ptr->size)
+    {
+        DEBUG_MSG_FROM("Failed: Not a complete recording.", "openStateReplay");
+        fclose(f);
+        destroyStateReplay(ptr);
+        return NULL;
+    }
+
+    fclose(f);
+
+    ptr->frameCount = header[1];
+    ptr->frameTimes = malloc(sizeof *(ptr->frameTimes) * ptr->frameCount);
+
+    if (!ptr->frameTimes)
+    {
+        destroyStateReplay(ptr);
+        return NULL;
+    }
+
+    ptr->camera = camera;
+    ptr->mesh = mesh;
+    rewindStateReplay(ptr);
+
+    return ptr;
+}
+
+int readReplayBytes(StateReplay *rp, void *dst, long size)
+{
+    if (rp->offset + size > rp->size) return -1;
+
+    memcpy(dst, &rp->data[rp->offset], size);
+    rp->offset += size;
+
+    return 0;
+}
+
+int applyNextFrameState(StateReplay *rp)
+{
+    unsigned char changes;
+
+    if (!rp || rp->currentFrame >= rp->frameCount) return 0;
+
+    if (readReplayBytes(rp, &changes, 1) ||
+        ((changes & STATE_FLAGS) && readReplayBytes(rp, &flags, sizeof flags)) ||
+        ((changes & STATE_MODE) && readReplayBytes(rp, &mode, sizeof mode)) ||
+        ((changes & STATE_CAMERA_POSITION) && readReplayBytes(rp, &rp->camera->position, sizeof rp->camera->position)) ||
+        ((changes & STATE_CAMERA_TARGET) && readReplayBytes(rp, &rp->camera->target, sizeof rp->camera->target)) ||
+        ((changes & STATE_MESH_POSITION) && readReplayBytes(rp, &rp->mesh->position, sizeof rp->mesh->position)) ||
+        ((changes & STATE_MESH_ORIENTATION) && readReplayBytes(rp, &rp->mesh->orientation, sizeof rp->mesh->orientation)) ||
+        ((changes & STATE_MESH_ROTATION) && readReplayBytes(rp, &rp->mesh->rotation, sizeof rp->mesh->rotation)))
+    {
+        DEBUG_MSG_FROM("Failed: The recording ends in the middle of a frame.", "applyNextFrameState");
+        rp->currentFrame = rp->frameCount;
+        return 0;
+    }
+
+    rp->currentFrame++;
+
+    return 1;
+}
+
+int runStateReplay(StateReplay *rp, Screen *screen, int maxFrames)
+{
+    int rendered = 0;
+    clock_t start;
+
+    if (!rp || !screen) return -1;
+
+    // the frames are drawn back to back, into renderTarget when it's set and on
+    // the canvas otherwise, 0 or fewer maxFrames runs the rest of the recording
+    while (rp->currentFrame < rp->frameCount && (maxFrames <= 0 || rendered < maxFrames))
+    {
+        start = clock();
+
+        if (!applyNextFrameState(rp)) break;
+
+        if (renderTarget) clearFrameBuffer(renderTarget, 0, 0, 0);
+
+        renderMesh(screen, rp->camera, rp->mesh);
+        sortTrianglePoolInsertion(&trianglePool);
+        drawTrianglesFromPool(&trianglePool);
+
+        rp->frameTimes[rp->currentFrame - 1] = (clock() - start) * 1000.0f / CLOCKS_PER_SEC;
+        rendered++;
+    }
+
+    return rendered;
+}
+
+void rewindStateReplay(StateReplay *rp)
+{
+    int i;
+
+    if (!rp) return;
+
+    rp->offset = 0;
+    rp->currentFrame = 0;
+
+    for (i = 0; i < rp->frameCount; i++)
+    {
+        rp->frameTimes[i] = 0.0f;
+    }
+}
+
+void reportStateReplay(StateReplay *rp)
+{
+    int i, slowest = 0;
+    float total = 0.0f;
+    char msg[256] = "";
+
+    if (!rp || !rp->currentFrame) return;
+
+    for (i = 0; i < rp->currentFrame; i++)
+    {
+        total += rp->frameTimes[i];
+
+        if (rp->frameTimes[i] > rp->frameTimes[slowest]) slowest = i;
+    }
+
+    sprintf(msg, "frames %d, total %.1f ms, mean %.3f ms, slowest %.3f ms (frame %d)",
+            rp->currentFrame, total, total / rp->currentFrame, rp->frameTimes[slowest], slowest);
+    DEBUG_MSG_FROM(msg, "reportStateReplay");
+}
+
+void destroyStateReplay(StateReplay *rp)
+{
+    if (!rp) return;
+
+    free(rp->data);
+    free(rp->frameTimes);
+    free(rp);
+}